@@ -50,7 +50,10 @@ int main()
 		cpp_jcfu::InstrType::RET_OBJ{}
 	);
 
-	const std::vector<uint8_t> out = cpp_jcfu::gen(
+	std::ofstream outF("out/HelloWorld.class", std::ios::binary);
+	cpp_jcfu::OStreamSink sink{ outF };
+
+	cpp_jcfu::gen(sink,
 		cpp_jcfu::ClassFlags_SUPER | cpp_jcfu::ClassFlags_PUBLIC,
 		"HelloWorld",
 		"java/lang/Object",
@@ -96,9 +99,6 @@ int main()
 		}
 	);
 
-	std::ofstream outF("out/HelloWorld.class", std::ios::binary);
-
-	outF.write((const char*)out.data(), out.size());
 	outF.close();
 
 	return 0;
@@ -0,0 +1,139 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <span>
+#include <string_view>
+#include <bit>
+#include <concepts>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+namespace cpp_jcfu
+{
+	namespace detail {
+		template<std::unsigned_integral T>
+		constexpr T toBigEndian(const T v)
+		{
+			if constexpr (sizeof(T) == 1 || std::endian::native == std::endian::big)
+				return v;
+			else
+			{
+#ifdef __cpp_lib_byteswap
+				return std::byteswap(v);
+#else
+				T ret = 0;
+				for (size_t i = 0; i < sizeof(T); i++)
+					ret |= T((v >> (i * 8)) & 0xFF) << ((sizeof(T) - 1 - i) * 8);
+				return ret;
+#endif
+			}
+		}
+	}
+
+	// A big endian output buffer with a cursor
+	//
+	// ensure(n) makes room for n more bytes, after that every write is a single
+	// store, that is only bounds checked in debug builds (_ASSERT).
+	// Write sizes that are known upfront with one ensure, not per value.
+	class ByteWriter
+	{
+		std::vector<uint8_t> buf;//Its size is the capacity, pos is the real size
+		size_t pos = 0;
+
+		template<std::unsigned_integral T>
+		void put(const T v)
+		{
+			_ASSERT(buf.size() - pos >= sizeof(T));
+			const T be = detail::toBigEndian(v);
+			std::memcpy(buf.data() + pos, &be, sizeof(T));
+			pos += sizeof(T);
+		}
+	public:
+		ByteWriter() = default;
+		explicit ByteWriter(const size_t capacity) {
+			buf.resize(capacity);
+		}
+
+		// Makes sure n more bytes can be written without checks
+		void ensure(const size_t n)
+		{
+			if (buf.size() - pos >= n)
+				return;
+			buf.resize(std::max(pos + n, buf.size() * 2));
+		}
+
+		// Unchecked, call ensure first
+
+		void u8(const uint8_t v) {
+			_ASSERT(pos < buf.size());
+			buf[pos++] = v;
+		}
+		void u16(const uint16_t v) { put(v); }
+		void u32(const uint32_t v) { put(v); }
+		void u64(const uint64_t v) { put(v); }
+		void bytes(const std::span<const uint8_t> src)
+		{
+			_ASSERT(buf.size() - pos >= src.size());
+			if (!src.empty())
+				std::memcpy(buf.data() + pos, src.data(), src.size());
+			pos += src.size();
+		}
+		void bytes(const std::string_view src) {
+			bytes(std::span((const uint8_t*)src.data(), src.size()));
+		}
+		void fill(const size_t n, const uint8_t v)
+		{
+			_ASSERT(buf.size() - pos >= n);
+			std::memset(buf.data() + pos, v, n);
+			pos += n;
+		}
+
+		// For writing a size that is only known after writing, call ensure(maxSize) first
+		uint8_t* tail() { return buf.data() + pos; }
+		void advance(const size_t n)
+		{
+			_ASSERT(buf.size() - pos >= n);
+			pos += n;
+		}
+		// Bytes that can be written without ensure
+		size_t spare() const { return buf.size() - pos; }
+
+		// Offset must be inside the written bytes
+
+		void patch16(const size_t offset, const uint16_t v)
+		{
+			_ASSERT(offset + 2 <= pos);
+			const uint16_t be = detail::toBigEndian(v);
+			std::memcpy(buf.data() + offset, &be, 2);
+		}
+		void patch32(const size_t offset, const uint32_t v)
+		{
+			_ASSERT(offset + 4 <= pos);
+			const uint32_t be = detail::toBigEndian(v);
+			std::memcpy(buf.data() + offset, &be, 4);
+		}
+		size_t size() const { return pos; }
+		bool empty() const { return pos == 0; }
+		uint8_t* data() { return buf.data(); }
+		const uint8_t* data() const { return buf.data(); }
+		uint8_t& operator[](const size_t i) { return buf[i]; }
+		uint8_t operator[](const size_t i) const { return buf[i]; }
+		std::span<const uint8_t> view() const { return { buf.data(), pos }; }
+
+		// Keeps the memory
+		void clear() { pos = 0; }
+		// @returns the written bytes, leaving this empty
+		std::vector<uint8_t> take()
+		{
+			buf.resize(pos);
+			pos = 0;
+			std::vector<uint8_t> ret = std::move(buf);
+			buf.clear();
+			return ret;
+		}
+	};
+}
@@ -0,0 +1,110 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <string_view>
+
+#include "State.hpp"
+#include "ConstPool.hpp"
+#include "Gen.hpp"
+#include "InstrCompiler.hpp"
+#include "CodeBuilder.hpp"
+#include "InstrOptimizer.hpp"
+
+namespace cpp_jcfu
+{
+	// Owns the pool, and every scratch buffer of gen & compileCode
+	// Reuse one for many classes (clear() between them), to reach a state where
+	// generating a class doesnt allocate anything, besides what it returns.
+	//
+	// Usage, per class:
+	//	ctx.clear();
+	//	... push consts, or orderLdcConsts(ctx.poolSize, ctx.consts, ...) ...
+	//	FuncTag code = compileCode(ctx, data);
+	//	gen(ctx, sink, flags, "A", "java/lang/Object", funcs, fields);
+	struct ClassGenContext
+	{
+		ConstPool consts;
+		size_t poolSize = 1;
+
+		CodeCompileScratch code;
+		InstrOptScratch opt;
+		InstrBuffer instrs;// For compileCode(ctx, ctx.instrs, data), if you build code that way
+		ClassSections sections;
+		ConstPoolLayout layout;
+
+		// Keeps all the memory
+		void clear()
+		{
+			consts.clear();
+			poolSize = 1;
+			code.clear();
+			opt.clear();
+			instrs.clear();
+			sections.head.clear();
+			sections.body.clear();
+			layout.children.clear();
+		}
+	};
+
+	inline FuncTagType::CODE compileCode(
+		ClassGenContext& ctx,
+		const CodeCompileData& data
+	)
+	{
+		return compileCodeWith(
+			[&](const ConstPoolEntry& e) { return constPoolPush(ctx.poolSize, ctx.consts, e); },
+			data, ctx.code);
+	}
+	inline FuncTagType::CODE compileCode(
+		ClassGenContext& ctx,
+		const InstrBuffer& buf,
+		const CodeCompileData& data
+	)
+	{
+		return compileCodeWith(
+			[&](const ConstPoolEntry& e) { return constPoolPush(ctx.poolSize, ctx.consts, e); },
+			buf, data, ctx.code);
+	}
+	// Pushes into ctx's pool, and uses its scratch, so nothing else can compile until its finished
+	inline auto newCodeBuilder(ClassGenContext& ctx, const RefTable* refs = nullptr)
+	{
+		return CodeBuilder(
+			[&ctx](const ConstPoolEntry& e) { return constPoolPush(ctx.poolSize, ctx.consts, e); },
+			ctx.code, refs);
+	}
+
+	// Runs InstrOptimizer passes in order, with ctx's scratch
+	// Usage: optimizeInstrs<foldConstInstrs, threadJumps, peepholeInstrs>(ctx, instrs, errorHandlers, data);
+	template<auto... Passes>
+	inline InstrOptStats optimizeInstrs(
+		ClassGenContext& ctx,
+		std::vector<Instr>& instrs,
+		std::vector<ErrorHandler>& errorHandlers,
+		CodeCompileData& data
+	)
+	{
+		InstrOptStats ret;
+		((ret += Passes(instrs, errorHandlers, data, ctx.opt)), ...);
+		return ret;
+	}
+
+	// Uses ctx.consts as the pool, call ctx.clear() before the next class
+	template<ClassSink Sink>
+	inline void gen(
+		ClassGenContext& ctx,
+		Sink& sink,
+		const ClassFlags thisClassFlags,
+		const std::string_view thisClass,
+		const std::string_view superClass,
+		const Functions& funcs,
+		const Fields& fields)
+	{
+		genSections(ctx.sections, ctx.layout, thisClassFlags, thisClass, superClass, ctx.consts, funcs, fields);
+
+		const std::span<const uint8_t> parts[] = { ctx.sections.head.view(), ctx.sections.body.view() };
+		sink.write(parts);
+	}
+}
@@ -0,0 +1,155 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <span>
+#include <ostream>
+#include <concepts>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#if __has_include(<sys/uio.h>)
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#define _CPP_JCFU__HAS_WRITEV
+#elif __has_include(<io.h>)
+#include <io.h>
+#endif
+
+namespace cpp_jcfu
+{
+	// The sections of a class, in file order
+	using ClassParts = std::span<const std::span<const uint8_t>>;
+
+	// Where gen(sink, ...) puts the class file
+	// write() is called once, with every part of the class
+	template<class T>
+	concept ClassSink = requires(T& sink, const ClassParts parts) {
+		sink.write(parts);
+	};
+
+	inline size_t classPartsSize(const ClassParts parts)
+	{
+		size_t ret = 0;
+		for (const std::span<const uint8_t> part : parts)
+			ret += part.size();
+		return ret;
+	}
+
+	// Appends to a vector, growing it at most once
+	struct VecSink
+	{
+		std::vector<uint8_t>& out;
+
+		void write(const ClassParts parts)
+		{
+			out.reserve(out.size() + classPartsSize(parts));
+			for (const std::span<const uint8_t> part : parts)
+				out.insert(out.end(), part.begin(), part.end());
+		}
+	};
+
+	// Writes into memory owned by the caller
+	// If the class doesnt fit, nothing is written, and overflowed is set
+	struct SpanSink
+	{
+		std::span<uint8_t> out;
+		size_t written = 0;
+		bool overflowed = false;
+
+		void write(const ClassParts parts)
+		{
+			if (classPartsSize(parts) > out.size() - written)
+			{
+				overflowed = true;
+				return;
+			}
+			for (const std::span<const uint8_t> part : parts)
+			{
+				if (part.empty())
+					continue;
+				std::memcpy(out.data() + written, part.data(), part.size());
+				written += part.size();
+			}
+		}
+	};
+
+	// Writes to a file descriptor, every part is written in place (writev, if there is one)
+	// If a write fails, failed is set, and errno tells why
+	struct FdSink
+	{
+		int fd;
+		bool failed = false;
+
+#ifdef _CPP_JCFU__HAS_WRITEV
+		void write(const ClassParts parts)
+		{
+			std::vector<iovec> iovs;
+			iovs.reserve(parts.size());
+			for (const std::span<const uint8_t> part : parts)
+			{
+				if (!part.empty())
+					iovs.push_back({ (void*)part.data(), part.size() });
+			}
+			size_t first = 0;
+			while (first < iovs.size())
+			{
+				const int count = (int)std::min<size_t>(iovs.size() - first, IOV_MAX);
+				const ssize_t res = ::writev(fd, iovs.data() + first, count);
+				if (res < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					failed = true;
+					return;
+				}
+				// Skip what was written, it might stop in the middle of a part
+				size_t done = (size_t)res;
+				while (first < iovs.size() && done >= iovs[first].iov_len)
+					done -= iovs[first++].iov_len;
+				if (done != 0)
+				{
+					iovs[first].iov_base = (uint8_t*)iovs[first].iov_base + done;
+					iovs[first].iov_len -= done;
+				}
+			}
+		}
+#else
+		void write(const ClassParts parts)
+		{
+			for (const std::span<const uint8_t> part : parts)
+			{
+				size_t done = 0;
+				while (done < part.size())
+				{
+					const unsigned int chunk = (unsigned int)std::min<size_t>(part.size() - done, INT32_MAX);
+					const int res = ::_write(fd, part.data() + done, chunk);
+					if (res <= 0)
+					{
+						failed = true;
+						return;
+					}
+					done += (size_t)res;
+				}
+			}
+		}
+#endif
+	};
+
+	// Writes to a stream, check the streams state for errors
+	struct OStreamSink
+	{
+		std::ostream& out;
+
+		void write(const ClassParts parts)
+		{
+			for (const std::span<const uint8_t> part : parts)
+				out.write((const char*)part.data(), (std::streamsize)part.size());
+		}
+	};
+}
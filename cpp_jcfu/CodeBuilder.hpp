@@ -0,0 +1,221 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <algorithm>
+
+#include "State.hpp"
+#include "InstrCompiler.hpp"
+#include "Fragment.hpp"
+
+namespace cpp_jcfu
+{
+	// Encodes each instruction into the bytecode as its emitted, for frontends
+	// that go straight from their AST to bytecode, without a std::vector<Instr>.
+	// Fixed idioms can be emitted as a BytecodeFragment, which is a memcpy.
+	//
+	// Branches can count instructions (like BaseBranch::jmpOffset), or target a Label.
+	// Forward ones are patched in finish(), where labels are looked up in a flat table.
+	// Backward ones keep a patch point too, as widening a far forward branch can move them.
+	//
+	// Like compileCode with a InstrBuffer, the code is never analyzed, so
+	// finish() needs data.maxStack, and calcFrames cant be used.
+	// A SWITCH is always a single tableswitch / lookupswitch, as splitting it
+	// might need the code to be emitted a second time.
+	//
+	// Usage:
+	//	CodeBuilder b(poolPush, scratch, &refs);
+	//	const Label end = b.newLabel();
+	//	b.emit(InstrType::PUSH_I32_I32{ 5 });
+	//	b.branch(InstrId::IF_EQL, end);
+	//	...
+	//	b.bind(end);
+	//	FuncTagType::CODE code = b.finish(data);
+	template<class PoolPush>
+	class CodeBuilder
+	{
+		PoolPush poolPush;// (const ConstPoolEntry&) -> uint16_t pool index
+		CodeCompileScratch& scratch;
+		const RefTable* refs;
+
+		SwitchEmitState sw{ .plainOnly = true };
+		size_t curInstrOffset = 0;
+		size_t localsEnd = 0;
+
+		uint16_t beginInstr()
+		{
+			const uint16_t i = nextInstr();
+			_ASSERT(i < UINT16_MAX - 1);
+			scratch.instrOffsets.push_back(0);
+			// Switches ensure their own size
+			scratch.out.ensure(MAX_FIXED_INSTR_SIZE);
+			return i;
+		}
+		/// @returns cases, with the label ids as jmpOffsets
+		std::span<const SwitchCase> labelCasesOf(const std::span<const LabelCase> cases)
+		{
+			std::vector<SwitchCase>& ret = scratch.labelCases;
+			ret.clear();
+			for (const LabelCase& kase : cases)
+				ret.push_back({ kase.k, int32_t(kase.target.id) });
+			return ret;
+		}
+		void emitFragment(const FragmentView frag, const auto& poolIdxOf)
+		{
+			const uint16_t i = nextInstr();
+			_ASSERT(i < UINT16_MAX - 1);
+			_ASSERT(curInstrOffset + frag.code.size() <= UINT16_MAX);
+			scratch.instrOffsets.push_back(uint16_t(curInstrOffset));
+			writeFragment(scratch.out, frag, poolIdxOf);
+			curInstrOffset += frag.code.size();
+			localsEnd = std::max<size_t>(localsEnd, frag.localsEnd);
+		}
+		// The patch points from firstPatchPoint on target labels
+		void markLabelPatchPoints(const size_t firstPatchPoint)
+		{
+			for (size_t p = firstPatchPoint; p < scratch.instrPatchPoints.size(); p++)
+				scratch.labelPatchPoints.push_back(uint32_t(p));
+		}
+
+	public:
+		// refs - resolves the RefHandle's of emitted instructions, it may grow while building
+		CodeBuilder(PoolPush poolPush, CodeCompileScratch& scratch, const RefTable* refs = nullptr)
+			:poolPush(std::move(poolPush)), scratch(scratch), refs(refs)
+		{
+			scratch.clear();
+		}
+		CodeBuilder(const CodeBuilder&) = delete;
+
+		/// @returns the index of the next instruction
+		uint16_t nextInstr() const { return uint16_t(scratch.instrOffsets.size()); }
+		/// @returns the bytecode offset of the next instruction
+		size_t byteOffset() const { return curInstrOffset; }
+
+		void emit(const Instr& instr)
+		{
+			const uint16_t i = beginInstr();
+			detail::emitInstr(poolPush, refs, scratch, curInstrOffset, sw,
+				[] { return uint16_t(0); },// plainOnly, so never needed
+				i, instr);
+			localsEnd = std::max(localsEnd, instrLocalsEnd(instr));
+		}
+
+		// Copies a BytecodeFragment as 1 instruction
+		// holeRefs - [FragmentHole::ref], from refs
+		void emit(const FragmentView frag, const std::span<const RefHandle> holeRefs)
+		{
+			_ASSERT(holeRefs.size() >= frag.refCount);
+			emitFragment(frag, [&](const uint8_t ref) {
+				return detail::handlePoolIdxOf(poolPush, scratch, refs, holeRefs[ref]);
+			});
+		}
+		// holeEntries - [FragmentHole::ref]
+		void emit(const FragmentView frag, const std::span<const ConstPoolEntry> holeEntries)
+		{
+			_ASSERT(holeEntries.size() >= frag.refCount);
+			emitFragment(frag, [&](const uint8_t ref) {
+				return poolPush(holeEntries[ref]);
+			});
+		}
+
+		Label newLabel() { return scratch.labels.newLabel(); }
+		// To the next instruction
+		void bind(const Label l) { scratch.labels.bind(l, nextInstr()); }
+
+		// id - IF_*, or INSTR_OP_CODE<InstrType::GOTO>
+		void branch(const InstrId id, const Label target)
+		{
+			const InstrArgKind kind = INSTR_ARG_KINDS[(uint8_t)id];
+			_ASSERT(kind == InstrArgKind::IF || kind == InstrArgKind::GOTO);
+
+			const uint16_t i = beginInstr();
+			const LabelTable& labels = scratch.labels;
+			// Backward, so its known now
+			const int32_t jmpOffset = labels.isBound(target) ? labels.jmpOffset(i, target) : 0;
+			const size_t firstPatchPoint = scratch.instrPatchPoints.size();
+			if (kind == InstrArgKind::GOTO)
+				pushGotoW(scratch.out, scratch.instrOffsets, curInstrOffset, i, scratch.instrPatchPoints, jmpOffset);
+			else
+				pushIfW(scratch.out, scratch.instrOffsets, curInstrOffset, i, scratch.instrPatchPoints, id, jmpOffset);
+
+			if (!labels.isBound(target))
+			{
+				scratch.instrPatchPoints.back().instrOffset = target.id;
+				markLabelPatchPoints(firstPatchPoint);
+			}
+		}
+		void tableSwitch(const int32_t min, const std::span<const Label> targets, const Label defaultTarget)
+		{
+			const uint16_t i = beginInstr();
+			std::vector<int32_t>& jmpOffsets = scratch.labelJmpOffsets;
+			jmpOffsets.clear();
+			for (const Label l : targets)
+				jmpOffsets.push_back(int32_t(l.id));
+
+			const size_t firstPatchPoint = scratch.instrPatchPoints.size();
+			pushTableSwitchW(scratch, curInstrOffset, i, min, jmpOffsets, int32_t(defaultTarget.id));
+			markLabelPatchPoints(firstPatchPoint);
+		}
+		// cases - sorted by key
+		void lookupSwitch(const std::span<const LabelCase> cases, const Label defaultTarget)
+		{
+			const uint16_t i = beginInstr();
+			const size_t firstPatchPoint = scratch.instrPatchPoints.size();
+			pushLookupSwitchW(scratch, curInstrOffset, i, labelCasesOf(cases), int32_t(defaultTarget.id));
+			markLabelPatchPoints(firstPatchPoint);
+		}
+		// Like a SWITCH, cases in any order
+		void caseSwitch(const std::span<const LabelCase> cases, const Label defaultTarget)
+		{
+			const uint16_t i = beginInstr();
+			const size_t firstPatchPoint = scratch.instrPatchPoints.size();
+			pushSwitchW(scratch, curInstrOffset, i, poolPush, sw, 0, labelCasesOf(cases), int32_t(defaultTarget.id));
+			markLabelPatchPoints(firstPatchPoint);
+		}
+		// Catches throws from [start, end), can be used instead of data.errorHandlers
+		// end - bound after the last covered instruction
+		void handler(
+			const Label start, const Label end, const Label handlerStart,
+			std::optional<ConstPoolItmType::CLASS> catchType = std::nullopt)
+		{
+			scratch.labelHandlers.push_back({ std::move(catchType), 0, 0, 0 });
+			scratch.labelHandlerRanges.push_back({ start, end, handlerStart });
+		}
+
+		// Patches the branches, and builds the frames, tags, ...
+		// data - everything but the instructions, its indices refer to emitted ones
+		// The builder cant be used after this
+		FuncTagType::CODE finish(const CodeCompileData& data)
+		{
+			_ASSERT(data.instrs.empty() && "Instructions were emitted");
+			_ASSERT(!data.calcFrames && "Cant calc frames for a CodeBuilder");
+			_ASSERT(data.maxStack.has_value() && "Cant calc maxStack for a CodeBuilder");
+
+			_ASSERT(curInstrOffset <= UINT16_MAX);
+			scratch.instrOffsets.push_back((uint16_t)curInstrOffset);//Prevent oob
+
+			const LabelTable& labels = scratch.labels;
+			for (const uint32_t p : scratch.labelPatchPoints)
+			{
+				PatchPoint& pp = scratch.instrPatchPoints[p];
+				pp.instrOffset = uint32_t(labels.jmpOffset(pp.instrIdx, Label{ pp.instrOffset }));
+			}
+			std::vector<ErrorHandler>& handlers = scratch.labelHandlers;
+			_ASSERT((handlers.empty() || data.errorHandlers.empty()) && "Error handlers given twice");
+			for (size_t h = 0; h < handlers.size(); h++)
+			{
+				const auto& [start, end, handlerStart] = scratch.labelHandlerRanges[h];
+				handlers[h].startInstr = labels.instrOf(start);
+				_ASSERT(labels.instrOf(end) > handlers[h].startInstr && "Empty error handler range");
+				handlers[h].endInstr = uint16_t(labels.instrOf(end) - 1);
+				handlers[h].handlerInstr = labels.instrOf(handlerStart);
+			}
+
+			_ASSERT(localsEnd <= UINT16_MAX);
+			return detail::finishCode(poolPush, data, scratch, sw,
+				std::max(calcMaxLocals(data), uint16_t(localsEnd)),
+				handlers.empty() ? data.errorHandlers : std::span<const ErrorHandler>(handlers));
+		}
+	};
+}
@@ -0,0 +1,93 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <span>
+#include <map>
+#include <string>
+#include <string_view>
+#include <optional>
+
+#include "State.hpp"
+#include "InstrVariant.hpp"
+
+namespace cpp_jcfu
+{
+	//https://docs.oracle.com/javase/specs/jvms/se24/html/jvms-4.html#jvms-4.7.4
+	//Required on every ErrorHandler::startInstr, and every Goto/If/Switch target
+	// add it to (.instructionFrames)
+	// 
+	//Additionaly: if a 'if' could ever jump >32k bytes, it needs it too,
+	// but to keep things optimized, you only need it on (.ifInstructionFrames)
+	// (Its the frame of the instruction after the 'if', which the inverted 'if' jumps to)
+	//
+	//Or turn on (.calcFrames), and only add the ones it cant figure out
+	struct StackFrame
+	{
+		std::vector<SlotKind> stack;
+		std::vector<SlotKind> local;
+	};
+	struct LineNumEntry
+	{
+		uint16_t startInstr;
+		uint16_t line;
+	};
+	struct LocalEntry
+	{
+		std::string name;
+		std::string desc;
+		uint16_t startInstr;
+		uint16_t instrCount;
+		uint16_t idx;
+	};
+	struct LocalTypeEntry
+	{
+		std::string name;
+		std::string sig;
+		uint16_t startInstr;
+		uint16_t instrCount;
+		uint16_t idx;
+	};
+	struct ErrorHandler
+	{
+		std::optional<ConstPoolItmType::CLASS> catchType; // None -> catch all
+		uint16_t startInstr;
+		uint16_t endInstr; // Inclusive
+		uint16_t handlerInstr;
+	};
+	struct CodeCompileData
+	{
+		std::span<const Instr> instrs;
+		std::span<const ErrorHandler> errorHandlers;
+		// Resolves the RefHandle's in instrs, only needed if some instruction has one
+		const RefTable* refs = nullptr;
+
+		// Will not be added to binary, only used to optimize out some instructionFrames, that dont need to exist
+		std::vector<SlotKind> startFrameLocals;
+		std::map<uint16_t, StackFrame> instructionFrames;
+		//Only ones that jump >32k will be used! (will error, if missing)
+		//Not used if instructionFrames has the next instruction
+		std::map<uint16_t, StackFrame> ifInstructionFrames;
+
+		// Calculate the frames for every branch target, error handler & long 'if', from the instructions
+		// startFrameLocals must then have 'this' and the params, ifInstructionFrames is ignored
+		// instructionFrames still win where given, add them for dead code, or when a merge of
+		// 2 different classes needs something more exact than java/lang/Object
+		bool calcFrames = false;
+		// Only needed for calcFrames, if 'this' starts as RAW_THIS (constructors)
+		std::string_view thisClass{};
+
+		std::vector<LineNumEntry> lineNums;
+		std::vector<LocalEntry> localVars;
+		std::vector<LocalTypeEntry> localVarTypes;
+
+		// Calculated from the instructions, if not given
+		// If given, its trusted as an upper bound (checked with _ASSERT, when it was calculated anyway)
+		// maxLocals only sees params through startFrameLocals, so put 'this' and the params there
+		// maxStack follows every branch like calcFrames does, so it needs the same startFrameLocals
+		std::optional<uint16_t> maxStack;
+		std::optional<uint16_t> maxLocals;
+	};
+}
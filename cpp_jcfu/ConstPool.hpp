@@ -0,0 +1,355 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <array>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <bit>
+
+#include "State.hpp"
+#include "KnownJutf8.hpp"
+#include "ext/CppMatch.hpp"
+#include "ext/MorLib.hpp"
+
+namespace cpp_jcfu
+{
+	// Monotonic storage for strings, the views it gives out
+	// stay valid until reset() or its destruction.
+	//
+	// Can be owned by a single ConstPool, or shared by a batch of them.
+	class StringArena
+	{
+		struct Block
+		{
+			std::unique_ptr<char[]> data;
+			size_t size;
+		};
+		std::vector<Block> blocks;
+		size_t curBlock = 0;
+		size_t used = 0;//In the current block
+	public:
+		inline static constexpr size_t BLOCK_SIZE = 16 * 1024;
+
+		std::string_view store(const std::string_view str)
+		{
+			if (str.empty())
+				return {};
+
+			while (curBlock < blocks.size() && blocks[curBlock].size - used < str.size())
+			{
+				curBlock++;
+				used = 0;
+			}
+			if (curBlock == blocks.size())
+			{
+				const size_t size = std::max(BLOCK_SIZE, str.size());
+				blocks.push_back(Block{ std::make_unique_for_overwrite<char[]>(size), size });
+				used = 0;
+			}
+			char* const dst = blocks[curBlock].data.get() + used;
+			std::memcpy(dst, str.data(), str.size());
+			used += str.size();
+			return { dst, str.size() };
+		}
+		// Keeps the blocks, so a reused arena stops allocating
+		void reset()
+		{
+			curBlock = 0;
+			used = 0;
+		}
+	};
+
+	// A flattened pool item, its strings point into a StringArena (or something that lives as long)
+	//
+	// strs, by id:
+	//	JUTF8, STR, CLASS, FUNC_TYPE => [0] is the string
+	//	NAME_AND_DESC, RUN_DYN => name, desc
+	//	*_REF, FUNC_HANDLE => class, name, desc
+	// num, by id:
+	//	I32, F32, I64, F64 => the bits of the value
+	//	FUNC_HANDLE => the kind
+	//	RUN_DYN => the bootstrap idx
+	struct ConstPoolEntry
+	{
+		ConstPoolItmId id;
+		uint64_t num = 0;
+		std::array<std::string_view, 3> strs{};
+
+		// Floats are compared by their bits, so -0.0 and 0.0 are different
+		Mor_eq_op(ConstPoolEntry);
+
+		constexpr bool isBig() const {
+			return id == ConstPoolItmId::I64 || id == ConstPoolItmId::F64;
+		}
+	};
+
+	constexpr ConstPoolEntry newJutf8Entry(const std::string_view str) {
+		return { ConstPoolItmId::JUTF8, 0, { str } };
+	}
+	constexpr ConstPoolEntry newClassEntry(const std::string_view name) {
+		return { ConstPoolItmId::CLASS, 0, { name } };
+	}
+	constexpr ConstPoolEntry newNameAndDescEntry(const std::string_view name, const std::string_view desc) {
+		return { ConstPoolItmId::NAME_AND_DESC, 0, { name, desc } };
+	}
+	constexpr ConstPoolEntry newRefEntry(const ConstPoolItmId id, const ConstPoolItmType::RefBase& ref) {
+		return { id, 0, { ref.classIdx.name, ref.refDesc.name, ref.refDesc.desc } };
+	}
+
+	inline ConstPoolEntry constPoolEntryOf(const ConstPoolItmType::CLASS& itm) {
+		return newClassEntry(itm.name);
+	}
+	inline ConstPoolEntry constPoolEntryOf(const ConstPoolItmType::FIELD_REF& itm) {
+		return newRefEntry(ConstPoolItmId::FIELD_REF, itm);
+	}
+	inline ConstPoolEntry constPoolEntryOf(const ConstPoolItmType::FUNC_REF& itm) {
+		return newRefEntry(ConstPoolItmId::FUNC_REF, itm);
+	}
+	inline ConstPoolEntry constPoolEntryOf(const ConstPoolItmType::INTERFACE_FUNC_REF& itm) {
+		return newRefEntry(ConstPoolItmId::INTERFACE_FUNC_REF, itm);
+	}
+	// The strings of the result point into itm
+	inline ConstPoolEntry constPoolEntryOf(const ConstPoolItm& itm)
+	{
+		return ezmatch(itm)(
+		varcase(const ConstPoolItmType::I32) -> ConstPoolEntry {
+			return { ConstPoolItmId::I32, std::bit_cast<uint32_t>(var) };
+		},
+		varcase(const ConstPoolItmType::F32) -> ConstPoolEntry {
+			return { ConstPoolItmId::F32, std::bit_cast<uint32_t>(var) };
+		},
+		varcase(const ConstPoolItmType::I64) -> ConstPoolEntry {
+			return { ConstPoolItmId::I64, std::bit_cast<uint64_t>(var) };
+		},
+		varcase(const ConstPoolItmType::F64) -> ConstPoolEntry {
+			return { ConstPoolItmId::F64, std::bit_cast<uint64_t>(var) };
+		},
+		varcase(const ConstPoolItmType::STR&) -> ConstPoolEntry {
+			return { ConstPoolItmId::STR, 0, { var.txt } };
+		},
+		varcase(const ConstPoolItmType::JUTF8&) -> ConstPoolEntry {
+			return newJutf8Entry(var);
+		},
+		varcase(const ConstPoolItmType::FUNC_TYPE&) -> ConstPoolEntry {
+			return { ConstPoolItmId::FUNC_TYPE, 0, { var.desc } };
+		},
+		varcase(const ConstPoolItmType::NAME_AND_DESC&) -> ConstPoolEntry {
+			return newNameAndDescEntry(var.name, var.desc);
+		},
+		varcase(const ConstPoolItmType::RUN_DYN&) -> ConstPoolEntry {
+			return { ConstPoolItmId::RUN_DYN, var.bootstrapIdx, { var.funcDesc.name, var.funcDesc.desc } };
+		},
+		varcase(const ConstPoolItmType::FUNC_HANDLE&) -> ConstPoolEntry {
+			ConstPoolEntry ret = newRefEntry(ConstPoolItmId::FUNC_HANDLE, var.val);
+			ret.num = (uint64_t)var.kind;
+			return ret;
+		},
+		// CLASS, *_REF
+		varcase(const auto&) -> ConstPoolEntry {
+			return constPoolEntryOf(var);
+		}
+		);
+	}
+
+	inline size_t hashPoolEntry(const ConstPoolEntry& e)
+	{
+		const auto mix = [](const size_t h, const size_t v) {
+			return h ^ (v + size_t(0x9E3779B9) + (h << 6) + (h >> 2));
+		};
+		size_t ret = mix((size_t)e.id, std::hash<uint64_t>{}(e.num));
+		for (const std::string_view str : e.strs)
+			ret = mix(ret, std::hash<std::string_view>{}(str));
+		return ret;
+	}
+
+	// You can only rely on the ones you added to it.
+	// The writer might add some, but it will always be after your ones.
+	//
+	// Equal items are interned, so pushing one twice gives back the first index.
+	// The strings are copied into a StringArena, either the pools own one, or
+	// a shared one, for batches of classes.
+	class ConstPool
+	{
+		struct Slot
+		{
+			uint32_t hash;
+			uint16_t itemIdx = UINT16_MAX;//UINT16_MAX -> empty
+			uint16_t poolIdx;
+		};
+
+		std::vector<ConstPoolEntry> items;
+		std::vector<Slot> table;//Open addressing, linear probing, size is a power of 2
+
+		StringArena ownArena;
+		StringArena* sharedArena = nullptr;
+
+		std::array<uint16_t, KNOWN_JUTF8_COUNT> knownIdxs{};//0 -> not interned yet
+
+		StringArena& arena() {
+			return sharedArena == nullptr ? ownArena : *sharedArena;
+		}
+
+		void rehash(const size_t newSize)
+		{
+			std::vector<Slot> old = std::move(table);
+			table.assign(newSize, Slot{});
+			const size_t mask = newSize - 1;
+
+			for (const Slot& s : old)
+			{
+				if (s.itemIdx == UINT16_MAX)
+					continue;
+				size_t pos = s.hash & mask;
+				while (table[pos].itemIdx != UINT16_MAX)
+					pos = (pos + 1) & mask;
+				table[pos] = s;
+			}
+		}
+		// @returns the slot holding an equal item, or the empty slot to put it in
+		size_t findSlot(const ConstPoolEntry& e, const uint32_t hash) const
+		{
+			const size_t mask = table.size() - 1;
+			size_t pos = hash & mask;
+			while (true)
+			{
+				const Slot& s = table[pos];
+				if (s.itemIdx == UINT16_MAX)
+					return pos;
+				if (s.hash == hash && items[s.itemIdx] == e)
+					return pos;
+				pos = (pos + 1) & mask;
+			}
+		}
+		void growIfNeeded()
+		{
+			// Keep the load factor <= 1/2
+			if ((items.size() + 1) * 2 > table.size())
+				rehash(table.empty() ? 64 : table.size() * 2);
+		}
+	public:
+		ConstPool() = default;
+		// The strings will be kept in sharedArena, so it must outlive the pool
+		explicit ConstPool(StringArena& sharedArena)
+			:sharedArena(&sharedArena) {}
+
+		ConstPool(ConstPool&&) = default;
+		ConstPool& operator=(ConstPool&&) = default;
+
+		ConstPool(const ConstPool& o)
+			:items(o.items), table(o.table), sharedArena(o.sharedArena), knownIdxs(o.knownIdxs)
+		{
+			if (sharedArena != nullptr)
+				return;
+			for (ConstPoolEntry& e : items)
+			{
+				for (std::string_view& str : e.strs)
+					str = ownArena.store(str);
+			}
+		}
+		ConstPool& operator=(const ConstPool& o)
+		{
+			if (this != &o)
+				*this = ConstPool(o);
+			return *this;
+		}
+
+		/// @returns the pool index of an equal item, if there is one
+		std::optional<uint16_t> find(const ConstPoolEntry& e) const {
+			return findHashed(e, hashPoolEntry(e));
+		}
+		/// fullHash - must be hashPoolEntry(e)
+		std::optional<uint16_t> findHashed(const ConstPoolEntry& e, const size_t fullHash) const
+		{
+			if (table.empty())
+				return std::nullopt;
+			const Slot& s = table[findSlot(e, (uint32_t)fullHash)];
+			if (s.itemIdx == UINT16_MAX)
+				return std::nullopt;
+			return s.poolIdx;
+		}
+		std::optional<uint16_t> find(const ConstPoolItm& itm) const {
+			return find(constPoolEntryOf(itm));
+		}
+
+		/// @returns {pool index, was it added}
+		/// poolIdxIfNew is only used, if no equal item exists yet
+		/// copyStrs - false, if the strings already live as long as the pool (static, or from this pool)
+		std::pair<uint16_t, bool> intern(const ConstPoolEntry& e, const uint16_t poolIdxIfNew, const bool copyStrs = true) {
+			return internHashed(e, hashPoolEntry(e), poolIdxIfNew, copyStrs);
+		}
+		/// fullHash - must be hashPoolEntry(e)
+		std::pair<uint16_t, bool> internHashed(const ConstPoolEntry& e, const size_t fullHash, const uint16_t poolIdxIfNew, const bool copyStrs = true)
+		{
+			_ASSERT(items.size() < UINT16_MAX - 1);
+			growIfNeeded();
+
+			const uint32_t hash = (uint32_t)fullHash;
+			Slot& s = table[findSlot(e, hash)];
+			if (s.itemIdx != UINT16_MAX)
+				return { s.poolIdx,false };
+
+			s.hash = hash;
+			s.itemIdx = (uint16_t)items.size();
+			s.poolIdx = poolIdxIfNew;
+
+			ConstPoolEntry& added = items.emplace_back(e);
+			if (copyStrs)
+			{
+				for (std::string_view& str : added.strs)
+					str = arena().store(str);
+			}
+			return { poolIdxIfNew,true };
+		}
+		std::pair<uint16_t, bool> intern(const ConstPoolItm& itm, const uint16_t poolIdxIfNew) {
+			return intern(constPoolEntryOf(itm), poolIdxIfNew);
+		}
+
+		/// Like intern(newJutf8Entry(knownJutf8Str(k)), ...), but only looks it up once
+		/// The string is static, so it is never copied
+		std::pair<uint16_t, bool> internKnown(const KnownJutf8 k, const uint16_t poolIdxIfNew)
+		{
+			uint16_t& idx = knownIdxs[size_t(k)];
+			if (idx != 0)
+				return { idx,false };
+
+			const auto ret = intern(newJutf8Entry(knownJutf8Str(k)), poolIdxIfNew, false);
+			idx = ret.first;
+			return ret;
+		}
+
+		void reserve(const size_t count)
+		{
+			items.reserve(count);
+			size_t newSize = table.empty() ? 64 : table.size();
+			while (count * 2 > newSize)
+				newSize *= 2;
+			if (newSize != table.size())
+				rehash(newSize);
+		}
+		// Keeps the allocated memory, so the pool can be reused for the next class
+		// A shared arena is not reset, as other pools might still use it
+		void clear()
+		{
+			items.clear();
+			table.assign(table.size(), Slot{});
+			knownIdxs.fill(0);
+			ownArena.reset();
+		}
+
+		size_t size() const { return items.size(); }
+		bool empty() const { return items.empty(); }
+		const ConstPoolEntry& operator[](const size_t i) const { return items[i]; }
+
+		auto begin() const { return items.begin(); }
+		auto end() const { return items.end(); }
+	};
+}
@@ -0,0 +1,74 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <string_view>
+#include <cstdint>
+
+namespace cpp_jcfu
+{
+	//https://docs.oracle.com/javase/specs/jvms/se24/html/jvms-4.html#jvms-4.3
+
+	/// @returns the end of the field type that starts at pos, or npos if its broken
+	constexpr size_t descTypeEnd(const std::string_view desc, size_t pos)
+	{
+		while (pos < desc.size() && desc[pos] == '[')
+			pos++;
+		if (pos >= desc.size())
+			return std::string_view::npos;
+
+		switch (desc[pos])
+		{
+		case 'B': case 'C': case 'D': case 'F':
+		case 'I': case 'J': case 'S': case 'Z':
+			return pos + 1;
+		case 'L':
+		{
+			const size_t end = desc.find(';', pos);
+			return end == std::string_view::npos ? end : end + 1;
+		}
+		default:
+			return std::string_view::npos;
+		}
+	}
+	// Slots a value of this type takes, long & double take 2, void takes 0
+	constexpr uint8_t descTypeSlots(const std::string_view type)
+	{
+		if (type.empty() || type[0] == 'V')
+			return 0;
+		return (type[0] == 'J' || type[0] == 'D') ? 2 : 1;
+	}
+	// The name a CONSTANT_Class uses for this type: "Lx/Y;" -> "x/Y", arrays stay as they are
+	constexpr std::string_view descClassName(const std::string_view type)
+	{
+		if (type.size() >= 2 && type[0] == 'L')
+			return type.substr(1, type.size() - 2);
+		return type;
+	}
+
+	// Calls onParam(std::string_view type) for every param of a function descriptor
+	/// @returns the return type ("V" for void), or empty if desc is broken
+	constexpr std::string_view forEachDescParam(const std::string_view desc, const auto& onParam)
+	{
+		if (desc.empty() || desc[0] != '(')
+			return {};
+
+		size_t pos = 1;
+		while (pos < desc.size() && desc[pos] != ')')
+		{
+			const size_t end = descTypeEnd(desc, pos);
+			if (end == std::string_view::npos)
+				return {};
+			onParam(desc.substr(pos, end - pos));
+			pos = end;
+		}
+		if (pos >= desc.size())
+			return {};
+		return desc.substr(pos + 1);
+	}
+
+	static_assert(descTypeEnd("[[Ljava/lang/String;I", 0) == 20);
+	static_assert(descClassName("Ljava/lang/String;") == "java/lang/String");
+	static_assert(forEachDescParam("(IJ)V", [](std::string_view) {}) == "V");
+}
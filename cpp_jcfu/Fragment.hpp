@@ -0,0 +1,272 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <array>
+#include <span>
+#include <algorithm>
+
+#include "State.hpp"
+#include "ByteWriter.hpp"
+#include "InstrBuffer.hpp"
+#include "StackFrameCalc.hpp"
+
+namespace cpp_jcfu
+{
+	// One instruction of a BytecodeFragment, arg is like InstrBuffer::op's,
+	// except refs & constants, which take the index of the ref, that fills their hole
+	struct FragOp
+	{
+		InstrId id;
+		uint32_t arg = 0;
+	};
+	constexpr FragOp fragOp(const InstrId id, const uint32_t arg = 0) {
+		return { id, arg };
+	}
+	// A ref instruction, or I_PUSH_CONST_U16 / I_PUSH_CONST2_U16
+	// ref - which of the refs given when emitting, fills the hole
+	// extra - argCount for PUSH_RUN_INTERFACE, dims for PUSH_OBJARR_U8
+	constexpr FragOp fragRef(const InstrId id, const uint8_t ref, const uint8_t extra = 0) {
+		return { id, uint32_t(ref) | uint32_t(extra) << 16 };
+	}
+
+	// Where a pool index goes, a u16 at byteOffset
+	struct FragmentHole
+	{
+		uint16_t byteOffset;
+		uint8_t ref;
+	};
+
+	// Any BytecodeFragment, so emitting isnt a template per size
+	struct FragmentView
+	{
+		std::span<const uint8_t> code;
+		std::span<const FragmentHole> holes;
+		uint8_t refCount;
+		uint16_t localsEnd;
+	};
+
+	// Straight line bytecode, that was encoded at compile time, see makeFragment
+	template<size_t N, size_t HOLES>
+	struct BytecodeFragment
+	{
+		std::array<uint8_t, N> code;
+		std::array<FragmentHole, HOLES> holes;
+		uint8_t refCount;// Refs needed to fill the holes
+		uint16_t localsEnd;// The highest local slot used, +1
+
+		constexpr operator FragmentView() const {
+			return { code, holes, refCount, localsEnd };
+		}
+	};
+
+	namespace detail
+	{
+		// Not constexpr, so using it in makeFragment is a compile error
+		inline void fragmentOpNotAllowed(const char*) {}
+
+		// wide iinc is the largest
+		inline constexpr size_t MAX_FRAG_OP_SIZE = 6;
+
+		template<size_t OPS>
+		struct EncodedFragment
+		{
+			std::array<uint8_t, OPS * MAX_FRAG_OP_SIZE> code{};
+			size_t size = 0;
+			std::array<FragmentHole, OPS> holes{};
+			size_t holeCount = 0;
+			uint8_t refCount = 0;
+			uint16_t localsEnd = 0;
+
+			constexpr void u8(const uint8_t v) { code[size++] = v; }
+			constexpr void u16(const uint16_t v)
+			{
+				u8(uint8_t(v >> 8));
+				u8(uint8_t(v));
+			}
+			constexpr void hole(const uint8_t ref)
+			{
+				holes[holeCount++] = { uint16_t(size), ref };
+				refCount = std::max(refCount, uint8_t(ref + 1));
+				u16(0);
+			}
+		};
+
+		template<size_t OPS>
+		constexpr EncodedFragment<OPS> encodeFragment(const std::array<FragOp, OPS>& ops)
+		{
+			using K = InstrArgKind;
+			EncodedFragment<OPS> ret;
+
+			for (const FragOp& op : ops)
+			{
+				const InstrId id = op.id;
+				const K kind = INSTR_ARG_KINDS[(uint8_t)id];
+				const uint8_t ref = uint8_t(op.arg);
+				const uint8_t extra = uint8_t(op.arg >> 16);
+
+				if (id == InstrId::I_WIDE || id == InstrId::I_DEPR_GOTO_VAR_U16)
+					fragmentOpNotAllowed("wide is picked automatically, ret isnt supported");
+
+				const int varIdx = localVarIdx(id);
+				if (varIdx != -1)
+				{
+					const size_t idx = varIdx == -2 ? (op.arg & UINT16_MAX) : size_t(varIdx);
+					ret.localsEnd = (uint16_t)std::max<size_t>(ret.localsEnd, idx + localVarSlots(id));
+				}
+
+				switch (kind)
+				{
+				case K::NONE:
+					ret.u8((uint8_t)id);
+					break;
+				case K::I8:
+					ret.u8((uint8_t)id);
+					ret.u8(uint8_t(op.arg));
+					break;
+				case K::I16:
+					ret.u8((uint8_t)id);
+					ret.u16(uint16_t(op.arg));
+					break;
+				case K::I32:
+				{// Like pushI32InstrW, but only up to i16
+					const int32_t v = int32_t(op.arg);
+					if (v >= -1 && v <= 5)
+						ret.u8(uint8_t((int32_t)InstrId::PUSH_I32_0 + v));
+					else if (v >= INT8_MIN && v <= INT8_MAX)
+					{
+						ret.u8((uint8_t)InstrId::I_PUSH_I32_I8);
+						ret.u8(uint8_t(v));
+					}
+					else if (v >= INT16_MIN && v <= INT16_MAX)
+					{
+						ret.u8((uint8_t)InstrId::I_PUSH_I32_I16);
+						ret.u16(uint16_t(v));
+					}
+					else
+						fragmentOpNotAllowed("PUSH_I32_I32 outside of i16 needs a pool constant, use I_PUSH_CONST_U16");
+					break;
+				}
+				case K::VAR:
+					if (op.arg <= UINT8_MAX)
+					{
+						ret.u8((uint8_t)id);
+						ret.u8(uint8_t(op.arg));
+						break;
+					}
+					ret.u8((uint8_t)InstrId::I_WIDE);
+					ret.u8((uint8_t)id);
+					ret.u16(uint16_t(op.arg));
+					break;
+				case K::ADD_VAR:
+				{// Like pushAddVarInstrW
+					const uint16_t idx = uint16_t(op.arg);
+					const int16_t val = int16_t(op.arg >> 16);
+					if (idx <= UINT8_MAX && val >= INT8_MIN && val <= INT8_MAX)
+					{
+						ret.u8((uint8_t)InstrId::I_ADD_I32_VAR_U8_CI8);
+						ret.u8(uint8_t(idx));
+						ret.u8(uint8_t(val));
+						break;
+					}
+					ret.u8((uint8_t)InstrId::I_WIDE);
+					ret.u8((uint8_t)InstrId::I_ADD_I32_VAR_U8_CI8);
+					ret.u16(idx);
+					ret.u16(uint16_t(val));
+					break;
+				}
+				case K::ARR_TYPE:
+					ret.u8((uint8_t)id);
+					ret.u8(uint8_t(op.arg));
+					break;
+				case K::POOL_U16:
+				case K::REF:
+					ret.u8((uint8_t)id);
+					ret.hole(ref);
+					break;
+				case K::REF_INTERFACE:
+					ret.u8((uint8_t)id);
+					ret.hole(ref);
+					ret.u8(extra);
+					ret.u8(0);
+					break;
+				case K::REF_DYN:
+					ret.u8((uint8_t)id);
+					ret.hole(ref);
+					ret.u16(0);
+					break;
+				case K::REF_OBJARR:
+					ret.u8((uint8_t)id);
+					ret.hole(ref);
+					ret.u8(extra);
+					break;
+				case K::POOL_U8:
+					fragmentOpNotAllowed("The pool index isnt known yet, use I_PUSH_CONST_U16");
+					break;
+				case K::PUSH_CONST:
+					fragmentOpNotAllowed("Use I_PUSH_CONST_U16, or I_PUSH_CONST2_U16 for long / double");
+					break;
+				default:
+					// Their targets would need stack frames, & wide constants need the pool
+					fragmentOpNotAllowed("Fragments cant contain branches, switches, or wide constants");
+					break;
+				}
+			}
+			return ret;
+		}
+	}
+
+	// Encodes a fixed sequence of instructions at compile time, so emitting it is a memcpy.
+	// Refs & pool constants are left as holes, that get the pool index of a ref when emitted.
+	// Its a single instruction to the code its emitted into, so it cant contain branches.
+	//
+	// makeOps - captureless lambda, returning a std::array<FragOp, ...>
+	//
+	// Usage:
+	//	inline constexpr auto BOX_I32 = makeFragment([] {
+	//		return std::array{ fragRef(InstrId::PUSH_RUN_STATIC, 0) };
+	//	});
+	template<class MakeOps>
+	consteval auto makeFragment(MakeOps)
+	{
+		constexpr auto ops = MakeOps{}();
+		constexpr auto enc = detail::encodeFragment(ops);
+
+		BytecodeFragment<enc.size, enc.holeCount> ret{};
+		std::copy_n(enc.code.begin(), enc.size, ret.code.begin());
+		std::copy_n(enc.holes.begin(), enc.holeCount, ret.holes.begin());
+		ret.refCount = enc.refCount;
+		ret.localsEnd = enc.localsEnd;
+		return ret;
+	}
+
+	// new #0, dup, invokespecial #1 (<init>)
+	inline constexpr auto NEW_INIT_FRAGMENT = makeFragment([] {
+		return std::array{
+			fragRef(InstrId::PUSH_OBJ, 0),
+			fragOp(InstrId::DUP_1),
+			fragRef(InstrId::PUSH_RUN_SPECIAL, 1)
+		};
+	});
+	// new #0, dup, invokespecial #1 (<init>), athrow
+	inline constexpr auto THROW_NEW_FRAGMENT = makeFragment([] {
+		return std::array{
+			fragRef(InstrId::PUSH_OBJ, 0),
+			fragOp(InstrId::DUP_1),
+			fragRef(InstrId::PUSH_RUN_SPECIAL, 1),
+			fragOp(InstrId::THROW)
+		};
+	});
+
+	// Copies frag into out, then fills its holes
+	// poolIdxOf - (uint8_t ref) -> uint16_t pool index
+	inline void writeFragment(ByteWriter& out, const FragmentView frag, const auto& poolIdxOf)
+	{
+		out.ensure(frag.code.size());
+		const size_t start = out.size();
+		out.bytes(frag.code);
+		for (const FragmentHole& h : frag.holes)
+			out.patch16(start + h.byteOffset, poolIdxOf(h.ref));
+	}
+}
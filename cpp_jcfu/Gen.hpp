@@ -4,96 +4,149 @@
 #pragma once
 
 #include <vector>
+#include <span>
 #include <bit>
 
 #include "State.hpp"
 #include "ext/CppMatch.hpp"
 #include "WriteBin.hpp"
 #include "WriteConstPool.hpp"
+#include "ClassSinks.hpp"
 
 namespace cpp_jcfu
 {
 
-	inline std::vector<uint8_t> gen(
+	// A class file, split into the parts gen writes
+	struct ClassSections
+	{
+		ByteWriter head;//Magic, version & const pool
+		ByteWriter body;//Everything after the pool
+
+		size_t size() const { return head.size() + body.size(); }
+	};
+
+	// Overwrites ret & layout, but keeps their memory
+	inline void genSections(
+		ClassSections& ret,
+		ConstPoolLayout& layout,
 		const ClassFlags thisClassFlags,
-		const std::string& thisClass,
-		const std::string& superClass,
-		ConstPool&& consts, 
+		const std::string_view thisClass,
+		const std::string_view superClass,
+		ConstPool& consts, 
 		const Functions& funcs, 
 		const Fields& fields)
 	{
 		_ASSERT(funcs.size() < UINT16_MAX);
 		_ASSERT(fields.size() < UINT16_MAX);
 
-		std::vector<uint8_t> out;
+		// Written first, as it fills the pool
+		ByteWriter& body = ret.body;
+		body.clear();
 
-		//https://docs.oracle.com/javase/specs/jvms/se7/html/jvms-4.html#jvms-4.1
+		u16w(body, thisClassFlags);
 
-		u32w(out, 0xCAFEBABE);
-		u16w(out, 0);
-		u16w(out, 51);
+		// Filled in later, to optimize small op-code stuff
+		const size_t thisClassAt = body.size();
+		u16w(body, 0);//this
+		u16w(body, 0);//super
 
-		std::vector<uint8_t> fieldOut;
+		u16w(body, 0);//interface count
 
 		size_t poolSize = calcConstPoolSize(consts) + 1;
 
 		//https://docs.oracle.com/javase/specs/jvms/se7/html/jvms-4.html#jvms-4.5
 		// Fields
+		u16w(body, (uint16_t)fields.size());//field count
+		for (const FieldInfo& info : fields)
 		{
-			for (const FieldInfo& info : fields)
-			{
-				u16w(fieldOut, info.flags);
-				constPoolIdxPushW(fieldOut, poolSize, consts,
-					ConstPoolItmType::JUTF8(info.name));
-				constPoolIdxPushW(fieldOut, poolSize, consts,
-					ConstPoolItmType::JUTF8(info.desc));
-
-				_ASSERT(info.tags.size() < UINT16_MAX);
-				u16w(fieldOut, (uint16_t)info.tags.size());
-				for (const FieldTag& tag : info.tags)
-					fieldTagW(fieldOut, poolSize, consts, tag);
-			}
+			u16w(body, info.flags);
+			pushJutf8IdxW(body, poolSize, consts, info.name);
+			pushJutf8IdxW(body, poolSize, consts, info.desc);
+
+			_ASSERT(info.tags.size() < UINT16_MAX);
+			u16w(body, (uint16_t)info.tags.size());
+			for (const FieldTag& tag : info.tags)
+				fieldTagW(body, poolSize, consts, tag);
 		}
-		std::vector<uint8_t> funcOut;
 
 		//https://docs.oracle.com/javase/specs/jvms/se7/html/jvms-4.html#jvms-4.6
 		// Funcs
+		u16w(body, (uint16_t)funcs.size());//method count
+		for (const FuncInfo& info : funcs)
 		{
-			for (const FuncInfo& info : funcs)
-			{
-				u16w(funcOut, info.flags);
-				constPoolIdxPushW(funcOut, poolSize, consts, 
-					ConstPoolItmType::JUTF8(info.name));
-				constPoolIdxPushW(funcOut, poolSize, consts, 
-					ConstPoolItmType::JUTF8(info.desc));
-
-				_ASSERT(info.tags.size() < UINT16_MAX);
-				u16w(funcOut, (uint16_t)info.tags.size());
-				for (const FuncTag& tag : info.tags)
-					funcTagW(funcOut, poolSize, consts, tag);
-			}
+			u16w(body, info.flags);
+			pushJutf8IdxW(body, poolSize, consts, info.name);
+			pushJutf8IdxW(body, poolSize, consts, info.desc);
+
+			_ASSERT(info.tags.size() < UINT16_MAX);
+			u16w(body, (uint16_t)info.tags.size());
+			for (const FuncTag& tag : info.tags)
+				funcTagW(body, poolSize, consts, tag);
 		}
 
+		u16w(body, 0);//tag count
+
 		//Do next to last, to optimize small op-code stuff
-		const uint16_t thisClassIdx = constPoolPush(poolSize, consts, ConstPoolItmType::CLASS(thisClass));
-		const uint16_t superClassIdx = constPoolPush(poolSize, consts, ConstPoolItmType::CLASS(superClass));
+		u16Patch(body, thisClassAt, constPoolPush(poolSize, consts, newClassEntry(thisClass)));
+		u16Patch(body, thisClassAt + 2, constPoolPush(poolSize, consts, newClassEntry(superClass)));
 
-		constPoolW(out, std::move(consts));
+		layoutConstPool(consts, layout);
 
-		u16w(out, thisClassFlags);
+		// Exact size, so the head is allocated once
+		ByteWriter& head = ret.head;
+		head.clear();
+		head.ensure(4 + 2 + 2 + 2 + layout.byteSize);
 
-		u16w(out, thisClassIdx);//this
-		u16w(out, superClassIdx);//super
+		//https://docs.oracle.com/javase/specs/jvms/se7/html/jvms-4.html#jvms-4.1
 
-		u16w(out, 0);//interface count
-		u16w(out, (uint16_t)fields.size());//field count
-		out.insert(out.end(), fieldOut.begin(), fieldOut.end());
+		head.u32(0xCAFEBABE);
+		head.u16(0);
+		head.u16(51);
 
-		u16w(out, (uint16_t)funcs.size());//method count
-		out.insert(out.end(), funcOut.begin(), funcOut.end());
+		constPoolW(head, consts, layout);
+	}
+	inline ClassSections genSections(
+		const ClassFlags thisClassFlags,
+		const std::string_view thisClass,
+		const std::string_view superClass,
+		ConstPool&& consts, 
+		const Functions& funcs, 
+		const Fields& fields)
+	{
+		ClassSections ret;
+		ConstPoolLayout layout;
+		genSections(ret, layout, thisClassFlags, thisClass, superClass, consts, funcs, fields);
+		return ret;
+	}
 
-		u16w(out, 0);//tag count
+	// Streams the class into sink, see ClassSinks.hpp
+	// The parts are handed over as they are, so a sink like FdSink never copies them
+	template<ClassSink Sink>
+	inline void gen(
+		Sink& sink,
+		const ClassFlags thisClassFlags,
+		const std::string& thisClass,
+		const std::string& superClass,
+		ConstPool&& consts,
+		const Functions& funcs,
+		const Fields& fields)
+	{
+		const ClassSections sections = genSections(thisClassFlags, thisClass, superClass, std::move(consts), funcs, fields);
 
+		const std::span<const uint8_t> parts[] = { sections.head.view(), sections.body.view() };
+		sink.write(parts);
+	}
+	inline std::vector<uint8_t> gen(
+		const ClassFlags thisClassFlags,
+		const std::string& thisClass,
+		const std::string& superClass,
+		ConstPool&& consts, 
+		const Functions& funcs, 
+		const Fields& fields)
+	{
+		std::vector<uint8_t> out;
+		VecSink sink{ out };
+		gen(sink, thisClassFlags, thisClass, superClass, std::move(consts), funcs, fields);
 		return out;
 	}
 }
@@ -0,0 +1,235 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <span>
+#include <bit>
+#include <algorithm>
+
+#include "State.hpp"
+#include "ext/CppMatch.hpp"
+#include "RefTable.hpp"
+#include "InstrVariant.hpp"
+#include "StackFrameCalc.hpp"
+
+namespace cpp_jcfu
+{
+	// What the operand of a InstrBuffer instruction is
+	enum class InstrArgKind : uint8_t
+	{
+		NONE,
+		I8, I16,// I_PUSH_I32_I8/I16
+		POOL_U8, POOL_U16,// I_PUSH_CONST_*
+		RAW_BRANCH16, RAW_BRANCH32,// In bytes
+		VAR,// BaseVar16Instr
+		ADD_VAR,// varIdx | u16(val) << 16
+		IF, GOTO,// In instructions
+		TABLE_SWITCH, LOOKUP_SWITCH, SWITCH,// Idx into switches
+		REF,// Ref handle
+		REF_INTERFACE,// Ref handle | argCount << 16
+		REF_DYN,// Ref handle
+		REF_OBJARR,// Ref handle | dims << 16
+		ARR_TYPE,
+		PUSH_CONST,// Ref handle
+		I32, F32,// The bits
+		I64, F64// Idx into wideConsts
+	};
+	template<class T>
+	constexpr InstrArgKind instrArgKindOf()
+	{
+		using namespace InstrType;
+		using K = InstrArgKind;
+
+		if constexpr (std::same_as<T, I_PUSH_I32_I8>) return K::I8;
+		else if constexpr (std::same_as<T, I_PUSH_I32_I16>) return K::I16;
+		else if constexpr (std::same_as<T, I_PUSH_CONST_U8>) return K::POOL_U8;
+		else if constexpr (std::same_as<T, I_PUSH_CONST_U16> || std::same_as<T, I_PUSH_CONST2_U16>) return K::POOL_U16;
+		else if constexpr (std::derived_from<T, BaseBranch16>) return K::RAW_BRANCH16;
+		else if constexpr (std::derived_from<T, BaseBranch32>) return K::RAW_BRANCH32;
+		else if constexpr (std::same_as<T, ADD_I32_VAR_U16_CI16>) return K::ADD_VAR;
+		else if constexpr (std::derived_from<T, BaseVar16Instr>) return K::VAR;
+		else if constexpr (std::same_as<T, GOTO>) return K::GOTO;
+		else if constexpr (std::derived_from<T, BaseBranch>) return K::IF;
+		else if constexpr (std::same_as<T, TABLE_SWITCH>) return K::TABLE_SWITCH;
+		else if constexpr (std::same_as<T, LOOKUP_SWITCH>) return K::LOOKUP_SWITCH;
+		else if constexpr (std::same_as<T, InstrType::SWITCH>) return K::SWITCH;
+		else if constexpr (std::same_as<T, PUSH_RUN_INTERFACE>) return K::REF_INTERFACE;
+		else if constexpr (std::same_as<T, PUSH_RUN_DYN>) return K::REF_DYN;
+		else if constexpr (std::same_as<T, PUSH_OBJARR_U8>) return K::REF_OBJARR;
+		else if constexpr (std::derived_from<T, BaseFieldRef>
+			|| std::derived_from<T, BaseFuncRef>
+			|| std::derived_from<T, BaseClassRef>) return K::REF;
+		else if constexpr (std::same_as<T, PUSH_ARR>) return K::ARR_TYPE;
+		else if constexpr (std::same_as<T, InstrType::PUSH_CONST>) return K::PUSH_CONST;
+		else if constexpr (std::same_as<T, PUSH_I32_I32>) return K::I32;
+		else if constexpr (std::same_as<T, PUSH_F32_F32>) return K::F32;
+		else if constexpr (std::same_as<T, PUSH_I64_I64>) return K::I64;
+		else if constexpr (std::same_as<T, PUSH_F64_F64>) return K::F64;
+		else
+		{
+			static_assert(std::is_empty_v<T>, "Instruction with an operand, that has no InstrArgKind");
+			return K::NONE;
+		}
+	}
+	// By INSTR_OP_CODE
+	inline constexpr auto INSTR_ARG_KINDS = Instr::typeTable([]<class T>(std::type_identity<T>) {
+		return instrArgKindOf<T>();
+	});
+
+	// Instructions as 2 parallel arrays, a opcode byte & a 4 byte operand, for compileCode to scan linearly.
+	// Refs & constants are interned into refs, switches go into flat side arrays,
+	// so appending doesnt allocate per instruction (unlike Instr, which is 16 bytes + heap refs)
+	//
+	// ops[i] is the INSTR_OP_CODE, utilities included. args[i] is described by INSTR_ARG_KINDS[ops[i]]
+	struct InstrBuffer
+	{
+		struct SwitchRef
+		{
+			int32_t defaultJmpOffset;
+			int32_t min;// TABLE_SWITCH only
+			uint32_t first;// Into tableJmpOffsets for TABLE_SWITCH, else switchCases
+			uint32_t count;
+		};
+
+		std::vector<InstrId> ops;
+		std::vector<uint32_t> args;
+
+		// Refs & PUSH_CONST's, build instructions with handles from here, to skip interning them again
+		RefTable refs;
+		std::vector<uint64_t> wideConsts;
+		std::vector<SwitchRef> switches;
+		std::vector<int32_t> tableJmpOffsets;
+		std::vector<SwitchCase> switchCases;
+
+		// The highest local slot used by any instruction, +1
+		uint16_t localSlots = 0;
+
+		size_t size() const { return ops.size(); }
+
+		// Keeps the memory
+		void clear()
+		{
+			ops.clear();
+			args.clear();
+			refs.clear();
+			wideConsts.clear();
+			switches.clear();
+			tableJmpOffsets.clear();
+			switchCases.clear();
+			localSlots = 0;
+		}
+
+		// Anything, arg must match INSTR_ARG_KINDS
+		void op(const InstrId id, const uint32_t arg = 0)
+		{
+			_ASSERT(ops.size() < UINT16_MAX);
+			ops.push_back(id);
+			args.push_back(arg);
+
+			const int varIdx = detail::localVarIdx(id);
+			if (varIdx != -1)
+			{
+				const size_t idx = varIdx == -2 ? (arg & UINT16_MAX) : size_t(varIdx);
+				localSlots = (uint16_t)std::max<size_t>(localSlots, idx + detail::localVarSlots(id));
+			}
+		}
+		// A ref instruction, or PUSH_CONST
+		// h - from refs
+		// extra - argCount for PUSH_RUN_INTERFACE, dims for PUSH_OBJARR_U8
+		void ref(const InstrId id, const RefHandle h, const uint8_t extra = 0) {
+			op(id, uint32_t(h) | uint32_t(extra) << 16);
+		}
+		void ref(const InstrId id, const ConstPoolEntry& e, const uint8_t extra = 0) {
+			ref(id, refs.intern(e), extra);
+		}
+		void pushI64(const int64_t v)
+		{
+			op(INSTR_OP_CODE<InstrType::PUSH_I64_I64>, (uint32_t)wideConsts.size());
+			wideConsts.push_back(std::bit_cast<uint64_t>(v));
+		}
+		void pushF64(const double v)
+		{
+			op(INSTR_OP_CODE<InstrType::PUSH_F64_F64>, (uint32_t)wideConsts.size());
+			wideConsts.push_back(std::bit_cast<uint64_t>(v));
+		}
+		void tableSwitch(const int32_t min, const std::span<const int32_t> jmpOffsets, const int32_t defaultJmpOffset)
+		{
+			op(InstrId::TABLE_SWITCH, (uint32_t)switches.size());
+			switches.push_back({ defaultJmpOffset, min, (uint32_t)tableJmpOffsets.size(), (uint32_t)jmpOffsets.size() });
+			tableJmpOffsets.insert(tableJmpOffsets.end(), jmpOffsets.begin(), jmpOffsets.end());
+		}
+		// LOOKUP_SWITCH (sorted cases), or SWITCH
+		void caseSwitch(const InstrId id, const std::span<const SwitchCase> cases, const int32_t defaultJmpOffset)
+		{
+			_ASSERT(INSTR_ARG_KINDS[(uint8_t)id] == InstrArgKind::LOOKUP_SWITCH
+				|| INSTR_ARG_KINDS[(uint8_t)id] == InstrArgKind::SWITCH);
+			op(id, (uint32_t)switches.size());
+			switches.push_back({ defaultJmpOffset, 0, (uint32_t)switchCases.size(), (uint32_t)cases.size() });
+			switchCases.insert(switchCases.end(), cases.begin(), cases.end());
+		}
+
+		// instrRefs - resolves the RefHandle's in instr, they are kept as is, if its &refs
+		void push(const Instr& instr, const RefTable* instrRefs = nullptr)
+		{
+			const auto handleOf = [&](const auto& r) {
+				if (r.isHandle() && instrRefs == &refs)
+					return r.handle();
+				return refs.intern(refEntryOf(r, instrRefs));
+			};
+			ezmatch(instr)(
+			varcase(const auto&) {
+				using T = std::remove_cvref_t<decltype(var)>;
+				using K = InstrArgKind;
+				constexpr InstrId id = INSTR_OP_CODE<T>;
+				constexpr K kind = instrArgKindOf<T>();
+
+				if constexpr (kind == K::NONE)
+					op(id);
+				else if constexpr (kind == K::I8 || kind == K::I16)
+					op(id, uint32_t(int32_t(var)));
+				else if constexpr (kind == K::POOL_U8 || kind == K::POOL_U16)
+					op(id, var.poolIdx);
+				else if constexpr (kind == K::RAW_BRANCH16 || kind == K::RAW_BRANCH32)
+					op(id, uint32_t(int32_t(var.jmpOffsetBytes)));
+				else if constexpr (kind == K::VAR)
+					op(id, var.varIdx);
+				else if constexpr (kind == K::ADD_VAR)
+					op(id, var.varIdx | uint32_t(uint16_t(var.val)) << 16);
+				else if constexpr (kind == K::IF || kind == K::GOTO)
+					op(id, uint32_t(var.jmpOffset));
+				else if constexpr (kind == K::TABLE_SWITCH)
+					tableSwitch(var->min, var->jmpOffsets, var->defaultJmpOffset);
+				else if constexpr (kind == K::LOOKUP_SWITCH || kind == K::SWITCH)
+					caseSwitch(id, var->cases, var->defaultJmpOffset);
+				else if constexpr (kind == K::REF || kind == K::REF_DYN)
+					ref(id, handleOf(var.ref));
+				else if constexpr (kind == K::REF_INTERFACE)
+					ref(id, handleOf(var.ref), var.argCount);
+				else if constexpr (kind == K::REF_OBJARR)
+					ref(id, handleOf(var.ref), var.dims);
+				else if constexpr (kind == K::ARR_TYPE)
+					op(id, (uint8_t)var.type);
+				else if constexpr (kind == K::PUSH_CONST)
+					ref(id, handleOf(var));
+				else if constexpr (kind == K::I32)
+					op(id, uint32_t(var));
+				else if constexpr (kind == K::F32)
+					op(id, std::bit_cast<uint32_t>(var));
+				else if constexpr (kind == K::I64)
+					pushI64(var);
+				else if constexpr (kind == K::F64)
+					pushF64(var);
+			}
+			);
+		}
+		void push(const std::span<const Instr> instrs, const RefTable* instrRefs = nullptr)
+		{
+			ops.reserve(ops.size() + instrs.size());
+			args.reserve(args.size() + instrs.size());
+			for (const Instr& instr : instrs)
+				push(instr, instrRefs);
+		}
+	};
+}
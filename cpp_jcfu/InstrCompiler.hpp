@@ -7,12 +7,19 @@
 #include <span>
 #include <bit>
 #include <map>
-#include <set>
+#include <optional>
+#include <algorithm>
 
 #include "State.hpp"
 #include "ext/CppMatch.hpp"
 #include "WriteBin.hpp"
+#include "SharedConstPool.hpp"
 #include "InstrVariant.hpp"
+#include "CodeCompileData.hpp"
+#include "StackFrameCalc.hpp"
+#include "SwitchPlan.hpp"
+#include "InstrBuffer.hpp"
+#include "Label.hpp"
 
 namespace cpp_jcfu
 {
@@ -29,8 +36,9 @@ namespace cpp_jcfu
 		}
 	}
 
+	// poolPush - (const ConstPoolEntry&) -> uint16_t pool index
 	inline CodeSlotKind slotKind2CodeSlotKind(
-		size_t& poolSize, ConstPool& consts,
+		const auto& poolPush,
 		const std::vector<uint16_t>& instrOffsets,
 		const SlotKind& slot
 		)
@@ -40,7 +48,7 @@ namespace cpp_jcfu
 			return CodeSlotKind(var);
 		},
 		varcase(const SlotKindType::OBJ&){
-			return CodeSlotKind(CodeSlotKindType::OBJ{ constPoolPush(poolSize,consts,{*var}) });
+			return CodeSlotKind(CodeSlotKindType::OBJ{ poolPush(constPoolEntryOf(*var)) });
 		},
 		varcase(const SlotKindType::RAW_OBJ&){
 			return CodeSlotKind(CodeSlotKindType::RAW_OBJ{ instrOffsets[var] });
@@ -48,18 +56,18 @@ namespace cpp_jcfu
 		);
 	}
 	inline void pushOpCodeId(
-		std::vector<uint8_t>& out,
+		ByteWriter& out,
 		std::vector<uint16_t>& instrOffsets,
 		size_t& curInstrOffset,
 		const uint16_t i,
 		const InstrId id)
 	{
-		out.push_back((uint8_t)id);
+		out.u8((uint8_t)id);
 		_ASSERT(curInstrOffset < UINT16_MAX);
 		instrOffsets[i] = uint16_t(curInstrOffset++);
 	}
 	inline void pushOpCodeByte(
-		std::vector<uint8_t>& out,
+		ByteWriter& out,
 		std::vector<uint16_t>& instrOffsets,
 		size_t& curInstrOffset,
 		const uint16_t i,
@@ -70,20 +78,20 @@ namespace cpp_jcfu
 		pushOpCodeId(out, instrOffsets, curInstrOffset, i, op);
 	}
 	inline void pushWideOpCodeId(
-		std::vector<uint8_t>& out,
+		ByteWriter& out,
 		std::vector<uint16_t>& instrOffsets,
 		size_t& curInstrOffset,
 		const uint16_t i,
 		const InstrId id)
 	{
-		out.push_back((uint8_t)InstrId::I_WIDE);
-		out.push_back((uint8_t)id);
+		out.u8((uint8_t)InstrId::I_WIDE);
+		out.u8((uint8_t)id);
 		_ASSERT(curInstrOffset < (UINT16_MAX - 1));
 		instrOffsets[i] = uint16_t(curInstrOffset);
 		curInstrOffset += 2;
 	}
 	inline void pushWideOpCodeByte(
-		std::vector<uint8_t>& out,
+		ByteWriter& out,
 		std::vector<uint16_t>& instrOffsets,
 		size_t& curInstrOffset,
 		const uint16_t i,
@@ -95,21 +103,21 @@ namespace cpp_jcfu
 	}
 
 	inline void pushConstPoolInstrW(
-		std::vector<uint8_t>& out,
+		ByteWriter& out,
 		std::vector<uint16_t>& instrOffsets,
 		size_t& curInstrOffset,
 		const uint16_t i,
-		size_t& poolSize, ConstPool& consts,
-		ConstPoolItm&& itm)
+		const auto& poolPush,
+		const ConstPoolEntry& e)
 	{
-		const bool isBig = isPoolItemBig(itm);
-		const uint16_t idx = constPoolPush(poolSize, consts, std::move(itm));
+		const bool isBig = e.isBig();
+		const uint16_t idx = poolPush(e);
 
 		if (isBig)
 		{
 			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
 				InstrId::I_PUSH_CONST2_U16);
-			u16w(out, idx);
+			out.u16(idx);
 			curInstrOffset += 2;
 			return;
 		}
@@ -117,16 +125,113 @@ namespace cpp_jcfu
 		{
 			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
 				InstrId::I_PUSH_CONST_U8);
-			out.push_back((uint8_t)idx);
+			out.u8((uint8_t)idx);
 			curInstrOffset++;
 			return;
 		}
 		pushOpCodeId(out, instrOffsets, curInstrOffset, i,
 			InstrId::I_PUSH_CONST_U16);
-		u16w(out, idx);
+		out.u16(idx);
 		curInstrOffset += 2;
 	}
 
+	// Has a fconst_* / dconst_* opcode, -0.0 doesnt, as that would push +0.0
+	constexpr bool isOpCodeF32(const float v) {
+		return std::bit_cast<uint32_t>(v) == 0 || v == 1.0f || v == 2.0f;
+	}
+	constexpr bool isOpCodeF64(const double v) {
+		return std::bit_cast<uint64_t>(v) == 0 || v == 1.0;
+	}
+
+	// Is it loadable with a 1 byte idx (ldc)
+	constexpr bool isLdcPoolEntry(const ConstPoolEntry& e)
+	{
+		switch (e.id)
+		{
+		case ConstPoolItmId::STR:
+		case ConstPoolItmId::I32:
+		case ConstPoolItmId::F32:
+		case ConstPoolItmId::CLASS:
+		case ConstPoolItmId::FUNC_HANDLE:
+		case ConstPoolItmId::FUNC_TYPE:
+			return true;
+		default:
+			return false;
+		}
+	}
+	// @returns the pool entry, if compileCode would turn the instruction into a ldc / ldc_w
+	// Its strings point into instr, or refs
+	// refs - resolves the RefHandle's, can be nullptr if there are none
+	inline std::optional<ConstPoolEntry> ldcPoolEntryOf(const Instr& instr, const RefTable* refs = nullptr)
+	{
+		std::optional<ConstPoolEntry> ret;
+		ezmatch(instr)(
+		varcase(const auto&) {},
+		varcase(const InstrType::PUSH_CONST&) {
+			const ConstPoolEntry e = refEntryOf(var, refs);
+			if (isLdcPoolEntry(e))
+				ret = e;
+		},
+		varcase(const InstrType::PUSH_I32_I32) {
+			if (var > INT16_MAX || var < INT16_MIN)
+				ret = constPoolEntryOf(ConstPoolItmType::I32(var));
+		},
+		varcase(const InstrType::PUSH_F32_F32) {
+			if (!isOpCodeF32(var))
+				ret = constPoolEntryOf(ConstPoolItmType::F32(var));
+		}
+		);
+		return ret;
+	}
+
+	// Optional, call before compileCode, with the instructions of every method in the class.
+	//
+	// Pushes the constants used by ldc's, most used first, so
+	// that more of them get a index <= 255, and a 2 byte ldc,
+	// instead of a 3 byte ldc_w.
+	// refs - resolves the RefHandle's, can be nullptr if there are none
+	inline void orderLdcConsts(
+		size_t& poolSize, ConstPool& consts,
+		std::span<const std::span<const Instr>> methods,
+		const RefTable* refs = nullptr)
+	{
+		ConstPool seen;// The pool index is used as the idx into uses
+		std::vector<uint32_t> uses;
+
+		for (const std::span<const Instr> instrs : methods)
+		{
+			for (const Instr& instr : instrs)
+			{
+				const std::optional<ConstPoolEntry> e = ldcPoolEntryOf(instr, refs);
+				if (!e.has_value())
+					continue;
+
+				// No copy, the instructions & refs outlive seen
+				const auto [id, added] = seen.intern(*e, (uint16_t)uses.size(), false);
+				if (added)
+					uses.push_back(0);
+				uses[id]++;
+			}
+		}
+		std::vector<uint16_t> order(uses.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = (uint16_t)i;
+
+		// Stable, so ties keep the order they were first used in
+		std::stable_sort(order.begin(), order.end(), [&](const uint16_t a, const uint16_t b) {
+			return uses[a] > uses[b];
+		});
+		for (const uint16_t id : order)
+		{
+			if (poolSize > UINT8_MAX)
+				break;// The rest will need a ldc_w anyway
+			constPoolPush(poolSize, consts, seen[id]);
+		}
+	}
+
+	// Largest instruction, that isnt a switch: a long if (if + goto_w)
+	inline constexpr size_t MAX_FIXED_INSTR_SIZE = 3 + 5;
+
 	struct PatchPoint
 	{
 		uint32_t instrOffset : 30;//Packed!!!
@@ -135,9 +240,11 @@ namespace cpp_jcfu
 
 		uint16_t instrIdx;
 		uint16_t byteOffset;
+		// Where the jump is measured from, relative to the instruction (3 for a long if, more inside a SWITCH)
+		uint16_t originDelta = 0;
 	};
 	inline void writePatchPoint32(
-		std::vector<uint8_t>& out,
+		ByteWriter& out,
 		size_t& curInstrOffset,
 		const uint16_t i,
 		std::vector<PatchPoint>& instrPatchPoints,
@@ -145,23 +252,24 @@ namespace cpp_jcfu
 		const bool isLongIf=false)
 	{
 		_ASSERT(curInstrOffset <= UINT16_MAX - 4);
-		u32w(out, 0);
+		out.u32(0);
 		instrPatchPoints.emplace_back(
 			(uint32_t)jmpOffset,
 			true, isLongIf, i,
-			(uint16_t)curInstrOffset
+			(uint16_t)curInstrOffset,
+			uint16_t(isLongIf ? 3 : 0)
 		);
 		curInstrOffset += 4;
 	}
 	inline void writePatchPoint16(
-		std::vector<uint8_t>& out,
+		ByteWriter& out,
 		size_t& curInstrOffset,
 		const uint16_t i,
 		std::vector<PatchPoint>& instrPatchPoints,
 		const int32_t jmpOffset)
 	{
 		_ASSERT(curInstrOffset <= UINT16_MAX - 2);
-		u16w(out, 0);
+		out.u16(0);
 		instrPatchPoints.emplace_back(
 			(uint32_t)jmpOffset,
 			false,false, i,
@@ -199,82 +307,666 @@ namespace cpp_jcfu
 		&& !BaseBranched<T>
 		&& !PushConstXed<T>;
 
-	//https://docs.oracle.com/javase/specs/jvms/se24/html/jvms-4.html#jvms-4.7.4
-	//Required on every ErrorHandler::startInstr, and every Goto/If/Switch target
-	// add it to (.instructionFrames)
-	// 
-	//Additionaly: if a 'if' could ever jump >32k bytes, it needs it too,
-	// but to keep things optimized, you only need it on (.ifInstructionFrames)
-	struct StackFrame
+	// Memory compileCode needs while working, keep it around to stop reallocating it for every function
+	struct CodeCompileScratch
 	{
-		std::vector<SlotKind> stack;
-		std::vector<SlotKind> local;
+		struct SwitchPad
+		{
+			uint16_t instrIdx;
+			uint8_t padBytes;
+		};
+
+		ByteWriter out;
+		std::vector<uint16_t> instrOffsets;
+		std::vector<PatchPoint> instrPatchPoints;
+		std::vector<SwitchPad> switchPads;
+		std::vector<SwitchCase> switchCases;
+		std::vector<uint16_t> refPoolIdxs;// By RefHandle, 0 if not pushed yet
+		std::vector<uint16_t> neededIfFrames;
+		std::vector<std::pair<uint16_t, const StackFrame*>> frameList;
+
+		// Only used with calcFrames
+		FrameCalcScratch frameCalc;
+		std::vector<std::pair<uint16_t, StackFrame>> calcedFrames;
+		std::vector<uint16_t> longIfNexts;
+
+		// Only used by CodeBuilder's labels
+		LabelTable labels;
+		std::vector<uint32_t> labelPatchPoints;// Into instrPatchPoints, their instrOffset is a label id until finish()
+		std::vector<int32_t> labelJmpOffsets;
+		std::vector<SwitchCase> labelCases;
+		std::vector<ErrorHandler> labelHandlers;
+		std::vector<std::array<Label, 3>> labelHandlerRanges;// start, end, handler
+
+		// Only used when some 16 bit branch doesnt fit
+		ByteWriter relaxedOut;
+		std::vector<uint32_t> relaxedOffsets;
+		std::vector<uint8_t> instrGrowth;
+
+		// Keeps the memory
+		void clear()
+		{
+			out.clear();
+			instrOffsets.clear();
+			instrPatchPoints.clear();
+			switchPads.clear();
+			refPoolIdxs.clear();
+			labels.clear();
+			labelPatchPoints.clear();
+			labelHandlers.clear();
+			labelHandlerRanges.clear();
+			neededIfFrames.clear();
+			frameList.clear();
+			calcedFrames.clear();
+			longIfNexts.clear();
+		}
 	};
-	struct LineNumEntry
+
+	// Padding after a switch opcode at instrOffset, so its jump table is 4 byte aligned
+	constexpr uint8_t switchPadBytes(const size_t instrOffset) {
+		return uint8_t((4 - ((instrOffset + 1) % 4)) % 4);
+	}
+	inline bool fitsBranch16(const int64_t movement) {
+		return movement <= INT16_MAX && movement >= INT16_MIN;
+	}
+
+	// Code is emitted with every branch that might fit being 16 bit.
+	// 
+	// This widens the ones that dont: goto -> goto_w, if -> (!if +8, goto_w)
+	// Widening moves code, which can push other branches out of range, and change switch padding,
+	// so sizes are recalculated until nothing else needs widening. (Each pass is linear, and it
+	// only ever widens, so it stops, usually after 2-3 passes)
+	// Then the code is rebuilt once, and instrOffsets & the patch points are moved to match.
+	//
+	// Every branch must be at the start of its instruction, or in a plain switch (see branchesFit16)
+	inline void relaxBranches(CodeCompileScratch& scratch)
 	{
-		uint16_t startInstr;
-		uint16_t line;
-	};
-	struct LocalEntry
+		ByteWriter& out = scratch.out;
+		std::vector<uint16_t>& instrOffsets = scratch.instrOffsets;//Has the end offset too
+		std::vector<PatchPoint>& instrPatchPoints = scratch.instrPatchPoints;
+		const std::vector<CodeCompileScratch::SwitchPad>& switchPads = scratch.switchPads;
+		const size_t instrCount = instrOffsets.size() - 1;
+
+		std::vector<uint32_t>& newOffsets = scratch.relaxedOffsets;
+		std::vector<uint8_t>& growth = scratch.instrGrowth;
+
+		// Widens every 16 bit branch that doesnt fit with these offsets
+		/// @returns if anything was widened
+		const auto widen = [&](const auto& offsets) {
+			bool widened = false;
+			for (PatchPoint& pp : instrPatchPoints)
+			{
+				if (pp.is32Bit)
+					continue;
+				const int32_t instrOffset = int32_t(pp.instrOffset << 2) >> 2;//carry top bit
+				// Like branchesFit16, jumps inside a SWITCH are measured from their own opcode
+				const int64_t movement = int64_t(offsets[pp.instrIdx + instrOffset])
+					- int64_t(offsets[pp.instrIdx] + pp.originDelta);
+				if (fitsBranch16(movement))
+					continue;
+
+				// Only a branch at the start of its instruction can be rebuilt
+				_ASSERT(pp.originDelta == 0);
+				if (!widened)
+				{
+					widened = true;
+					if (growth.empty())// First one, nothing was sized yet
+						growth.assign(instrCount, 0);
+				}
+				pp.is32Bit = true;
+				pp.isLongIf = InstrId(out[pp.byteOffset - 1]) != InstrId::I_GOTO16;
+				pp.originDelta = pp.isLongIf ? 3 : 0;
+				growth[pp.instrIdx] = pp.isLongIf ? 5 : 2;
+			}
+			return widened;
+		};
+		growth.clear();
+		if (!widen(instrOffsets))
+			return;//Everything fits, nothing moves
+
+		newOffsets.resize(instrCount + 1);
+		do
+		{
+			size_t curOffset = 0;
+			auto itSwitch = switchPads.begin();
+			for (size_t i = 0; i < instrCount; i++)
+			{
+				newOffsets[i] = (uint32_t)curOffset;
+				size_t size = instrOffsets[i + 1] - instrOffsets[i] + growth[i];
+				if (itSwitch != switchPads.end() && itSwitch->instrIdx == i)
+				{
+					size = size - itSwitch->padBytes + switchPadBytes(curOffset);
+					++itSwitch;
+				}
+				curOffset += size;
+			}
+			newOffsets[instrCount] = (uint32_t)curOffset;
+		} while (widen(newOffsets));
+
+		_ASSERT(newOffsets[instrCount] <= UINT16_MAX && "Code too large (64KB)");
+
+		// Rebuild, copying the runs between changed instructions as is
+		ByteWriter& relaxed = scratch.relaxedOut;
+		relaxed.clear();
+		relaxed.ensure(newOffsets[instrCount]);
+
+		auto itSwitch = switchPads.begin();
+		size_t copiedTo = 0;//in out
+		for (size_t i = 0; i < instrCount; i++)
+		{
+			const bool isSwitch = itSwitch != switchPads.end() && itSwitch->instrIdx == i;
+			if (growth[i] == 0 && !isSwitch)
+				continue;
+
+			relaxed.bytes(std::span(out.data() + copiedTo, instrOffsets[i] - copiedTo));
+			const uint8_t* instr = out.data() + instrOffsets[i];
+
+			if (isSwitch)
+			{
+				const size_t restStart = 1 + itSwitch->padBytes;
+				relaxed.u8(instr[0]);
+				relaxed.fill(switchPadBytes(newOffsets[i]), 0);
+				relaxed.bytes(std::span(instr + restStart, instrOffsets[i + 1] - instrOffsets[i] - restStart));
+				++itSwitch;
+			}
+			else if (growth[i] == 2)
+			{
+				relaxed.u8((uint8_t)InstrId::I_GOTO32);
+				relaxed.u32(0);
+			}
+			else
+			{
+				relaxed.u8((uint8_t)invertIfInstr(InstrId(instr[0])));
+				relaxed.u16(1 + 2 + 1 + 4);//skip thisInstr, goto32
+				relaxed.u8((uint8_t)InstrId::I_GOTO32);
+				relaxed.u32(0);
+			}
+			copiedTo = instrOffsets[i + 1];
+		}
+		relaxed.bytes(std::span(out.data() + copiedTo, out.size() - copiedTo));
+		_ASSERT(relaxed.size() == newOffsets[instrCount]);
+
+		// Move the patch points, they are in instruction order
+		itSwitch = switchPads.begin();
+		for (PatchPoint& pp : instrPatchPoints)
+		{
+			const uint16_t i = pp.instrIdx;
+			if (growth[i] != 0)
+			{
+				pp.byteOffset = uint16_t(newOffsets[i] + (pp.isLongIf ? 4 : 1));
+				continue;
+			}
+			while (itSwitch != switchPads.end() && itSwitch->instrIdx < i)
+				++itSwitch;
+
+			size_t byteOffset = pp.byteOffset - instrOffsets[i] + newOffsets[i];
+			if (itSwitch != switchPads.end() && itSwitch->instrIdx == i)
+				byteOffset = byteOffset - itSwitch->padBytes + switchPadBytes(newOffsets[i]);
+			pp.byteOffset = (uint16_t)byteOffset;
+		}
+		for (size_t i = 0; i <= instrCount; i++)
+			instrOffsets[i] = (uint16_t)newOffsets[i];
+
+		std::swap(out, relaxed);
+	}
+
+	// If relaxBranches has nothing to do
+	inline bool branchesFit16(const CodeCompileScratch& scratch)
 	{
-		std::string name;
-		std::string desc;
-		uint16_t startInstr;
-		uint16_t instrCount;
-		uint16_t idx;
-	};
-	struct LocalTypeEntry
+		const std::vector<uint16_t>& instrOffsets = scratch.instrOffsets;//Has the end offset too
+		for (const PatchPoint& pp : scratch.instrPatchPoints)
+		{
+			if (pp.is32Bit)
+				continue;
+			const int32_t instrOffset = int32_t(pp.instrOffset << 2) >> 2;//carry top bit
+			const int64_t movement = int64_t(instrOffsets[pp.instrIdx + instrOffset])
+				- int64_t(instrOffsets[pp.instrIdx] + pp.originDelta);
+			if (!fitsBranch16(movement))
+				return false;
+		}
+		return true;
+	}
+
+	// compileCode state for the SWITCH's of a function
+	struct SwitchEmitState
 	{
-		std::string name;
-		std::string sig;
-		uint16_t startInstr;
-		uint16_t instrCount;
-		uint16_t idx;
+		// Only emit plain table / lookup switches, set when the code is emitted again for relaxBranches
+		bool plainOnly = false;
+		// The slot after every other local, set on the first SWITCH
+		std::optional<uint16_t> tempVar{};
+
+		bool hasSplitSwitch = false;// Some SWITCH has compares, so relaxBranches cant handle it
+		bool usedTempVar = false;
+		bool usedCompare = false;
 	};
-	struct ErrorHandler
+
+	// Instruction writers, shared by the Instr and InstrBuffer versions of compileCode.
+	// Only the switches ensure their own size, the rest fit in MAX_FIXED_INSTR_SIZE
+
+	inline void pushI32InstrW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const auto& poolPush,
+		const int32_t var)
 	{
-		std::optional<ConstPoolItmType::CLASS> catchType; // None -> catch all
-		uint16_t startInstr;
-		uint16_t endInstr;
-		uint16_t handlerInstr;
-	};
-	struct CodeCompileData
+		if (var <= INT8_MAX
+			&& var >= INT8_MIN)
+		{// Small, so opcode, or i8
+			if (var <= 5
+				&& var >= -1)
+			{// Tiny, so use a opcode
+				pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+					InstrId((int8_t)InstrId::PUSH_I32_0 + (int8_t)var));
+				return;
+			}
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+				InstrId::I_PUSH_I32_I8);
+			out.u8((int8_t)var);
+			curInstrOffset++;
+			return;
+		}
+		// Not i8
+		if (var <= INT16_MAX
+			&& var >= INT16_MIN)
+		{// Short, so i16
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+				InstrId::I_PUSH_I32_I16);
+			out.u16((int16_t)var);
+			curInstrOffset += 2;
+			return;
+		}
+		// Not i16 !!
+		pushConstPoolInstrW(out,
+			instrOffsets, curInstrOffset, i,
+			poolPush,
+			constPoolEntryOf(ConstPoolItmType::I32(var)));
+	}
+	inline void pushF32InstrW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const auto& poolPush,
+		const float var)
 	{
-		std::span<const Instr> instrs;
-		std::span<const ErrorHandler> errorHandlers;
+		if (isOpCodeF32(var))
+		{
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+				InstrId((uint8_t)InstrId::PUSH_F32_0 + (uint8_t)var));
+			return;
+		}
+		pushConstPoolInstrW(out,
+			instrOffsets, curInstrOffset, i,
+			poolPush,
+			constPoolEntryOf(ConstPoolItmType::F32(var)));
+	}
+	inline void pushI64InstrW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const auto& poolPush,
+		const int64_t var)
+	{
+		if (var == 0 || var==1)
+		{
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+				InstrId((uint8_t)InstrId::PUSH_I64_0 + (uint8_t)var));
+			return;
+		}
+		pushConstPoolInstrW(out,
+			instrOffsets, curInstrOffset, i,
+			poolPush,
+			constPoolEntryOf(ConstPoolItmType::I64(var)));
+	}
+	inline void pushF64InstrW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const auto& poolPush,
+		const double var)
+	{
+		if (isOpCodeF64(var))
+		{
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+				InstrId((uint8_t)InstrId::PUSH_F64_0 + (uint8_t)var));
+			return;
+		}
+		pushConstPoolInstrW(out,
+			instrOffsets, curInstrOffset, i,
+			poolPush,
+			constPoolEntryOf(ConstPoolItmType::F64(var)));
+	}
+	// iload, istore, ret, ... with a u8 idx, or wide
+	inline void pushVarInstrW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const InstrId id,
+		const uint16_t varIdx)
+	{
+		if (varIdx <= UINT8_MAX)
+		{
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+			out.u8((uint8_t)varIdx);
+			curInstrOffset++;
+			return;
+		}
+		pushWideOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+		out.u16(varIdx);
+		curInstrOffset += 2;
+	}
+	inline void pushAddVarInstrW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const uint16_t varIdx,
+		const int16_t val)
+	{
+		if (varIdx <= UINT8_MAX
+			&& val <= INT8_MAX
+			&& val >= INT8_MIN)
+		{
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+				InstrId::I_ADD_I32_VAR_U8_CI8);
+			out.u8((uint8_t)varIdx);
+			out.u8((int8_t)val);
+			curInstrOffset += 2;
+			return;
+		}
+		pushWideOpCodeId(out, instrOffsets, curInstrOffset, i,
+			InstrId::I_ADD_I32_VAR_U8_CI8);
+		out.u16(varIdx);
+		out.u16(val);
+		curInstrOffset += 4;
+	}
+	inline void pushGotoW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		std::vector<PatchPoint>& instrPatchPoints,
+		const int32_t jmpOffset)
+	{
+		if (jmpOffset > INT16_MAX || jmpOffset < INT16_MIN)
+		{// Always 32
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i, 
+				InstrId::I_GOTO32);
+			writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, jmpOffset);
+			return;
+		}
+		// Hope for 16
+		pushOpCodeId(out, instrOffsets, curInstrOffset, i,
+			InstrId::I_GOTO16);
+		writePatchPoint16(out, curInstrOffset, i, instrPatchPoints, jmpOffset);
+	}
+	inline void pushIfW(
+		ByteWriter& out,
+		std::vector<uint16_t>& instrOffsets,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		std::vector<PatchPoint>& instrPatchPoints,
+		const InstrId id,
+		const int32_t jmpOffset)
+	{
+		if (jmpOffset > INT16_MAX || jmpOffset < INT16_MIN)
+		{// Always 32
+
+			pushOpCodeId(out, instrOffsets, curInstrOffset, i, invertIfInstr(id));
+			out.u16(1 + 2 +1+4);//skip thisInstr, goto32
+
+			out.u8((uint8_t)InstrId::I_GOTO32);
+			curInstrOffset += 3;
+			writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, jmpOffset,true);
+			return;
+		}
+		pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+		// Hope for 16
+		writePatchPoint16(out,curInstrOffset,i, instrPatchPoints,jmpOffset);
+	}
+	// Ensures its size
+	inline void pushTableSwitchW(
+		CodeCompileScratch& scratch,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const int32_t min,
+		const std::span<const int32_t> jmpOffsets,
+		const int32_t defaultJmpOffset)
+	{
+		ByteWriter& out = scratch.out;
+		pushOpCodeId(out, scratch.instrOffsets, curInstrOffset, i, InstrId::TABLE_SWITCH);
 
-		// Will not be added to binary, only used to optimize out some instructionFrames, that dont need to exist
-		std::vector<SlotKind> startFrameLocals;
-		std::map<uint16_t, StackFrame> instructionFrames;
-		//Only ones that jump >32k will be used! (will error, if missing)
-		std::map<uint16_t, StackFrame> ifInstructionFrames;
+		const uint8_t padBytes = switchPadBytes(scratch.instrOffsets[i]);
+		scratch.switchPads.push_back({ i, padBytes });
+		out.ensure(3 + 4 * 3 + 4 * jmpOffsets.size());
+		out.fill(padBytes, 0);
+		curInstrOffset += padBytes;
 
-		std::vector<LineNumEntry> lineNums;
-		std::vector<LocalEntry> localVars;
-		std::vector<LocalTypeEntry> localVarTypes;
+		writePatchPoint32(out, curInstrOffset, i, scratch.instrPatchPoints, defaultJmpOffset);
+		out.u32(min);
+		out.u32(uint32_t(uint32_t(min) + jmpOffsets.size() - 1));
+		curInstrOffset += 8;
 
-		uint16_t maxStack;
-		uint16_t maxLocals;
-	};
-	inline FuncTagType::CODE compileCode(
-		size_t& poolSize, ConstPool& consts,
-		const CodeCompileData& data
-	)
+		for (const int32_t jmpOffset : jmpOffsets)
+		{
+			writePatchPoint32(out, curInstrOffset, i, scratch.instrPatchPoints, jmpOffset);
+		}
+	}
+	// Ensures its size, cases must be sorted
+	inline void pushLookupSwitchW(
+		CodeCompileScratch& scratch,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const std::span<const SwitchCase> cases,
+		const int32_t defaultJmpOffset)
 	{
-		const std::span<const Instr> instrs = data.instrs;
+		ByteWriter& out = scratch.out;
+		pushOpCodeId(out, scratch.instrOffsets, curInstrOffset, i, InstrId::LOOKUP_SWITCH);
 
-		_ASSERT(instrs.size() < UINT16_MAX);
+		const uint8_t padBytes = switchPadBytes(scratch.instrOffsets[i]);
+		scratch.switchPads.push_back({ i, padBytes });
+		out.ensure(3 + 4 * 2 + 8 * cases.size());
+		out.fill(padBytes, 0);
+		curInstrOffset += padBytes;
 
-		std::vector<PatchPoint> instrPatchPoints;
-		std::vector<uint16_t> instrOffsets(instrs.size());
-		size_t curInstrOffset = 0;
+		writePatchPoint32(out, curInstrOffset, i, scratch.instrPatchPoints, defaultJmpOffset);
 
-		std::vector<uint8_t> out;
-		out.reserve(instrs.size() + (instrs.size() >> 3)); // 1.125X scaling
+		_ASSERT(cases.size() < UINT32_MAX);
+		out.u32(uint32_t(cases.size()));
+		curInstrOffset += 4;
 
-		for (uint16_t i = 0; i < instrs.size(); i++)
+		for (const SwitchCase& kase : cases)
 		{
-			const Instr& instr = instrs[i];
+			out.u32(kase.k);
+			curInstrOffset += 4;
+			writePatchPoint32(out, curInstrOffset, i, scratch.instrPatchPoints, kase.jmpOffset);
+		}
+	}
+	// SWITCH, see SwitchPlan. Ensures its size
+	// tempVar - where the key is saved, if it needs to be compared more than once
+	inline void pushSwitchW(
+		CodeCompileScratch& scratch,
+		size_t& curInstrOffset,
+		const uint16_t i,
+		const auto& poolPush,
+		SwitchEmitState& sw,
+		const uint16_t tempVar,
+		const std::span<const SwitchCase> unsortedCases,
+		const int32_t defaultJmpOffset)
+	{
+		ByteWriter& out = scratch.out;
+		std::vector<uint16_t>& instrOffsets = scratch.instrOffsets;
+		std::vector<PatchPoint>& instrPatchPoints = scratch.instrPatchPoints;
+
+		std::vector<SwitchCase>& cases = scratch.switchCases;
+		cases.assign(unsortedCases.begin(), unsortedCases.end());
+		std::sort(cases.begin(), cases.end(), [](const SwitchCase& a, const SwitchCase& b) {
+			return a.k < b.k;
+		});
+		_ASSERT(std::adjacent_find(cases.begin(), cases.end(), [](const SwitchCase& a, const SwitchCase& b) {
+			return a.k == b.k;
+		}) == cases.end() && "SWITCH has a key twice");
+
+		const SwitchPlan plan = planSwitch(cases, tempVar, sw.plainOnly);
+		const size_t compareCount = plan.compareCount(cases.size());
+		const std::span<const SwitchCase> main = std::span<const SwitchCase>(cases)
+			.subspan(plan.mainStart, plan.mainEnd - plan.mainStart);
+
+		const size_t mainSize = plan.kind == SwitchPlan::Kind::TABLE
+			? 4 * 3 + 4 * detail::switchTableRange(main)
+			: 4 * 2 + 8 * main.size();
+		// save, (load, ldc_w, if) per compare, load, switch with padding
+		out.ensure(4 + compareCount * (4 + 3 + 3) + 4 + 4 + mainSize);
+
+		_ASSERT(curInstrOffset < UINT16_MAX);
+		const size_t start = curInstrOffset;
+
+		// The pushXW's below set instrOffsets[i] too, its put back at the end
+		const auto op = [&](const InstrId id) {
+			out.u8((uint8_t)id);
+			curInstrOffset++;
+		};
+		const auto tempVarOp = [&](const InstrId shortId, const InstrId id) {
+			if (tempVar <= 3)
+				return op(InstrId((uint8_t)shortId + tempVar));
+			pushVarInstrW(out, instrOffsets, curInstrOffset, i, id, tempVar);
+		};
+		// Hope for 16, like GOTO
+		const auto jmp16 = [&](const InstrId id, const int32_t jmpOffset) {
+			const uint16_t originDelta = uint16_t(curInstrOffset - start);
+			op(id);
+			writePatchPoint16(out, curInstrOffset, i, instrPatchPoints, jmpOffset);
+			instrPatchPoints.back().originDelta = originDelta;
+		};
+		const auto compare = [&](const SwitchCase& kase) {
+			if (plan.needsTempVar)
+				tempVarOp(InstrId::I_PUSH_I32_VAR_0, InstrId::PUSH_I32_VAR_U16);
+			if (kase.k == 0)
+				return jmp16(InstrId::IF_EQL, kase.jmpOffset);
+			pushI32InstrW(out, instrOffsets, curInstrOffset, i, poolPush, kase.k);
+			jmp16(InstrId::IF_I32_EQL, kase.jmpOffset);
+		};
+
+		if (plan.needsTempVar)
+			tempVarOp(InstrId::I_SAVE_I32_VAR_0, InstrId::SAVE_I32_VAR_U16);
+		for (size_t c = 0; c < plan.mainStart; c++)
+			compare(cases[c]);
+		for (size_t c = plan.mainEnd; c < cases.size(); c++)
+			compare(cases[c]);
+
+		if (plan.kind == SwitchPlan::Kind::NONE)
+		{
+			if (compareCount == 0)
+				op(InstrId::POP_1);
+			jmp16(InstrId::I_GOTO16, defaultJmpOffset);
+		}
+		else
+		{
+			if (plan.needsTempVar)
+				tempVarOp(InstrId::I_PUSH_I32_VAR_0, InstrId::PUSH_I32_VAR_U16);
+
+			const size_t opAt = curInstrOffset;
+			const uint16_t originDelta = uint16_t(opAt - start);
+			op(plan.kind == SwitchPlan::Kind::TABLE ? InstrId::TABLE_SWITCH : InstrId::LOOKUP_SWITCH);
+
+			const uint8_t padBytes = switchPadBytes(opAt);
+			if (plan.isPlainSwitch())
+				scratch.switchPads.push_back({ i, padBytes });
+			out.fill(padBytes, 0);
+			curInstrOffset += padBytes;
+
+			const auto jmp32 = [&](const int32_t jmpOffset) {
+				writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, jmpOffset);
+				instrPatchPoints.back().originDelta = originDelta;
+			};
+			jmp32(defaultJmpOffset);
+			if (plan.kind == SwitchPlan::Kind::TABLE)
+			{
+				out.u32(main.front().k);
+				out.u32(main.back().k);
+				curInstrOffset += 8;
+
+				// Holes go to the default
+				int64_t k = main.front().k;
+				for (const SwitchCase& kase : main)
+				{
+					for (; k < kase.k; k++)
+						jmp32(defaultJmpOffset);
+					jmp32(kase.jmpOffset);
+					k++;
+				}
+			}
+			else
+			{
+				out.u32(uint32_t(main.size()));
+				curInstrOffset += 4;
+
+				for (const SwitchCase& kase : main)
+				{
+					out.u32(kase.k);
+					curInstrOffset += 4;
+					jmp32(kase.jmpOffset);
+				}
+			}
+		}
+		instrOffsets[i] = (uint16_t)start;
+
+		sw.hasSplitSwitch |= !plan.isPlainSwitch();
+		sw.usedTempVar |= plan.needsTempVar;
+		sw.usedCompare |= compareCount != 0;
+	}
+
+	namespace detail
+	{
+		/// @returns the pool index of handle, each handle is only pushed once
+		inline uint16_t handlePoolIdxOf(
+			const auto& poolPush,
+			CodeCompileScratch& scratch,
+			const RefTable* refs,
+			const RefHandle handle)
+		{
+			_ASSERT(refs != nullptr && "Ref is a handle, but there is no RefTable");
+			// 0 is never a valid pool index. Grows lazily, as a CodeBuilder's table can grow while emitting
+			std::vector<uint16_t>& refPoolIdxs = scratch.refPoolIdxs;
+			const size_t h = size_t(handle);
+			if (h >= refPoolIdxs.size())
+				refPoolIdxs.resize(std::max(h + 1, refs->size()), 0);
+			if (refPoolIdxs[h] == 0)
+				refPoolIdxs[h] = poolPush((*refs)[handle]);
+			return refPoolIdxs[h];
+		}
+		/// @returns the pool index of ref, each handle is only pushed once
+		inline uint16_t refPoolIdxOf(
+			const auto& poolPush,
+			CodeCompileScratch& scratch,
+			const RefTable* refs,
+			const auto& ref)
+		{
+			if (!ref.isHandle())
+				return poolPush(constPoolEntryOf(*ref));
+			return handlePoolIdxOf(poolPush, scratch, refs, ref.handle());
+		}
+		// Writes 1 instruction into scratch.out, instrOffsets[i] must exist
+		// switchTempVar - () -> uint16_t, only called for the first SWITCH that might need it
+		inline void emitInstr(
+			const auto& poolPush,
+			const RefTable* refs,
+			CodeCompileScratch& scratch,
+			size_t& curInstrOffset,
+			SwitchEmitState& sw,
+			const auto& switchTempVar,
+			const uint16_t i,
+			const Instr& instr
+		)
+		{
+			ByteWriter& out = scratch.out;
+			std::vector<uint16_t>& instrOffsets = scratch.instrOffsets;
+			std::vector<PatchPoint>& instrPatchPoints = scratch.instrPatchPoints;
 
 			ezmatch(instr)(
 			// Easy 1 byte instructions
@@ -286,138 +978,83 @@ namespace cpp_jcfu
 
 			varcase(const InstrType::I_PUSH_I32_I8) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				out.push_back(var);
+				out.u8(var);
 				curInstrOffset++;
 			},
 			varcase(const InstrType::I_PUSH_I32_I16) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				u16w(out, var);
+				out.u16(var);
 				curInstrOffset += 2;
 			},
 			varcase(const InstrType::I_PUSH_CONST_U8) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				out.push_back(var.poolIdx);
+				out.u8(var.poolIdx);
 				curInstrOffset++;
 			},
 			varcase(const PushConstXed auto) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				u16w(out, var.poolIdx);
+				out.u16(var.poolIdx);
 				curInstrOffset += 2;
 			},
 
 			varcase(const BaseBranched16 auto) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				u16w(out, var.jmpOffsetBytes);
+				out.u16(var.jmpOffsetBytes);
 				curInstrOffset += 2;
 			},
 
 			varcase(const InstrType::TABLE_SWITCH&) {
-				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-
-				const uint8_t padBytes = (4 - (out.size() % 4)) % 4;
-				out.insert(out.end(), padBytes, 0);
-				curInstrOffset += padBytes;
-
-				writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, var->defaultJmpOffset);
-				u32w(out, var->min);
-				u32w(out, uint32_t(uint32_t(var->min) + var->jmpOffsets.size() - 1));
-				curInstrOffset += 8;
-
-				for (const int32_t jmpOffset : var->jmpOffsets)
-				{
-					writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, jmpOffset);
-				}
+				pushTableSwitchW(scratch, curInstrOffset, i, var->min, var->jmpOffsets, var->defaultJmpOffset);
 			},
 			varcase(const InstrType::LOOKUP_SWITCH&) {
-				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-
-				const uint8_t padBytes = (4 - (out.size() % 4))%4;
-				out.insert(out.end(), padBytes, 0);
-				curInstrOffset += padBytes;
-
-				writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, var->defaultJmpOffset);
-
-				_ASSERT(var->cases.size() < UINT32_MAX);
-				u32w(out, uint32_t(var->cases.size()));
-				curInstrOffset += 4;
-
-				for (const SwitchCase& kase : var->cases)
-				{
-					u32w(out, kase.k);
-					curInstrOffset += 4;
-					writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, kase.jmpOffset);
-				}
+				pushLookupSwitchW(scratch, curInstrOffset, i, var->cases, var->defaultJmpOffset);
 			},
 
 			varcase(const BaseRefed auto&) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				constPoolIdxPushW(out, poolSize, consts, *var.ref);
+				out.u16(refPoolIdxOf(poolPush, scratch, refs, var.ref));
 				curInstrOffset += 2;
 			},
 			varcase(const InstrType::PUSH_RUN_INTERFACE&) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				constPoolIdxPushW(out, poolSize, consts, *var.ref);
-				out.push_back(var.argCount);
-				out.push_back(0);
+				out.u16(refPoolIdxOf(poolPush, scratch, refs, var.ref));
+				out.u8(var.argCount);
+				out.u8(0);
 				curInstrOffset += 4;
 			},
 			varcase(const InstrType::PUSH_RUN_DYN&) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				constPoolIdxPushW(out, poolSize, consts, *var.ref);
-				out.push_back(0);
-				out.push_back(0);
+				out.u16(refPoolIdxOf(poolPush, scratch, refs, var.ref));
+				out.u8(0);
+				out.u8(0);
 				curInstrOffset += 4;
 			},
 
 			varcase(const InstrType::PUSH_ARR) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				out.push_back((uint8_t)var.type);
+				out.u8((uint8_t)var.type);
 				curInstrOffset++;
 			},
 			varcase(const InstrType::PUSH_OBJARR_U8&) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				constPoolIdxPushW(out, poolSize, consts, *var.ref);
-				out.push_back(var.dims);
+				out.u16(refPoolIdxOf(poolPush, scratch, refs, var.ref));
+				out.u8(var.dims);
 				curInstrOffset += 3;
 			},
 
 			varcase(const BaseBranched32 auto) {
 				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				u32w(out, var.jmpOffsetBytes);
+				out.u32(var.jmpOffsetBytes);
 				curInstrOffset += 4;
 			},
 
 			// Wide
 
 			varcase(const BaseVar16Instred auto) {
-				if (var.varIdx <= UINT8_MAX)
-				{
-					pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-					out.push_back((uint8_t)var.varIdx);
-					curInstrOffset++;
-					return;
-				}
-				pushWideOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				u16w(out, var.varIdx);
-				curInstrOffset += 2;
+				pushVarInstrW(out, instrOffsets, curInstrOffset, i, INSTR_OP_CODE<decltype(var)>, var.varIdx);
 			},
 			varcase(const InstrType::ADD_I32_VAR_U16_CI16) {
-				if (var.varIdx <= UINT8_MAX
-					&& var.val <= INT8_MAX
-					&& var.val >= INT8_MIN)
-				{
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-						InstrId::I_ADD_I32_VAR_U8_CI8);
-					out.push_back((uint8_t)var.varIdx);
-					out.push_back((int8_t)var.val);
-					curInstrOffset += 2;
-					return;
-				}
-				pushWideOpCodeId(out, instrOffsets, curInstrOffset, i,
-					InstrId::I_ADD_I32_VAR_U8_CI8);
-				u16w(out,var.varIdx);
-				u16w(out,var.val);
-				curInstrOffset += 4;
+				pushAddVarInstrW(out, instrOffsets, curInstrOffset, i, var.varIdx, var.val);
 			},
 
 			// Utilities
@@ -425,409 +1062,628 @@ namespace cpp_jcfu
 			varcase(const InstrType::PUSH_CONST&) {
 				pushConstPoolInstrW(out, 
 					instrOffsets,curInstrOffset, i, 
-					poolSize, consts, 
-					ConstPoolItm(*var));
+					[&](const ConstPoolEntry&) { return refPoolIdxOf(poolPush, scratch, refs, var); },
+					refEntryOf(var, refs));
 			},
 			varcase(const InstrType::PUSH_I32_I32) {
-				if (var <= INT8_MAX
-					&& var >= INT8_MIN)
-				{// Small, so opcode, or i8
-					if (var <= 5
-						&& var >= -1)
-					{// Tiny, so use a opcode
-						pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-							InstrId((int8_t)InstrId::PUSH_I32_0 + (int8_t)var));
-						return;
-					}
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-						InstrId::I_PUSH_I32_I8);
-					out.push_back((int8_t)var);
-					curInstrOffset++;
-					return;
-				}
-				// Not i8
-				if (var <= INT16_MAX
-					&& var >= INT16_MIN)
-				{// Short, so i16
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-						InstrId::I_PUSH_I32_I16);
-					u16w(out, (int16_t)var);
-					curInstrOffset += 2;
-					return;
-				}
-				// Not i16 !!
-				pushConstPoolInstrW(out,
-					instrOffsets, curInstrOffset, i,
-					poolSize, consts,
-					ConstPoolItmType::I32(var));
+				pushI32InstrW(out, instrOffsets, curInstrOffset, i, poolPush, var);
 			},
 			varcase(const InstrType::PUSH_F32_F32) {
-				if (var == 0.0f || var == 1.0f || var == 2.0f)
-				{
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-						InstrId((uint8_t)InstrId::PUSH_F32_0 + (uint8_t)var));
-					return;
-				}
-				pushConstPoolInstrW(out,
-					instrOffsets, curInstrOffset, i,
-					poolSize, consts,
-					ConstPoolItmType::F32(var));
+				pushF32InstrW(out, instrOffsets, curInstrOffset, i, poolPush, var);
 			},
 			varcase(const InstrType::PUSH_I64_I64) {
-				if (var == 0 || var==1)
-				{
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-						InstrId((uint8_t)InstrId::PUSH_I64_0 + (uint8_t)var));
-					return;
-				}
-				pushConstPoolInstrW(out,
-					instrOffsets, curInstrOffset, i,
-					poolSize, consts,
-					ConstPoolItmType::I64(var));
+				pushI64InstrW(out, instrOffsets, curInstrOffset, i, poolPush, var);
 			},
 			varcase(const InstrType::PUSH_F64_F64) {
-				if (var == 0.0 || var == 1.0)
-				{
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-						InstrId((uint8_t)InstrId::PUSH_F64_0 + (uint8_t)var));
-					return;
-				}
-				pushConstPoolInstrW(out,
-					instrOffsets, curInstrOffset, i,
-					poolSize, consts,
-					ConstPoolItmType::F64(var));
+				pushF64InstrW(out, instrOffsets, curInstrOffset, i, poolPush, var);
 			},
 
 			varcase(const InstrType::GOTO) {
-				if (var.jmpOffset > INT16_MAX || var.jmpOffset < INT16_MIN)
-				{// Always 32
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i, 
-						InstrId::I_GOTO32);
-					writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, var.jmpOffset);
-					return;
-				}
-				// Hope for 16
-				pushOpCodeId(out, instrOffsets, curInstrOffset, i,
-					InstrId::I_GOTO16);
-				writePatchPoint16(out, curInstrOffset, i, instrPatchPoints, var.jmpOffset);
+				pushGotoW(out, instrOffsets, curInstrOffset, i, instrPatchPoints, var.jmpOffset);
+			},
+			varcase(const InstrType::SWITCH&) {
+				if (!sw.plainOnly && !sw.tempVar.has_value())
+					sw.tempVar = switchTempVar();
+				pushSwitchW(scratch, curInstrOffset, i, poolPush, sw, sw.tempVar.value_or(0),
+					var->cases, var->defaultJmpOffset);
 			},
 			varcase(const BaseBranched auto) {
-				if (var.jmpOffset > INT16_MAX || var.jmpOffset < INT16_MIN)
-				{// Always 32
-
-					pushOpCodeId(out, instrOffsets, curInstrOffset, i, invertIfInstr(INSTR_OP_CODE<decltype(var)>));
-					u16w(out, 1 + 2 +1+4);//skip thisInstr, goto32
-
-					out.push_back((uint8_t)InstrId::I_GOTO32);
-					curInstrOffset += 3;
-					writePatchPoint32(out, curInstrOffset, i, instrPatchPoints, var.jmpOffset,true);
-					return;
-				}
-				pushOpCodeByte(out, instrOffsets, curInstrOffset, i, var);
-				// Hope for 16
-				writePatchPoint16(out,curInstrOffset,i, instrPatchPoints,var.jmpOffset);
+				pushIfW(out, instrOffsets, curInstrOffset, i, instrPatchPoints,
+					INSTR_OP_CODE<decltype(var)>, var.jmpOffset);
 			}
 			);
 		}
-		_ASSERT(curInstrOffset <= UINT16_MAX);
-		instrOffsets.push_back((uint16_t)curInstrOffset);//Prevent oob
-
-		size_t ppOffset = 0;
-		for (PatchPoint& pp : instrPatchPoints)
+		// Writes data.instrs into scratch.out, and fills instrOffsets (+ the end offset), the patch points & switchPads
+		inline void emitInstrs(
+			const auto& poolPush,
+			const CodeCompileData& data,
+			CodeCompileScratch& scratch,
+			SwitchEmitState& sw
+		)
 		{
-			const uint16_t relPoint = instrOffsets[pp.instrIdx] + (pp.isLongIf?3:0);
-
-			const int32_t instrOffset = int32_t(pp.instrOffset << 2)>>2;//carry top bit
-			const int32_t movement = instrOffsets[pp.instrIdx+instrOffset] - int32_t(relPoint);
+			const std::span<const Instr> instrs = data.instrs;
 
-			if (pp.is32Bit)
-			{//Ez
-				u32Patch(out, pp.byteOffset + ppOffset, movement);
-				continue;
-			}
+			_ASSERT(instrs.size() < UINT16_MAX);
 
-			if (movement <= INT16_MAX && movement >= INT16_MIN)
-			{//Ez 16 bit move
-				u16Patch(out, pp.byteOffset + ppOffset, (int16_t)movement);
-				continue;
-			}
-			// Uh oh!!! need to upsize!
+			scratch.clear();
+			std::vector<uint16_t>& instrOffsets = scratch.instrOffsets;
+			instrOffsets.resize(instrs.size());
+			size_t curInstrOffset = 0;
 
-			InstrId& instr = reinterpret_cast<InstrId&>(out[pp.byteOffset + ppOffset - 1]);
+			ByteWriter& out = scratch.out;
+			out.ensure(instrs.size() + (instrs.size() >> 3)); // 1.125X scaling
 
-			if (instr == InstrId::I_GOTO16)
+			for (uint16_t i = 0; i < instrs.size(); i++)
 			{
-				instr = InstrId::I_GOTO32;
-
-				out.insert(out.begin() + (pp.byteOffset + ppOffset), 2, 0);
-				u32Patch(out, pp.byteOffset + ppOffset, movement);
-
-				for (size_t i = pp.instrIdx+1; i < instrOffsets.size(); i++)
-					instrOffsets[i] += 2;
-				ppOffset += 2;
-				continue;
+				// Switches ensure their own size
+				out.ensure(MAX_FIXED_INSTR_SIZE);
+				emitInstr(poolPush, data.refs, scratch, curInstrOffset, sw,
+					[&] { return data.maxLocals.value_or(calcMaxLocals(data)); },
+					i, instrs[i]);
 			}
-			// Its an if
-
-			pp.isLongIf = true;// Update, so stack frame calculator can do stuff
-
-			instr = invertIfInstr(instr);
-			u16Patch(out, pp.byteOffset + ppOffset, 1+2+1+4);//skip thisInstr, injected goto32
-
-			out.insert(out.begin() + (pp.byteOffset + ppOffset+2), 5, 
-				(uint8_t)InstrId::I_GOTO32);//use goto32, to auto fill in the opcode
+			_ASSERT(curInstrOffset <= UINT16_MAX);
+			instrOffsets.push_back((uint16_t)curInstrOffset);//Prevent oob
+		}
+		// Like emitInstrs, but for buf, each ref is only pushed into the pool once
+		inline void emitInstrBuffer(
+			const auto& poolPush,
+			const InstrBuffer& buf,
+			const CodeCompileData& data,
+			CodeCompileScratch& scratch,
+			SwitchEmitState& sw
+		)
+		{
+			using K = InstrArgKind;
+			_ASSERT(buf.size() < UINT16_MAX);
+
+			scratch.clear();
+			std::vector<PatchPoint>& instrPatchPoints = scratch.instrPatchPoints;
+			std::vector<uint16_t>& instrOffsets = scratch.instrOffsets;
+			instrOffsets.resize(buf.size());
+			size_t curInstrOffset = 0;
+
+			// 0 is never a valid pool index
+			std::vector<uint16_t>& refPoolIdxs = scratch.refPoolIdxs;
+			refPoolIdxs.assign(buf.refs.size(), 0);
+			const auto refPoolIdx = [&](const uint32_t arg) {
+				const RefHandle h = RefHandle(arg & UINT16_MAX);
+				uint16_t& idx = refPoolIdxs[size_t(h)];
+				if (idx == 0)
+					idx = poolPush(buf.refs[h]);
+				return idx;
+			};
+
+			ByteWriter& out = scratch.out;
+			out.ensure(buf.size() + (buf.size() >> 3)); // 1.125X scaling
+
+			for (uint16_t i = 0; i < buf.size(); i++)
+			{
+				const InstrId id = buf.ops[i];
+				const uint32_t arg = buf.args[i];
+				// Switches ensure their own size
+				out.ensure(MAX_FIXED_INSTR_SIZE);
 
-			u32Patch(out, 
-				pp.byteOffset + ppOffset+3, //+3, cuz we writing to the goto32's offset
-				movement -3);// -3, for if-instr size
+				switch (INSTR_ARG_KINDS[(uint8_t)id])
+				{
+				case K::NONE:
+					_ASSERT((uint8_t)id <= (uint8_t)InstrId::I_DEPR_JSR32);
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					break;
+				case K::I8:
+				case K::POOL_U8:
+				case K::ARR_TYPE:
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					out.u8((uint8_t)arg);
+					curInstrOffset++;
+					break;
+				case K::I16:
+				case K::POOL_U16:
+				case K::RAW_BRANCH16:
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					out.u16((uint16_t)arg);
+					curInstrOffset += 2;
+					break;
+				case K::RAW_BRANCH32:
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					out.u32(arg);
+					curInstrOffset += 4;
+					break;
+
+				case K::VAR:
+					pushVarInstrW(out, instrOffsets, curInstrOffset, i, id, (uint16_t)arg);
+					break;
+				case K::ADD_VAR:
+					pushAddVarInstrW(out, instrOffsets, curInstrOffset, i, (uint16_t)arg, int16_t(arg >> 16));
+					break;
+
+				case K::GOTO:
+					pushGotoW(out, instrOffsets, curInstrOffset, i, instrPatchPoints, (int32_t)arg);
+					break;
+				case K::IF:
+					pushIfW(out, instrOffsets, curInstrOffset, i, instrPatchPoints, id, (int32_t)arg);
+					break;
+				case K::TABLE_SWITCH:
+				{
+					const InstrBuffer::SwitchRef& s = buf.switches[arg];
+					pushTableSwitchW(scratch, curInstrOffset, i, s.min,
+						std::span(buf.tableJmpOffsets).subspan(s.first, s.count), s.defaultJmpOffset);
+					break;
+				}
+				case K::LOOKUP_SWITCH:
+				{
+					const InstrBuffer::SwitchRef& s = buf.switches[arg];
+					pushLookupSwitchW(scratch, curInstrOffset, i,
+						std::span(buf.switchCases).subspan(s.first, s.count), s.defaultJmpOffset);
+					break;
+				}
+				case K::SWITCH:
+				{
+					if (!sw.plainOnly && !sw.tempVar.has_value())
+						sw.tempVar = data.maxLocals.value_or(std::max(calcMaxLocals(data), buf.localSlots));
+					const InstrBuffer::SwitchRef& s = buf.switches[arg];
+					pushSwitchW(scratch, curInstrOffset, i, poolPush, sw, sw.tempVar.value_or(0),
+						std::span(buf.switchCases).subspan(s.first, s.count), s.defaultJmpOffset);
+					break;
+				}
 
-			for (size_t i = pp.instrIdx + 1; i < instrOffsets.size(); i++)
-				instrOffsets[i] += 5;
-			ppOffset += 5;
+				case K::REF:
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					out.u16(refPoolIdx(arg));
+					curInstrOffset += 2;
+					break;
+				case K::REF_INTERFACE:
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					out.u16(refPoolIdx(arg));
+					out.u8(uint8_t(arg >> 16));
+					out.u8(0);
+					curInstrOffset += 4;
+					break;
+				case K::REF_DYN:
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					out.u16(refPoolIdx(arg));
+					out.u8(0);
+					out.u8(0);
+					curInstrOffset += 4;
+					break;
+				case K::REF_OBJARR:
+					pushOpCodeId(out, instrOffsets, curInstrOffset, i, id);
+					out.u16(refPoolIdx(arg));
+					out.u8(uint8_t(arg >> 16));
+					curInstrOffset += 3;
+					break;
+
+				case K::PUSH_CONST:
+					pushConstPoolInstrW(out,
+						instrOffsets, curInstrOffset, i,
+						[&](const ConstPoolEntry&) { return refPoolIdx(arg); },
+						buf.refs[RefHandle(arg)]);
+					break;
+				case K::I32:
+					pushI32InstrW(out, instrOffsets, curInstrOffset, i, poolPush, (int32_t)arg);
+					break;
+				case K::F32:
+					pushF32InstrW(out, instrOffsets, curInstrOffset, i, poolPush, std::bit_cast<float>(arg));
+					break;
+				case K::I64:
+					pushI64InstrW(out, instrOffsets, curInstrOffset, i, poolPush, std::bit_cast<int64_t>(buf.wideConsts[arg]));
+					break;
+				case K::F64:
+					pushF64InstrW(out, instrOffsets, curInstrOffset, i, poolPush, std::bit_cast<double>(buf.wideConsts[arg]));
+					break;
+				}
+			}
+			_ASSERT(curInstrOffset <= UINT16_MAX);
+			instrOffsets.push_back((uint16_t)curInstrOffset);//Prevent oob
 		}
-		FuncTagType::CODE ret;
-		ret.bytecode = std::move(out);
-		ret.maxLocals = data.maxLocals;
-		ret.maxStack = data.maxStack;
-
-		//https://docs.oracle.com/javase/specs/jvms/se24/html/jvms-4.html#jvms-4.7.4
-		CodeTagType::STACK_FRAMES stackFrames;
-		if(!data.instructionFrames.empty() || !data.ifInstructionFrames.empty())
+		// Relaxes & patches the emitted code, then builds the frames, tags, ...
+		// calcedMaxLocals - from calcMaxLocals, or something as good
+		// errorHandlers - data.errorHandlers, unless the CodeBuilder made them
+		inline FuncTagType::CODE finishCode(
+			const auto& poolPush,
+			const CodeCompileData& data,
+			CodeCompileScratch& scratch,
+			const SwitchEmitState& sw,
+			const uint16_t calcedMaxLocals,
+			const std::span<const ErrorHandler> errorHandlers
+		)
 		{
-			stackFrames.reserve(
-				(data.ifInstructionFrames.size() >> 7) // (data.ifInstructionFrames.size / 128)
-				// (0.75 * data.instructionFrames.size)
-				+ (data.instructionFrames.size() >> 2)
-				+ (data.instructionFrames.size() >> 1)
-			);
-			std::set<uint16_t> neededIfFrames; // Unordered maybe?
+			ByteWriter& out = scratch.out;
+			std::vector<uint16_t>& instrOffsets = scratch.instrOffsets;
+			std::vector<PatchPoint>& instrPatchPoints = scratch.instrPatchPoints;
+
+			relaxBranches(scratch);
 
-			// Figure out which ifInstructionFrames
-			//	are needed, and mark them as such
 			for (const PatchPoint& pp : instrPatchPoints)
 			{
-				if (!pp.isLongIf)
-					continue;//Not interesting
-				// !!! check for frame
+				const uint16_t relPoint = instrOffsets[pp.instrIdx] + pp.originDelta;
 
-				if (!data.ifInstructionFrames.contains(pp.instrIdx))
-				{
-					_ASSERT(false && "Frame data (ifInstructionFrames) missing for long if!");
-					continue;//Nope, no frame
-				}
-				neededIfFrames.insert(pp.instrIdx);
+				const int32_t instrOffset = int32_t(pp.instrOffset << 2)>>2;//carry top bit
+				const int32_t movement = instrOffsets[pp.instrIdx+instrOffset] - int32_t(relPoint);
+
+				if (pp.is32Bit)
+					u32Patch(out, pp.byteOffset, movement);
+				else
+					u16Patch(out, pp.byteOffset, (int16_t)movement);
 			}
-			auto itSet = neededIfFrames.begin();
-			auto itMap = data.instructionFrames.begin();
+			FuncTagType::CODE ret;
+			// Copied, so out keeps its memory
+			ret.bytecode.assign(out.data(), out.data() + out.size());
 
-			const std::vector<cpp_jcfu::SlotKind> _tmp;
+			_ASSERT(!data.maxLocals.has_value() || calcedMaxLocals <= *data.maxLocals);
+			ret.maxLocals = data.maxLocals.value_or(calcedMaxLocals);
+			if (sw.usedTempVar)
+				ret.maxLocals = *sw.tempVar + 1;
 
-			const std::vector<cpp_jcfu::SlotKind>* _prevFrameLocals = &data.startFrameLocals;
-			uint16_t bcOffset = 0;
+			// Filled by calcStackFrames, or calcMaxStack below
+			std::optional<uint16_t> calcedMaxStack;
 
-			while (itSet != neededIfFrames.end() || itMap != data.instructionFrames.end())
+			// Every frame, in instruction order
+			std::vector<std::pair<uint16_t, const StackFrame*>>& frameList = scratch.frameList;
+			if (data.calcFrames)
 			{
-				bool is32If = false;// Adds a 3 byte offset, as thats the size of a 'if' instr
-				uint16_t instrIdx;
-				const cpp_jcfu::StackFrame* _frame=nullptr;
-				if (itSet != neededIfFrames.end() && (*itSet < itMap->first))
+				// The instruction after a long if, is jumped to by the inverted if
+				for (const PatchPoint& pp : instrPatchPoints)
 				{
-					instrIdx = *itSet;
-					_frame = &data.ifInstructionFrames.at(instrIdx);
-					is32If = true;
-					++itSet;
+					if (pp.isLongIf)
+						scratch.longIfNexts.push_back(pp.instrIdx + 1);
 				}
-				else
+				std::vector<std::pair<uint16_t, StackFrame>>& calcedFrames = scratch.calcedFrames;
+				if (calcStackFrames(data, scratch.longIfNexts, scratch.frameCalc, calcedFrames))
+					calcedMaxStack = scratch.frameCalc.maxStack;
+
+				// Both are sorted, and never have the same instruction
+				auto itCalc = calcedFrames.begin();
+				auto itMap = data.instructionFrames.begin();
+				while (itCalc != calcedFrames.end() || itMap != data.instructionFrames.end())
+				{
+					if (itCalc != calcedFrames.end()
+						&& (itMap == data.instructionFrames.end() || itCalc->first < itMap->first))
+					{
+						frameList.emplace_back(itCalc->first, &itCalc->second);
+						++itCalc;
+					}
+					else
+					{
+						frameList.emplace_back(itMap->first, &itMap->second);
+						++itMap;
+					}
+				}
+			}
+			else if(!data.instructionFrames.empty() || !data.ifInstructionFrames.empty())
+			{
+				// Patch points are in instruction order, so this stays sorted
+				std::vector<uint16_t>& neededIfFrames = scratch.neededIfFrames;
+
+				// Figure out which ifInstructionFrames
+				//	are needed, and mark them as such
+				for (const PatchPoint& pp : instrPatchPoints)
 				{
-					instrIdx = itMap->first;
-					_frame = &itMap->second;
-					++itMap;
+					if (!pp.isLongIf)
+						continue;//Not interesting
+					// !!! check for frame
+
+					// The frame goes on the instruction after the goto_w, as thats where the inverted if jumps
+					if (data.instructionFrames.contains(pp.instrIdx + 1))
+						continue;//Already has one
+					if (!data.ifInstructionFrames.contains(pp.instrIdx))
+					{
+						_ASSERT(false && "Frame data (ifInstructionFrames) missing for long if!");
+						continue;//Nope, no frame
+					}
+					neededIfFrames.push_back(pp.instrIdx);
 				}
-				const cpp_jcfu::StackFrame& frame = *_frame;
+				auto itSet = neededIfFrames.begin();
+				auto itMap = data.instructionFrames.begin();
 
-				const uint16_t deltaTarget = instrOffsets[instrIdx] + (is32If ? 3 : 0);
+				while (itSet != neededIfFrames.end() || itMap != data.instructionFrames.end())
+				{
+					if (itSet != neededIfFrames.end() 
+						&& (itMap == data.instructionFrames.end() || *itSet + 1 < itMap->first))
+					{
+						// After the if (+ goto_w)
+						frameList.emplace_back(uint16_t(*itSet + 1), &data.ifInstructionFrames.at(*itSet));
+						++itSet;
+					}
+					else
+					{
+						frameList.emplace_back(itMap->first, &itMap->second);
+						++itMap;
+					}
+				}
+			}
 
-				const uint16_t delta = deltaTarget - bcOffset;
-				bcOffset += delta+1;// +1, implicitly added by spec
+			// Only walk the code again, if it wasnt given
+			if (!calcedMaxStack.has_value() && !data.maxStack.has_value())
+				calcedMaxStack = calcMaxStack(data, scratch.frameCalc);
+			_ASSERT((calcedMaxStack.has_value() || data.maxStack.has_value()) && "maxStack missing, and the code cant be analyzed");
+			_ASSERT(!calcedMaxStack.has_value() || !data.maxStack.has_value() || *calcedMaxStack <= *data.maxStack);
+			ret.maxStack = data.maxStack.value_or(calcedMaxStack.value_or(UINT16_MAX));
+			// A SWITCH compare pushes a constant on top of the key
+			if (sw.usedCompare && ret.maxStack != UINT16_MAX)
+				ret.maxStack++;
+
+			//https://docs.oracle.com/javase/specs/jvms/se24/html/jvms-4.html#jvms-4.7.4
+			CodeTagType::STACK_FRAMES stackFrames;
+			if(!frameList.empty())
+			{
+				stackFrames.reserve(frameList.size());
 
-				const bool sameLocals = frame.local == *_prevFrameLocals;
+				const std::vector<cpp_jcfu::SlotKind>* _prevFrameLocals = &data.startFrameLocals;
+				uint16_t bcOffset = 0;
 
-				if (sameLocals)
+				for (const auto& [frameInstrIdx, _frame] : frameList)
 				{
-					if (frame.stack.empty())
-					{//SAME_NO_STACK
+					const cpp_jcfu::StackFrame& frame = *_frame;
 
-						stackFrames.push_back(CodeStackFrameType::SAME_NO_STACK{ delta });
-						goto continueLoop;
-					}
-					else if(frame.stack.size()==1)
-					{//SAME_1_STACK
-						stackFrames.push_back(CodeStackFrameType::SAME_1_STACK{
-							{delta},
-							slotKind2CodeSlotKind(poolSize,consts,instrOffsets,frame.stack[0]) 
-						});
-						goto continueLoop;
-					}
-					//FULL :(
-				}
-				else if(frame.stack.empty())//add & chop require 0 stack items
-				{//CHOP, ADD, FULL?
+					const uint16_t deltaTarget = instrOffsets[frameInstrIdx];
 
-					if (frame.local.size() > _prevFrameLocals->size())
-					{//maybe add?
-						const size_t addCount = frame.local.size() - _prevFrameLocals->size();
-						if (addCount <= 3)//only add 1...3 exist
-						{
-							if (detail::isVecPrefix(*_prevFrameLocals, frame.local))
-							{//ADD
-								if (addCount == 1)
-								{
-									stackFrames.push_back(CodeStackFrameType::ADD1_NO_STACK{
-										{delta},
-										{slotKind2CodeSlotKind(poolSize,consts,instrOffsets,frame.local.back())}
-									});
-								}
-								else if (addCount == 2)
-								{
-									stackFrames.push_back(CodeStackFrameType::ADD2_NO_STACK{
-										{delta},
-										{
-											slotKind2CodeSlotKind(poolSize,consts,instrOffsets,*(frame.local.rbegin() + 1)),
-											slotKind2CodeSlotKind(poolSize,consts,instrOffsets,frame.local.back())
-										}
-									});
-								}
-								else if (addCount == 3)
-								{
-									stackFrames.push_back(CodeStackFrameType::ADD3_NO_STACK{
-										{delta},
-										{
-											slotKind2CodeSlotKind(poolSize,consts,instrOffsets,*(frame.local.rbegin() + 2)),
-											slotKind2CodeSlotKind(poolSize,consts,instrOffsets,*(frame.local.rbegin() + 1)),
-											slotKind2CodeSlotKind(poolSize,consts,instrOffsets,frame.local.back())
-										}
-									});
+					const uint16_t delta = deltaTarget - bcOffset;
+					bcOffset += delta+1;// +1, implicitly added by spec
+
+					const bool sameLocals = frame.local == *_prevFrameLocals;
+
+					if (sameLocals)
+					{
+						if (frame.stack.empty())
+						{//SAME_NO_STACK
+
+							stackFrames.push_back(CodeStackFrameType::SAME_NO_STACK{ delta });
+							goto continueLoop;
+						}
+						else if(frame.stack.size()==1)
+						{//SAME_1_STACK
+							stackFrames.push_back(CodeStackFrameType::SAME_1_STACK{
+								{delta},
+								slotKind2CodeSlotKind(poolPush,instrOffsets,frame.stack[0]) 
+							});
+							goto continueLoop;
+						}
+						//FULL :(
+					}
+					else if(frame.stack.empty())//add & chop require 0 stack items
+					{//CHOP, ADD, FULL?
+
+						if (frame.local.size() > _prevFrameLocals->size())
+						{//maybe add?
+							const size_t addCount = frame.local.size() - _prevFrameLocals->size();
+							if (addCount <= 3)//only add 1...3 exist
+							{
+								if (detail::isVecPrefix(*_prevFrameLocals, frame.local))
+								{//ADD
+									if (addCount == 1)
+									{
+										stackFrames.push_back(CodeStackFrameType::ADD1_NO_STACK{
+											{delta},
+											{slotKind2CodeSlotKind(poolPush,instrOffsets,frame.local.back())}
+										});
+									}
+									else if (addCount == 2)
+									{
+										stackFrames.push_back(CodeStackFrameType::ADD2_NO_STACK{
+											{delta},
+											{
+												slotKind2CodeSlotKind(poolPush,instrOffsets,*(frame.local.rbegin() + 1)),
+												slotKind2CodeSlotKind(poolPush,instrOffsets,frame.local.back())
+											}
+										});
+									}
+									else if (addCount == 3)
+									{
+										stackFrames.push_back(CodeStackFrameType::ADD3_NO_STACK{
+											{delta},
+											{
+												slotKind2CodeSlotKind(poolPush,instrOffsets,*(frame.local.rbegin() + 2)),
+												slotKind2CodeSlotKind(poolPush,instrOffsets,*(frame.local.rbegin() + 1)),
+												slotKind2CodeSlotKind(poolPush,instrOffsets,frame.local.back())
+											}
+										});
+									}
+									goto continueLoop;
 								}
-								goto continueLoop;
 							}
 						}
-					}
-					else
-					{//maybe chop?
-						const size_t chopCount = _prevFrameLocals->size() - frame.local.size();
-						if(chopCount > 0 && chopCount <= 3)//only chop 1...3 exist
-						{
-							if (detail::isVecPrefix(frame.local, *_prevFrameLocals))
-							{//CHOP
-								if(chopCount==1)
-									stackFrames.push_back(CodeStackFrameType::CHOP1_NO_STACK{ delta });
-								else if(chopCount == 2)
-									stackFrames.push_back(CodeStackFrameType::CHOP2_NO_STACK{ delta });
-								else if(chopCount == 3)
-									stackFrames.push_back(CodeStackFrameType::CHOP3_NO_STACK{ delta });
-								goto continueLoop;
+						else
+						{//maybe chop?
+							const size_t chopCount = _prevFrameLocals->size() - frame.local.size();
+							if(chopCount > 0 && chopCount <= 3)//only chop 1...3 exist
+							{
+								if (detail::isVecPrefix(frame.local, *_prevFrameLocals))
+								{//CHOP
+									if(chopCount==1)
+										stackFrames.push_back(CodeStackFrameType::CHOP1_NO_STACK{ delta });
+									else if(chopCount == 2)
+										stackFrames.push_back(CodeStackFrameType::CHOP2_NO_STACK{ delta });
+									else if(chopCount == 3)
+										stackFrames.push_back(CodeStackFrameType::CHOP3_NO_STACK{ delta });
+									goto continueLoop;
+								}
 							}
 						}
+						//FULL :(
 					}
-					//FULL :(
-				}
-				//Do full
-				{
-					CodeStackFrameType::BaseFull fullTag;
+					//Do full
+					{
+						CodeStackFrameType::BaseFull fullTag;
 
-					fullTag.localKinds.reserve(frame.local.size());
-					fullTag.stackKinds.reserve(frame.stack.size());
+						fullTag.localKinds.reserve(frame.local.size());
+						fullTag.stackKinds.reserve(frame.stack.size());
 
-					for (size_t i = 0; i < frame.local.size(); i++)
-					{
-						fullTag.localKinds.push_back(
-							slotKind2CodeSlotKind(poolSize, consts, instrOffsets, 
-								frame.local[i]
-						));
-					}
-					for (size_t i = 0; i < frame.stack.size(); i++)
-					{
-						fullTag.stackKinds.push_back(
-							slotKind2CodeSlotKind(poolSize, consts, instrOffsets,
-								frame.stack[i]
+						for (size_t i = 0; i < frame.local.size(); i++)
+						{
+							fullTag.localKinds.push_back(
+								slotKind2CodeSlotKind(poolPush, instrOffsets, 
+									frame.local[i]
 							));
-					}
-					fullTag.delta = delta;
+						}
+						for (size_t i = 0; i < frame.stack.size(); i++)
+						{
+							fullTag.stackKinds.push_back(
+								slotKind2CodeSlotKind(poolPush, instrOffsets,
+									frame.stack[i]
+								));
+						}
+						fullTag.delta = delta;
 
-					stackFrames.push_back(
-						std::make_unique<CodeStackFrameType::BaseFull>(std::move(fullTag)));
+						stackFrames.push_back(
+							std::make_unique<CodeStackFrameType::BaseFull>(std::move(fullTag)));
+					}
+				continueLoop:
+					_prevFrameLocals = &frame.local;
 				}
-			continueLoop:
-				_prevFrameLocals = &frame.local;
 			}
-		}
-		ret.tags.reserve(
-			  (data.lineNums		.empty() ? 0 : 1)
-			+ (data.localVars		.empty() ? 0 : 1)
-			+ (data.localVarTypes	.empty() ? 0 : 1)
-			+ (stackFrames			.empty() ? 0 : 1)
-		);
-		if(!stackFrames.empty())
-			ret.tags.push_back(std::move(stackFrames));
-
-		if (!data.lineNums.empty())
-		{
-			CodeTagType::LINE_NUMS lnums;
-			lnums.reserve(data.lineNums.size());
+			ret.tags.reserve(
+				  (data.lineNums		.empty() ? 0 : 1)
+				+ (data.localVars		.empty() ? 0 : 1)
+				+ (data.localVarTypes	.empty() ? 0 : 1)
+				+ (stackFrames			.empty() ? 0 : 1)
+			);
+			if(!stackFrames.empty())
+				ret.tags.push_back(std::move(stackFrames));
 
-			for (const LineNumEntry e : data.lineNums)
+			if (!data.lineNums.empty())
 			{
-				lnums.push_back(
-					{instrOffsets[e.startInstr],e.line}
-				);
-			}
-			ret.tags.push_back(std::move(lnums));
-		}
-		if (!data.localVars.empty())
-		{
-			CodeTagType::LOCALS locs;
-			locs.reserve(data.localVars.size());
+				CodeTagType::LINE_NUMS lnums;
+				lnums.reserve(data.lineNums.size());
 
-			for (const LocalEntry& e : data.localVars)
+				for (const LineNumEntry e : data.lineNums)
+				{
+					lnums.push_back(
+						{instrOffsets[e.startInstr],e.line}
+					);
+				}
+				ret.tags.push_back(std::move(lnums));
+			}
+			if (!data.localVars.empty())
 			{
-				locs.push_back( {
-					e.name,
-					e.desc,
-					instrOffsets[e.startInstr],
-					instrOffsets[e.startInstr+e.instrCount],
-					e.idx
-				});
+				CodeTagType::LOCALS locs;
+				locs.reserve(data.localVars.size());
+
+				for (const LocalEntry& e : data.localVars)
+				{
+					locs.push_back( {
+						e.name,
+						e.desc,
+						instrOffsets[e.startInstr],
+						instrOffsets[e.startInstr+e.instrCount],
+						e.idx
+					});
+				}
+				ret.tags.push_back(std::move(locs));
 			}
-			ret.tags.push_back(std::move(locs));
-		}
-		if (!data.localVarTypes.empty())
-		{
-			CodeTagType::LOCAL_TYPES locs;
-			locs.reserve(data.localVarTypes.size());
+			if (!data.localVarTypes.empty())
+			{
+				CodeTagType::LOCAL_TYPES locs;
+				locs.reserve(data.localVarTypes.size());
 
-			for (const LocalTypeEntry& e : data.localVarTypes)
+				for (const LocalTypeEntry& e : data.localVarTypes)
+				{
+					locs.push_back( {
+						e.name,
+						e.sig,
+						instrOffsets[e.startInstr],
+						instrOffsets[e.startInstr+e.instrCount],
+						e.idx
+					});
+				}
+				ret.tags.push_back(std::move(locs));
+			}
+			ret.errorHandlers.resize(errorHandlers.size());
+			for (size_t i = 0; i < errorHandlers.size(); i++)
 			{
-				locs.push_back( {
-					e.name,
-					e.sig,
-					instrOffsets[e.startInstr],
-					instrOffsets[e.startInstr+e.instrCount],
-					e.idx
-				});
+				const ErrorHandler& mh = errorHandlers[i];
+				CodeTagErrorHandler& eh = ret.errorHandlers[i];
+
+				eh.catchType = mh.catchType;
+				eh.startByte = instrOffsets[mh.startInstr];
+				eh.afterEndByte = instrOffsets[mh.endInstr+1];
+				eh.handlerByte = instrOffsets[mh.handlerInstr];
 			}
-			ret.tags.push_back(std::move(locs));
+			return ret;
 		}
-		ret.errorHandlers.resize(data.errorHandlers.size());
-		for (size_t i = 0; i < data.errorHandlers.size(); i++)
+	}
+
+	// poolPush - (const ConstPoolEntry&) -> uint16_t pool index
+	// Its the only thing that touches the pool, so it decides if compiling is thread safe
+	inline FuncTagType::CODE compileCodeWith(
+		const auto& poolPush,
+		const CodeCompileData& data,
+		CodeCompileScratch& scratch
+	)
+	{
+		SwitchEmitState sw;
+		detail::emitInstrs(poolPush, data, scratch, sw);
+		if (sw.hasSplitSwitch && !branchesFit16(scratch))
 		{
-			const ErrorHandler& mh = data.errorHandlers[i];
-			CodeTagErrorHandler& eh = ret.errorHandlers[i];
+			sw = { .plainOnly = true, .tempVar = sw.tempVar };
+			detail::emitInstrs(poolPush, data, scratch, sw);
+		}
+		return detail::finishCode(poolPush, data, scratch, sw, calcMaxLocals(data), data.errorHandlers);
+	}
+	// Compiles buf instead of data.instrs, everything else still comes from data
+	// The buffer is never analyzed, so data.maxStack must be set, and calcFrames cant be used
+	inline FuncTagType::CODE compileCodeWith(
+		const auto& poolPush,
+		const InstrBuffer& buf,
+		const CodeCompileData& data,
+		CodeCompileScratch& scratch
+	)
+	{
+		_ASSERT(data.instrs.empty() && "Instructions are in the buffer");
+		_ASSERT(!data.calcFrames && "Cant calc frames for a InstrBuffer");
+		_ASSERT(data.maxStack.has_value() && "Cant calc maxStack for a InstrBuffer");
 
-			eh.catchType = mh.catchType;
-			eh.startByte = instrOffsets[mh.startInstr];
-			eh.afterEndByte = instrOffsets[mh.endInstr+1];
-			eh.handlerByte = instrOffsets[mh.handlerInstr];
+		SwitchEmitState sw;
+		detail::emitInstrBuffer(poolPush, buf, data, scratch, sw);
+		if (sw.hasSplitSwitch && !branchesFit16(scratch))
+		{
+			sw = { .plainOnly = true, .tempVar = sw.tempVar };
+			detail::emitInstrBuffer(poolPush, buf, data, scratch, sw);
 		}
-		return ret;
+		return detail::finishCode(poolPush, data, scratch, sw,
+			std::max(calcMaxLocals(data), buf.localSlots), data.errorHandlers);
+	}
+	// Single threaded, pushes straight into consts
+	inline FuncTagType::CODE compileCode(
+		size_t& poolSize, ConstPool& consts,
+		const CodeCompileData& data
+	)
+	{
+		CodeCompileScratch scratch;
+		return compileCodeWith(
+			[&](const ConstPoolEntry& e) { return constPoolPush(poolSize, consts, e); },
+			data, scratch);
+	}
+	inline FuncTagType::CODE compileCode(
+		size_t& poolSize, ConstPool& consts,
+		const InstrBuffer& buf,
+		const CodeCompileData& data
+	)
+	{
+		CodeCompileScratch scratch;
+		return compileCodeWith(
+			[&](const ConstPoolEntry& e) { return constPoolPush(poolSize, consts, e); },
+			buf, data, scratch);
+	}
+	// Thread safe, if every thread uses its own data
+	inline FuncTagType::CODE compileCode(
+		SharedConstPool& consts,
+		const CodeCompileData& data
+	)
+	{
+		CodeCompileScratch scratch;
+		return compileCodeWith(
+			[&](const ConstPoolEntry& e) { return consts.push(e); },
+			data, scratch);
+	}
+	inline FuncTagType::CODE compileCode(
+		SharedConstPool& consts,
+		const InstrBuffer& buf,
+		const CodeCompileData& data
+	)
+	{
+		CodeCompileScratch scratch;
+		return compileCodeWith(
+			[&](const ConstPoolEntry& e) { return consts.push(e); },
+			buf, data, scratch);
 	}
 }
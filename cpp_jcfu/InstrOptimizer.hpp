@@ -0,0 +1,1194 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <span>
+#include <map>
+#include <variant>
+#include <limits>
+#include <cmath>
+#include <type_traits>
+#include <algorithm>
+
+#include "CodeCompileData.hpp"
+#include "InstrCompiler.hpp"
+
+namespace cpp_jcfu
+{
+	struct InstrOptStats
+	{
+		size_t instrsSaved = 0;
+		// Estimated, ldc's count as 2 bytes, jumps as 3, switches without padding
+		size_t bytesSaved = 0;
+
+		InstrOptStats& operator+=(const InstrOptStats& o)
+		{
+			instrsSaved += o.instrsSaved;
+			bytesSaved += o.bytesSaved;
+			return *this;
+		}
+	};
+
+	// Memory the optimizer passes need while working, keep it around to stop reallocating it for every function
+	struct InstrOptScratch
+	{
+		// Jumped to, or has a frame, so it cant be merged with the instruction before it
+		std::vector<uint8_t> isLeader;
+		// INSTR_REMOVED / INSTR_DEAD, or 0
+		std::vector<uint8_t> isRemoved;
+		// Old index -> new index, a removed instruction goes to the next kept one
+		std::vector<uint16_t> newIdx;
+		std::vector<uint16_t> kept;
+		// Instructions reading each local slot, debug info counts as 2
+		std::vector<uint32_t> varReads;
+		std::vector<uint16_t> work;
+
+		// Keeps the memory
+		void clear()
+		{
+			isLeader.clear();
+			isRemoved.clear();
+			newIdx.clear();
+			kept.clear();
+			varReads.clear();
+			work.clear();
+		}
+	};
+
+	namespace detail
+	{
+		// Doesnt change the stack or locals, its jumps, frames & line numbers move to the next kept instruction
+		inline constexpr uint8_t INSTR_REMOVED = 1;
+		// Never runs, so its frames are dropped
+		inline constexpr uint8_t INSTR_DEAD = 2;
+
+		// What compileCode will (most likely) turn it into
+		inline size_t instrSizeEstimate(const Instr& instr)
+		{
+			size_t ret = 1;
+			ezmatch(instr)(
+			varcase(const auto&) {},
+			varcase(const InstrType::I_PUSH_I32_I8) { ret = 2; },
+			varcase(const InstrType::I_PUSH_I32_I16) { ret = 3; },
+			varcase(const InstrType::I_PUSH_CONST_U8) { ret = 2; },
+			varcase(const PushConstXed auto&) { ret = 3; },
+			varcase(const BaseVar16Instred auto&) { ret = var.varIdx <= UINT8_MAX ? 2 : 4; },
+			varcase(const InstrType::ADD_I32_VAR_U16_CI16) {
+				ret = (var.varIdx <= UINT8_MAX && var.val <= INT8_MAX && var.val >= INT8_MIN) ? 3 : 6;
+			},
+			varcase(const BaseBranched16 auto&) { ret = 3; },
+			varcase(const BaseBranched32 auto&) { ret = 5; },
+			varcase(const BaseBranched auto&) { ret = 3; },
+			varcase(const InstrType::GOTO) { ret = 3; },
+			varcase(const BaseRefed auto&) { ret = 3; },
+			varcase(const InstrType::PUSH_RUN_INTERFACE&) { ret = 5; },
+			varcase(const InstrType::PUSH_RUN_DYN&) { ret = 5; },
+			varcase(const InstrType::PUSH_ARR) { ret = 2; },
+			varcase(const InstrType::PUSH_OBJARR_U8&) { ret = 4; },
+			varcase(const InstrType::TABLE_SWITCH&) { ret = 1 + 4 * 3 + 4 * var->jmpOffsets.size(); },
+			varcase(const InstrType::LOOKUP_SWITCH&) { ret = 1 + 4 * 2 + 8 * var->cases.size(); },
+			varcase(const InstrType::SWITCH&) { ret = 1 + 4 * 2 + 8 * var->cases.size(); },// As a lookupswitch
+			varcase(const InstrType::PUSH_CONST&) {
+				// Handles might be a ldc_w
+				ret = (var.isHandle()
+					|| std::holds_alternative<ConstPoolItmType::I64>(*var)
+					|| std::holds_alternative<ConstPoolItmType::F64>(*var)) ? 3 : 2;
+			},
+			varcase(const InstrType::PUSH_I32_I32) {
+				if (var >= -1 && var <= 5)
+					ret = 1;
+				else if (var >= INT8_MIN && var <= INT8_MAX)
+					ret = 2;
+				else
+					ret = (var >= INT16_MIN && var <= INT16_MAX) ? 3 : 2;
+			},
+			varcase(const InstrType::PUSH_F32_F32) { ret = isOpCodeF32(var) ? 1 : 2; },
+			varcase(const InstrType::PUSH_I64_I64) { ret = (var == 0 || var == 1) ? 1 : 3; },
+			varcase(const InstrType::PUSH_F64_F64) { ret = isOpCodeF64(var) ? 1 : 3; }
+			);
+			return ret;
+		}
+
+		struct InstrVarUse
+		{
+			InstrId id;
+			int32_t idx; // -1 -> none
+		};
+		inline InstrVarUse instrVarUse(const Instr& instr)
+		{
+			InstrVarUse ret{ InstrId(instr.index()), -1 };
+			ezmatch(instr)(
+			varcase(const auto&) {
+				constexpr int varIdx = localVarIdx(INSTR_OP_CODE<decltype(var)>);
+				if constexpr (varIdx == -2)
+					ret.idx = var.varIdx;
+				else
+					ret.idx = varIdx;
+			}
+			);
+			return ret;
+		}
+
+		// Slots pushed by an instruction that only pushes a value, and cant throw
+		/// @returns 0 if it isnt one
+		inline uint8_t pureValuePushSlots(const Instr& instr)
+		{
+			uint8_t ret = 0;
+			ezmatch(instr)(
+			varcase(const auto&) {
+				constexpr InstrId id = INSTR_OP_CODE<decltype(var)>;
+				if constexpr (id == InstrId::PUSH_I64_0 || id == InstrId::PUSH_I64_1
+					|| id == InstrId::PUSH_F64_0 || id == InstrId::PUSH_F64_1
+					|| id == InstrId::DUP_2)
+					ret = 2;
+				else if constexpr ((id >= InstrId::PUSH_OBJ_NULL && id <= InstrId::PUSH_F32_2)
+					|| id == InstrId::I_PUSH_I32_I8 || id == InstrId::I_PUSH_I32_I16
+					|| id == InstrId::DUP_1)
+					ret = 1;
+				else if constexpr (localVarKind(id) != -1 && !isLocalVarSave(id))
+					ret = localVarSlots(id);
+			},
+			varcase(const InstrType::PUSH_I32_I32) { ret = 1; },
+			varcase(const InstrType::PUSH_F32_F32) { ret = 1; },
+			varcase(const InstrType::PUSH_I64_I64) { ret = 2; },
+			varcase(const InstrType::PUSH_F64_F64) { ret = 2; },
+			varcase(const InstrType::PUSH_CONST&) {
+				if (var.isHandle())
+					return;// Unknown without the RefTable
+				if (std::holds_alternative<ConstPoolItmType::I64>(*var)
+					|| std::holds_alternative<ConstPoolItmType::F64>(*var))
+					ret = 2;
+				else if (std::holds_alternative<ConstPoolItmType::I32>(*var)
+					|| std::holds_alternative<ConstPoolItmType::F32>(*var)
+					|| std::holds_alternative<ConstPoolItmType::STR>(*var))
+					ret = 1;
+			}
+			);
+			return ret;
+		}
+		// 1 -> pushes a 0 int, 2 -> pushes a 0 long
+		inline uint8_t zeroPushSlots(const Instr& instr)
+		{
+			uint8_t ret = 0;
+			ezmatch(instr)(
+			varcase(const auto&) {
+				constexpr InstrId id = INSTR_OP_CODE<decltype(var)>;
+				if constexpr (id == InstrId::PUSH_I32_0)
+					ret = 1;
+				else if constexpr (id == InstrId::PUSH_I64_0)
+					ret = 2;
+			},
+			varcase(const InstrType::I_PUSH_I32_I8) { ret = var == 0 ? 1 : 0; },
+			varcase(const InstrType::I_PUSH_I32_I16) { ret = var == 0 ? 1 : 0; },
+			varcase(const InstrType::PUSH_I32_I32) { ret = var == 0 ? 1 : 0; },
+			varcase(const InstrType::PUSH_I64_I64) { ret = var == 0 ? 2 : 0; }
+			);
+			return ret;
+		}
+		// Doing it with a 0 changes nothing
+		// The shift amount of a long shift is an int
+		constexpr uint8_t zeroIdentitySlots(const InstrId id)
+		{
+			switch (id)
+			{
+			case InstrId::ADD_I32: case InstrId::SUB_I32:
+			case InstrId::OR_I32: case InstrId::XOR_I32:
+			case InstrId::SHL_I32: case InstrId::SHR_I32: case InstrId::SRC_I32:
+			case InstrId::SHL_I64: case InstrId::SHR_I64: case InstrId::SRC_I64:
+				return 1;
+			case InstrId::ADD_I64: case InstrId::SUB_I64:
+			case InstrId::OR_I64: case InstrId::XOR_I64:
+				return 2;
+			default:
+				return 0;
+			}
+		}
+		// NOP, GOTO to the next instruction, iinc by 0
+		inline bool isNoOpInstr(const Instr& instr)
+		{
+			bool ret = false;
+			ezmatch(instr)(
+			varcase(const auto&) {},
+			varcase(const InstrType::NOP) { ret = true; },
+			varcase(const InstrType::GOTO) { ret = var.jmpOffset == 1; },
+			varcase(const InstrType::ADD_I32_VAR_U16_CI16) { ret = var.val == 0; }
+			);
+			return ret;
+		}
+
+		// A IF_* instruction, from its id
+		/// @returns nothing if id isnt a IF_*
+		inline std::optional<Instr> newIfInstr(const InstrId id, const int32_t jmpOffset)
+		{
+#define _IF_INSTR_CASE(_T) case InstrId::_T: return InstrType::_T{ { jmpOffset } }
+			switch (id)
+			{
+				_IF_INSTR_CASE(IF_EQL);
+				_IF_INSTR_CASE(IF_NEQ);
+				_IF_INSTR_CASE(IF_LT);
+				_IF_INSTR_CASE(IF_GT);
+				_IF_INSTR_CASE(IF_LTE);
+				_IF_INSTR_CASE(IF_GTE);
+
+				_IF_INSTR_CASE(IF_I32_EQL);
+				_IF_INSTR_CASE(IF_I32_NEQ);
+				_IF_INSTR_CASE(IF_I32_LT);
+				_IF_INSTR_CASE(IF_I32_GT);
+				_IF_INSTR_CASE(IF_I32_LTE);
+				_IF_INSTR_CASE(IF_I32_GTE);
+
+				_IF_INSTR_CASE(IF_OBJ_EQL);
+				_IF_INSTR_CASE(IF_OBJ_NEQ);
+				_IF_INSTR_CASE(IF_NIL);
+				_IF_INSTR_CASE(IF_NNIL);
+			default:
+				break;
+			}
+#undef _IF_INSTR_CASE
+			_ASSERT(false && "Invalid instruction, expected IF_*");
+			return std::nullopt;
+		}
+
+		// Marks every instruction that is jumped to, or has a frame
+		/// @returns false if some jump cant be moved (raw byte offsets, or out of range)
+		inline bool markInstrLeaders(
+			const std::span<const Instr> instrs,
+			const std::span<const ErrorHandler> errorHandlers,
+			const CodeCompileData& data,
+			InstrOptScratch& s)
+		{
+			const size_t n = instrs.size();
+			s.isLeader.assign(n, 0);
+			bool ok = true;
+			const auto markTarget = [&](const int64_t target) {
+				if (target < 0 || size_t(target) >= n)
+					ok = false;
+				else
+					s.isLeader[size_t(target)] = 1;
+			};
+			for (size_t i = 0; i < n && ok; i++)
+			{
+				ezmatch(instrs[i])(
+				varcase(const auto&) {},
+				varcase(const BaseBranched16 auto&) { ok = false; },
+				varcase(const BaseBranched32 auto&) { ok = false; },
+				varcase(const InstrType::I_DEPR_GOTO_VAR_U16) { ok = false; },
+				varcase(const InstrType::I_WIDE) { ok = false; },
+				varcase(const BaseBranched auto&) {
+					markTarget(int64_t(i) + var.jmpOffset);
+				},
+				varcase(const InstrType::GOTO) {
+					markTarget(int64_t(i) + var.jmpOffset);
+				},
+				varcase(const InstrType::TABLE_SWITCH&) {
+					markTarget(int64_t(i) + var->defaultJmpOffset);
+					for (const int32_t jmpOffset : var->jmpOffsets)
+						markTarget(int64_t(i) + jmpOffset);
+				},
+				varcase(const InstrType::LOOKUP_SWITCH&) {
+					markTarget(int64_t(i) + var->defaultJmpOffset);
+					for (const SwitchCase& kase : var->cases)
+						markTarget(int64_t(i) + kase.jmpOffset);
+				},
+				varcase(const InstrType::SWITCH&) {
+					markTarget(int64_t(i) + var->defaultJmpOffset);
+					for (const SwitchCase& kase : var->cases)
+						markTarget(int64_t(i) + kase.jmpOffset);
+				}
+				);
+			}
+			for (const ErrorHandler& eh : errorHandlers)
+			{
+				markTarget(eh.handlerInstr);
+				if (eh.startInstr > eh.endInstr || eh.endInstr >= n)
+					ok = false;
+			}
+			for (const auto& [i, frame] : data.instructionFrames)
+				markTarget(i);
+			// The frame is for the instruction after the if
+			for (const auto& [i, frame] : data.ifInstructionFrames)
+				markTarget(int64_t(i) + 1);
+			return ok;
+		}
+
+		// Counts the reads of every local slot, slots with debug info are never unused
+		inline void countVarReads(const std::span<const Instr> instrs, const CodeCompileData& data, InstrOptScratch& s)
+		{
+			s.varReads.clear();
+			const auto addRead = [&](const size_t slot, const uint32_t count) {
+				if (slot >= s.varReads.size())
+					s.varReads.resize(slot + 1, 0);
+				s.varReads[slot] += count;
+			};
+			for (const Instr& instr : instrs)
+			{
+				const InstrVarUse use = instrVarUse(instr);
+				if (use.idx < 0 || isLocalVarSave(use.id))
+					continue;
+				addRead(size_t(use.idx), 1);
+				if (localVarSlots(use.id) == 2)
+					addRead(size_t(use.idx) + 1, 1);
+			}
+			const auto addDebugRead = [&](const uint16_t idx, const std::string_view desc) {
+				addRead(idx, 2);
+				if (!desc.empty() && (desc[0] == 'J' || desc[0] == 'D'))
+					addRead(size_t(idx) + 1, 2);
+			};
+			for (const LocalEntry& e : data.localVars)
+				addDebugRead(e.idx, e.desc);
+			for (const LocalTypeEntry& e : data.localVarTypes)
+				addDebugRead(e.idx, e.sig);
+		}
+
+		template<class MapT>
+		inline void remapFrameKeys(MapT& frames, const InstrOptScratch& s)
+		{
+			MapT old = std::move(frames);
+			frames.clear();
+			// From the back, so a kept instruction keeps its own frame,
+			// over the ones of removed instructions before it
+			while (!old.empty())
+			{
+				auto node = old.extract(std::prev(old.end()));
+				if (node.key() >= s.isRemoved.size() || s.isRemoved[node.key()] == INSTR_DEAD)
+					continue;
+				node.key() = s.newIdx[node.key()];
+				frames.insert(std::move(node));
+			}
+		}
+
+		// Drops the instructions marked in isRemoved, and moves every index in data & errorHandlers to match
+		inline void removeMarkedInstrs(
+			std::vector<Instr>& instrs,
+			std::vector<ErrorHandler>& errorHandlers,
+			CodeCompileData& data,
+			InstrOptScratch& s)
+		{
+			const size_t n = instrs.size();
+			std::vector<uint16_t>& newIdx = s.newIdx;
+			newIdx.resize(n + 1);
+			size_t kept = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				newIdx[i] = uint16_t(kept);
+				if (!s.isRemoved[i])
+					kept++;
+			}
+			newIdx[n] = uint16_t(kept);
+
+			const auto moveJmp = [&](const size_t from, int32_t& jmpOffset) {
+				jmpOffset = int32_t(newIdx[from + jmpOffset]) - int32_t(newIdx[from]);
+			};
+			for (size_t i = 0; i < n; i++)
+			{
+				if (s.isRemoved[i])
+					continue;
+				ezmatch(instrs[i])(
+				varcase(const auto&) {},
+				varcase(BaseBranched auto&) { moveJmp(i, var.jmpOffset); },
+				varcase(InstrType::GOTO&) { moveJmp(i, var.jmpOffset); },
+				varcase(InstrType::TABLE_SWITCH&) {
+					moveJmp(i, var->defaultJmpOffset);
+					for (int32_t& jmpOffset : var->jmpOffsets)
+						moveJmp(i, jmpOffset);
+				},
+				varcase(InstrType::LOOKUP_SWITCH&) {
+					moveJmp(i, var->defaultJmpOffset);
+					for (SwitchCase& kase : var->cases)
+						moveJmp(i, kase.jmpOffset);
+				},
+				varcase(InstrType::SWITCH&) {
+					moveJmp(i, var->defaultJmpOffset);
+					for (SwitchCase& kase : var->cases)
+						moveJmp(i, kase.jmpOffset);
+				}
+				);
+			}
+			size_t w = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				if (s.isRemoved[i])
+					continue;
+				if (w != i)
+					instrs[w] = std::move(instrs[i]);
+				w++;
+			}
+			instrs.resize(w);
+
+			// Handlers that only covered removed instructions cant throw anything
+			for (ErrorHandler& eh : errorHandlers)
+			{
+				const uint16_t afterEnd = newIdx[eh.endInstr + 1];
+				eh.startInstr = newIdx[eh.startInstr];
+				eh.endInstr = afterEnd == 0 ? 0 : uint16_t(afterEnd - 1);
+				eh.handlerInstr = newIdx[eh.handlerInstr];
+				if (afterEnd <= eh.startInstr)
+					eh.endInstr = UINT16_MAX;// Mark for removal
+			}
+			std::erase_if(errorHandlers, [](const ErrorHandler& eh) { return eh.endInstr == UINT16_MAX; });
+
+			for (LineNumEntry& e : data.lineNums)
+				e.startInstr = newIdx[e.startInstr];
+			// Past the end, or sharing an instruction with the next one
+			for (size_t i = 0; i < data.lineNums.size(); i++)
+			{
+				if (data.lineNums[i].startInstr >= w
+					|| (i + 1 < data.lineNums.size() && data.lineNums[i + 1].startInstr == data.lineNums[i].startInstr))
+					data.lineNums[i].startInstr = UINT16_MAX;
+			}
+			std::erase_if(data.lineNums, [](const LineNumEntry& e) { return e.startInstr == UINT16_MAX; });
+
+			const auto moveRange = [&](uint16_t& start, uint16_t& count) {
+				const uint16_t end = newIdx[start + count];
+				start = newIdx[start];
+				count = uint16_t(end - start);
+			};
+			for (LocalEntry& e : data.localVars)
+				moveRange(e.startInstr, e.instrCount);
+			for (LocalTypeEntry& e : data.localVarTypes)
+				moveRange(e.startInstr, e.instrCount);
+
+			remapFrameKeys(data.instructionFrames, s);
+			remapFrameKeys(data.ifInstructionFrames, s);
+
+			data.instrs = instrs;
+			data.errorHandlers = errorHandlers;
+		}
+	}
+
+	// Removes or shortens naive instruction sequences, until nothing changes:
+	//	NOP, GOTO to the next instruction, iinc by 0
+	//	A push that cant throw, then a POP of it (DUP then POP too)
+	//	Adding, subtracting, or'ing, xor'ing or shifting by a pushed 0
+	//	x = x (PUSH_x_VAR then SAVE_x_VAR on the same slot)
+	//	SAVE_x_VAR then PUSH_x_VAR on the same slot -> DUP, SAVE_x_VAR
+	//		or nothing, if the slot is never read anywhere else. Only with calcFrames on,
+	//		no instructionFrames, and no debug info for that slot
+	//
+	// Never merges over a jump target, handler, or instruction with a frame
+	// Fixes every instruction index in data & errorHandlers, and points data.instrs & data.errorHandlers to them
+	// A given maxStack is raised by the slots of the biggest added DUP
+	// Does nothing if there are jumps in bytes (I_GOTO16, I_GOTO32, ...), as those cant be moved
+	inline InstrOptStats peepholeInstrs(
+		std::vector<Instr>& instrs,
+		std::vector<ErrorHandler>& errorHandlers,
+		CodeCompileData& data,
+		InstrOptScratch& scratch)
+	{
+		_ASSERT(instrs.size() < UINT16_MAX);
+		data.instrs = instrs;
+		data.errorHandlers = errorHandlers;
+
+		InstrOptStats stats;
+		const bool canDropStores = data.calcFrames && data.instructionFrames.empty();
+		// Extra stack slots a DUP could need
+		uint8_t dupSlots = 0;
+		while (true)
+		{
+			if (!detail::markInstrLeaders(instrs, errorHandlers, data, scratch))
+				break;
+			if (canDropStores)
+				detail::countVarReads(instrs, data, scratch);
+			const auto isUnusedVar = [&](const size_t slot) {
+				return canDropStores && slot < scratch.varReads.size() && scratch.varReads[slot] == 1;
+			};
+
+			const size_t n = instrs.size();
+			scratch.isRemoved.assign(n, 0);
+			scratch.kept.clear();
+			// Was any instruction since the last kept one jumped to?
+			bool pendingLeader = false;
+			bool removedAny = false;
+			const auto remove = [&](const size_t i) {
+				scratch.isRemoved[i] = detail::INSTR_REMOVED;
+				stats.instrsSaved++;
+				stats.bytesSaved += detail::instrSizeEstimate(instrs[i]);
+				removedAny = true;
+			};
+			for (size_t i = 0; i < n; i++)
+			{
+				pendingLeader |= scratch.isLeader[i] != 0;
+				if (detail::isNoOpInstr(instrs[i]))
+				{
+					remove(i);
+					continue;
+				}
+				if (!pendingLeader && !scratch.kept.empty())
+				{
+					const size_t p = scratch.kept.back();
+					bool removePair = false;
+
+					const uint8_t pushSlots = detail::pureValuePushSlots(instrs[p]);
+					const InstrId id = InstrId(instrs[i].index());
+					if (pushSlots != 0)
+					{
+						if ((pushSlots == 1 && id == InstrId::POP_1) || (pushSlots == 2 && id == InstrId::POP_2))
+							removePair = true;
+					}
+					const uint8_t zeroSlots = detail::zeroIdentitySlots(id);
+					if (zeroSlots != 0 && detail::zeroPushSlots(instrs[p]) == zeroSlots)
+						removePair = true;
+
+					const detail::InstrVarUse prevUse = detail::instrVarUse(instrs[p]);
+					const detail::InstrVarUse use = detail::instrVarUse(instrs[i]);
+					const int kind = detail::localVarKind(use.id);
+					if (!removePair && kind != -1 && use.idx == prevUse.idx
+						&& kind == detail::localVarKind(prevUse.id))
+					{
+						const bool isWide = detail::localVarSlots(use.id) == 2;
+						if (!detail::isLocalVarSave(prevUse.id) && detail::isLocalVarSave(use.id))
+							removePair = true;// x = x
+						else if (detail::isLocalVarSave(prevUse.id) && !detail::isLocalVarSave(use.id))
+						{
+							if (isUnusedVar(size_t(use.idx)) && (!isWide || isUnusedVar(size_t(use.idx) + 1)))
+								removePair = true;
+							else if (detail::instrSizeEstimate(instrs[i]) > 1)
+							{
+								stats.bytesSaved += detail::instrSizeEstimate(instrs[i]) - 1;
+								instrs[i] = std::move(instrs[p]);
+								if (isWide)
+									instrs[p] = InstrType::DUP_2{};
+								else
+									instrs[p] = InstrType::DUP_1{};
+								dupSlots = std::max<uint8_t>(dupSlots, isWide ? 2 : 1);
+							}
+						}
+					}
+					if (removePair)
+					{
+						remove(p);
+						remove(i);
+						scratch.kept.pop_back();
+						// Jumps to p now go to whatever comes after i
+						pendingLeader = scratch.isLeader[p] != 0;
+						continue;
+					}
+				}
+				scratch.isLeader[i] = pendingLeader;
+				pendingLeader = false;
+				scratch.kept.push_back(uint16_t(i));
+			}
+			if (!removedAny)
+				break;
+			detail::removeMarkedInstrs(instrs, errorHandlers, data, scratch);
+		}
+		if (dupSlots != 0 && data.maxStack.has_value())
+			data.maxStack = uint16_t(std::min<size_t>(UINT16_MAX, size_t(*data.maxStack) + dupSlots));
+		return stats;
+	}
+
+	// Drops every instruction that can never run: tails after RET_*, THROW, GOTO & switches,
+	// and handlers whose range never runs
+	// Fixes every instruction index in data & errorHandlers, and points data.instrs & data.errorHandlers to them
+	// Frames given for dead instructions are dropped
+	// Does nothing if there are jumps in bytes (I_GOTO16, I_GOTO32, ...), as those cant be followed
+	inline InstrOptStats removeUnreachableInstrs(
+		std::vector<Instr>& instrs,
+		std::vector<ErrorHandler>& errorHandlers,
+		CodeCompileData& data,
+		InstrOptScratch& scratch)
+	{
+		_ASSERT(instrs.size() < UINT16_MAX);
+		data.instrs = instrs;
+		data.errorHandlers = errorHandlers;
+
+		InstrOptStats stats;
+		const size_t n = instrs.size();
+		if (n == 0)
+			return stats;
+
+		// Starts as all dead, reached ones are cleared
+		std::vector<uint8_t>& isRemoved = scratch.isRemoved;
+		isRemoved.assign(n, detail::INSTR_DEAD);
+		std::vector<uint16_t>& work = scratch.work;
+		work.clear();
+
+		bool ok = true;
+		const auto reach = [&](const int64_t target) {
+			if (target < 0 || size_t(target) >= n)
+			{
+				ok = false;
+				return;
+			}
+			if (isRemoved[size_t(target)] == 0)
+				return;
+			isRemoved[size_t(target)] = 0;
+			work.push_back(uint16_t(target));
+		};
+		reach(0);
+		while (!work.empty() && ok)
+		{
+			const size_t i = work.back();
+			work.pop_back();
+
+			bool flowEnds = false;
+			ezmatch(instrs[i])(
+			varcase(const auto&) {
+				flowEnds = detail::isInstrFlowEnd(INSTR_OP_CODE<decltype(var)>);
+			},
+			varcase(const BaseBranched16 auto&) { ok = false; },
+			varcase(const BaseBranched32 auto&) { ok = false; },
+			varcase(const InstrType::I_DEPR_GOTO_VAR_U16) { ok = false; },
+			varcase(const InstrType::I_WIDE) { ok = false; },
+			varcase(const BaseBranched auto&) {
+				reach(int64_t(i) + var.jmpOffset);
+			},
+			varcase(const InstrType::GOTO) {
+				reach(int64_t(i) + var.jmpOffset);
+				flowEnds = true;
+			},
+			varcase(const InstrType::TABLE_SWITCH&) {
+				reach(int64_t(i) + var->defaultJmpOffset);
+				for (const int32_t jmpOffset : var->jmpOffsets)
+					reach(int64_t(i) + jmpOffset);
+				flowEnds = true;
+			},
+			varcase(const InstrType::LOOKUP_SWITCH&) {
+				reach(int64_t(i) + var->defaultJmpOffset);
+				for (const SwitchCase& kase : var->cases)
+					reach(int64_t(i) + kase.jmpOffset);
+				flowEnds = true;
+			},
+			varcase(const InstrType::SWITCH&) {
+				reach(int64_t(i) + var->defaultJmpOffset);
+				for (const SwitchCase& kase : var->cases)
+					reach(int64_t(i) + kase.jmpOffset);
+				flowEnds = true;
+			}
+			);
+			if (!flowEnds)
+				reach(int64_t(i) + 1);
+
+			for (const ErrorHandler& eh : errorHandlers)
+			{
+				if (i >= eh.startInstr && i <= eh.endInstr)
+					reach(eh.handlerInstr);
+			}
+		}
+		for (const ErrorHandler& eh : errorHandlers)
+		{
+			if (eh.startInstr > eh.endInstr || eh.endInstr >= n)
+				ok = false;
+		}
+		if (!ok)
+			return stats;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			if (isRemoved[i] == 0)
+				continue;
+			stats.instrsSaved++;
+			stats.bytesSaved += detail::instrSizeEstimate(instrs[i]);
+		}
+		if (stats.instrsSaved != 0)
+			detail::removeMarkedInstrs(instrs, errorHandlers, data, scratch);
+		return stats;
+	}
+
+	// Makes jumps skip the GOTO's they land on:
+	//	Every IF, GOTO, switch entry & handler that lands on a GOTO (chain) goes straight to the end of it
+	//	A GOTO that lands on RET_* or THROW becomes a copy of it, if the same handlers cover both
+	//	IF_x L; GOTO M; L: -> IF_not_x M; L: (if nothing jumps to the GOTO)
+	//	A IF to the next instruction only pops its values
+	//
+	// Fixes every instruction index in data & errorHandlers, and points data.instrs & data.errorHandlers to them
+	// Runs removeUnreachableInstrs, to drop the GOTO's nothing jumps to anymore
+	// Does nothing if there are jumps in bytes (I_GOTO16, I_GOTO32, ...), as those cant be followed
+	inline InstrOptStats threadJumps(
+		std::vector<Instr>& instrs,
+		std::vector<ErrorHandler>& errorHandlers,
+		CodeCompileData& data,
+		InstrOptScratch& scratch)
+	{
+		_ASSERT(instrs.size() < UINT16_MAX);
+		data.instrs = instrs;
+		data.errorHandlers = errorHandlers;
+
+		InstrOptStats stats;
+		// Also checks that every jump can be followed
+		if (!detail::markInstrLeaders(instrs, errorHandlers, data, scratch))
+			return stats;
+		const size_t n = instrs.size();
+
+		// Where a jump to target really ends up
+		const auto finalTarget = [&](size_t target) {
+			// Only n steps, so GOTO loops end
+			for (size_t steps = 0; steps < n; steps++)
+			{
+				int32_t jmpOffset = 0;
+				ezmatch(instrs[target])(
+				varcase(const auto&) {},
+				varcase(const InstrType::GOTO) { jmpOffset = var.jmpOffset; }
+				);
+				if (jmpOffset == 0)
+					return target;
+				target = size_t(int64_t(target) + jmpOffset);
+			}
+			return target;
+		};
+		const auto thread = [&](const size_t from, int32_t& jmpOffset) {
+			jmpOffset = int32_t(int64_t(finalTarget(size_t(int64_t(from) + jmpOffset))) - int64_t(from));
+		};
+		const auto sameHandlers = [&](const size_t a, const size_t b) {
+			for (const ErrorHandler& eh : errorHandlers)
+			{
+				if ((a >= eh.startInstr && a <= eh.endInstr) != (b >= eh.startInstr && b <= eh.endInstr))
+					return false;
+			}
+			return true;
+		};
+
+		for (size_t i = 0; i < n; i++)
+		{
+			size_t retTarget = SIZE_MAX;
+			ezmatch(instrs[i])(
+			varcase(const auto&) {},
+			varcase(BaseBranched auto&) { thread(i, var.jmpOffset); },
+			varcase(InstrType::GOTO&) {
+				thread(i, var.jmpOffset);
+				retTarget = size_t(int64_t(i) + var.jmpOffset);
+			},
+			varcase(InstrType::TABLE_SWITCH&) {
+				thread(i, var->defaultJmpOffset);
+				for (int32_t& jmpOffset : var->jmpOffsets)
+					thread(i, jmpOffset);
+			},
+			varcase(InstrType::LOOKUP_SWITCH&) {
+				thread(i, var->defaultJmpOffset);
+				for (SwitchCase& kase : var->cases)
+					thread(i, kase.jmpOffset);
+			},
+			varcase(InstrType::SWITCH&) {
+				thread(i, var->defaultJmpOffset);
+				for (SwitchCase& kase : var->cases)
+					thread(i, kase.jmpOffset);
+			}
+			);
+			if (retTarget == SIZE_MAX || !sameHandlers(i, retTarget))
+				continue;
+			ezmatch(instrs[retTarget])(
+			varcase(const auto&) {
+				using T = std::remove_cvref_t<decltype(var)>;
+				if constexpr (detail::isInstrFlowEnd(INSTR_OP_CODE<T>))
+				{
+					instrs[i] = T{};
+					stats.bytesSaved += 3 - 1;
+				}
+			}
+			);
+		}
+
+		for (ErrorHandler& eh : errorHandlers)
+			eh.handlerInstr = uint16_t(finalTarget(eh.handlerInstr));
+
+		// Drop the GOTO's nothing jumps to anymore, so more IF's land right after the next GOTO
+		stats += removeUnreachableInstrs(instrs, errorHandlers, data, scratch);
+
+		const size_t keptN = instrs.size();
+		detail::markInstrLeaders(instrs, errorHandlers, data, scratch);
+		scratch.isRemoved.assign(keptN, 0);
+		size_t inverted = 0;
+		for (size_t i = 0; i < keptN; i++)
+		{
+			InstrId ifId = InstrId::NOP;
+			int32_t ifJmpOffset = 0;
+			ezmatch(instrs[i])(
+			varcase(const auto&) {},
+			varcase(const BaseBranched auto&) {
+				ifId = INSTR_OP_CODE<decltype(var)>;
+				ifJmpOffset = var.jmpOffset;
+			}
+			);
+			if (ifId == InstrId::NOP)
+				continue;
+
+			if (ifJmpOffset == 1)
+			{
+				// Both ways go to the same place
+				if (detail::simpleStackEffect(ifId)->pops == 2)
+					instrs[i] = InstrType::POP_2{};
+				else
+					instrs[i] = InstrType::POP_1{};
+				stats.bytesSaved += 3 - 1;
+				continue;
+			}
+			if (ifJmpOffset != 2 || i + 1 >= keptN || scratch.isLeader[i + 1])
+				continue;
+			int32_t gotoJmpOffset = 0;
+			ezmatch(instrs[i + 1])(
+			varcase(const auto&) {},
+			varcase(const InstrType::GOTO) { gotoJmpOffset = var.jmpOffset; }
+			);
+			if (gotoJmpOffset == 0)
+				continue;
+			std::optional<Instr> inv = detail::newIfInstr(invertIfInstr(ifId), gotoJmpOffset + 1);
+			if (!inv.has_value())
+				continue;
+			instrs[i] = std::move(*inv);
+			scratch.isRemoved[i + 1] = detail::INSTR_REMOVED;
+			inverted++;
+			stats.instrsSaved++;
+			stats.bytesSaved += detail::instrSizeEstimate(instrs[i + 1]);
+			i++;
+		}
+		if (inverted != 0)
+			detail::removeMarkedInstrs(instrs, errorHandlers, data, scratch);
+		return stats;
+	}
+
+	namespace detail
+	{
+		// A pushed constant, I32, I64, F32 or F64
+		using FoldConst = std::variant<std::monostate, int32_t, int64_t, float, double>;
+
+		/// @returns monostate, if it doesnt push a known constant
+		inline FoldConst foldConstOf(const Instr& instr)
+		{
+			FoldConst ret;
+			ezmatch(instr)(
+			varcase(const auto&) {
+				constexpr InstrId id = INSTR_OP_CODE<decltype(var)>;
+				if constexpr (id >= InstrId::PUSH_I32_M1 && id <= InstrId::PUSH_I32_5)
+					ret = int32_t(id) - int32_t(InstrId::PUSH_I32_0);
+				else if constexpr (id >= InstrId::PUSH_I64_0 && id <= InstrId::PUSH_I64_1)
+					ret = int64_t(id) - int64_t(InstrId::PUSH_I64_0);
+				else if constexpr (id >= InstrId::PUSH_F32_0 && id <= InstrId::PUSH_F32_2)
+					ret = float(int(id) - int(InstrId::PUSH_F32_0));
+				else if constexpr (id >= InstrId::PUSH_F64_0 && id <= InstrId::PUSH_F64_1)
+					ret = double(int(id) - int(InstrId::PUSH_F64_0));
+			},
+			varcase(const InstrType::I_PUSH_I32_I8) { ret = int32_t(var); },
+			varcase(const InstrType::I_PUSH_I32_I16) { ret = int32_t(var); },
+			varcase(const InstrType::PUSH_I32_I32) { ret = var; },
+			varcase(const InstrType::PUSH_I64_I64) { ret = var; },
+			varcase(const InstrType::PUSH_F32_F32) { ret = var; },
+			varcase(const InstrType::PUSH_F64_F64) { ret = var; },
+			varcase(const InstrType::PUSH_CONST&) {
+				if (var.isHandle())
+					return;// Unknown without the RefTable
+				ezmatch(*var)(
+				varcase(const auto&) {},
+				varcase(const ConstPoolItmType::I32) { ret = int32_t(var); },
+				varcase(const ConstPoolItmType::I64) { ret = int64_t(var); },
+				varcase(const ConstPoolItmType::F32) { ret = float(var); },
+				varcase(const ConstPoolItmType::F64) { ret = double(var); }
+				);
+			}
+			);
+			return ret;
+		}
+		inline Instr newConstInstr(const FoldConst& c)
+		{
+			if (const int32_t* v = std::get_if<int32_t>(&c))
+				return InstrType::PUSH_I32_I32{ *v };
+			if (const int64_t* v = std::get_if<int64_t>(&c))
+				return InstrType::PUSH_I64_I64{ *v };
+			if (const float* v = std::get_if<float>(&c))
+				return InstrType::PUSH_F32_F32{ *v };
+			_ASSERT(std::holds_alternative<double>(c));
+			return InstrType::PUSH_F64_F64{ std::get<double>(c) };
+		}
+
+		// f2i, f2l, d2i, d2l: NaN -> 0, saturates, else rounds towards 0
+		template<class I, class F>
+		inline I javaFloatToInt(const F v)
+		{
+			if (v != v)
+				return 0;
+			// max + 1 is a power of 2, so it is exact
+			if (v >= -F(std::numeric_limits<I>::min()))
+				return std::numeric_limits<I>::max();
+			if (v <= F(std::numeric_limits<I>::min()))
+				return std::numeric_limits<I>::min();
+			return I(v);
+		}
+		// Wraps around, like java
+		/// @returns monostate for a division / remainder by 0, as that throws
+		template<class T>
+		inline FoldConst foldIntArith(const size_t op, const T a, const T b)
+		{
+			using U = std::make_unsigned_t<T>;
+			switch (op)
+			{
+			case 0: return T(U(a) + U(b));
+			case 1: return T(U(a) - U(b));
+			case 2: return T(U(a) * U(b));
+			case 3:
+				if (b == 0)
+					return {};
+				// Overflows, min / -1 is min
+				return b == -1 ? T(U(0) - U(a)) : T(a / b);
+			default:
+				if (b == 0)
+					return {};
+				return b == -1 ? T(0) : T(a % b);
+			}
+		}
+		template<class T>
+		inline FoldConst foldFloatArith(const size_t op, const T a, const T b)
+		{
+			switch (op)
+			{
+			case 0: return T(a + b);
+			case 1: return T(a - b);
+			case 2: return T(a * b);
+			case 3: return T(a / b);
+			default: return T(std::fmod(a, b));// frem / drem round towards 0, like fmod
+			}
+		}
+		// lcmp, fcmpl, fcmpg, ...
+		// nan - the result, if either is NaN
+		template<class T>
+		inline FoldConst foldCmp(const T a, const T b, const int32_t nan)
+		{
+			if (a != a || b != b)
+				return nan;
+			return int32_t(a > b) - int32_t(a < b);
+		}
+
+		// Both constants are popped, a is the deeper one
+		/// @returns monostate, if it cant be folded
+		inline FoldConst foldBinaryConst(const InstrId id, const FoldConst& a, const FoldConst& b)
+		{
+			const int32_t* i32a = std::get_if<int32_t>(&a);
+			const int32_t* i32b = std::get_if<int32_t>(&b);
+			const int64_t* i64a = std::get_if<int64_t>(&a);
+			const int64_t* i64b = std::get_if<int64_t>(&b);
+			const float* f32a = std::get_if<float>(&a);
+			const float* f32b = std::get_if<float>(&b);
+			const double* f64a = std::get_if<double>(&a);
+			const double* f64b = std::get_if<double>(&b);
+
+			if (id >= InstrId::ADD_I32 && id <= InstrId::REM_F64)
+			{
+				// ADD, SUB, MUL, DIV, REM, each as I32, I64, F32, F64
+				const size_t op = (size_t(id) - size_t(InstrId::ADD_I32)) / 4;
+				switch ((size_t(id) - size_t(InstrId::ADD_I32)) % 4)
+				{
+				case 0: if (i32a && i32b) return foldIntArith(op, *i32a, *i32b); break;
+				case 1: if (i64a && i64b) return foldIntArith(op, *i64a, *i64b); break;
+				case 2: if (f32a && f32b) return foldFloatArith(op, *f32a, *f32b); break;
+				default: if (f64a && f64b) return foldFloatArith(op, *f64a, *f64b); break;
+				}
+				return {};
+			}
+			// The shift amount is always an int, masked to the size
+			if (i32b && (i32a || i64a))
+			{
+				const int32_t n = *i32b;
+				switch (id)
+				{
+				case InstrId::SHL_I32: if (i32a) return int32_t(uint32_t(*i32a) << (n & 31)); break;
+				case InstrId::SRC_I32: if (i32a) return int32_t(*i32a >> (n & 31)); break;
+				case InstrId::SHR_I32: if (i32a) return int32_t(uint32_t(*i32a) >> (n & 31)); break;
+				case InstrId::SHL_I64: if (i64a) return int64_t(uint64_t(*i64a) << (n & 63)); break;
+				case InstrId::SRC_I64: if (i64a) return int64_t(*i64a >> (n & 63)); break;
+				case InstrId::SHR_I64: if (i64a) return int64_t(uint64_t(*i64a) >> (n & 63)); break;
+				default: break;
+				}
+			}
+			switch (id)
+			{
+			case InstrId::AND_I32: if (i32a && i32b) return int32_t(*i32a & *i32b); break;
+			case InstrId::OR_I32: if (i32a && i32b) return int32_t(*i32a | *i32b); break;
+			case InstrId::XOR_I32: if (i32a && i32b) return int32_t(*i32a ^ *i32b); break;
+			case InstrId::AND_I64: if (i64a && i64b) return int64_t(*i64a & *i64b); break;
+			case InstrId::OR_I64: if (i64a && i64b) return int64_t(*i64a | *i64b); break;
+			case InstrId::XOR_I64: if (i64a && i64b) return int64_t(*i64a ^ *i64b); break;
+
+			case InstrId::CMP_I64: if (i64a && i64b) return foldCmp(*i64a, *i64b, 0); break;
+			case InstrId::CMP_F32_M: if (f32a && f32b) return foldCmp(*f32a, *f32b, -1); break;
+			case InstrId::CMP_F32_P: if (f32a && f32b) return foldCmp(*f32a, *f32b, 1); break;
+			case InstrId::CMP_F64_M: if (f64a && f64b) return foldCmp(*f64a, *f64b, -1); break;
+			case InstrId::CMP_F64_P: if (f64a && f64b) return foldCmp(*f64a, *f64b, 1); break;
+			default: break;
+			}
+			return {};
+		}
+		/// @returns monostate, if it cant be folded
+		inline FoldConst foldUnaryConst(const InstrId id, const FoldConst& a)
+		{
+			const int32_t* i32 = std::get_if<int32_t>(&a);
+			const int64_t* i64 = std::get_if<int64_t>(&a);
+			const float* f32 = std::get_if<float>(&a);
+			const double* f64 = std::get_if<double>(&a);
+			switch (id)
+			{
+			case InstrId::NEG_I32: if (i32) return int32_t(0u - uint32_t(*i32)); break;
+			case InstrId::NEG_I64: if (i64) return int64_t(0ull - uint64_t(*i64)); break;
+			case InstrId::NEG_F32: if (f32) return -*f32; break;
+			case InstrId::NEG_F64: if (f64) return -*f64; break;
+
+			case InstrId::CAST_I32_I64: if (i32) return int64_t(*i32); break;
+			case InstrId::CAST_I32_F32: if (i32) return float(*i32); break;
+			case InstrId::CAST_I32_F64: if (i32) return double(*i32); break;
+			case InstrId::CAST_I64_I32: if (i64) return int32_t(*i64); break;
+			case InstrId::CAST_I64_F32: if (i64) return float(*i64); break;
+			case InstrId::CAST_I64_F64: if (i64) return double(*i64); break;
+
+			case InstrId::CAST_F32_I32: if (f32) return javaFloatToInt<int32_t>(*f32); break;
+			case InstrId::CAST_F32_I64: if (f32) return javaFloatToInt<int64_t>(*f32); break;
+			case InstrId::CAST_F32_F64: if (f32) return double(*f32); break;
+			case InstrId::CAST_F64_I32: if (f64) return javaFloatToInt<int32_t>(*f64); break;
+			case InstrId::CAST_F64_I64: if (f64) return javaFloatToInt<int64_t>(*f64); break;
+			case InstrId::CAST_F64_F32: if (f64) return float(*f64); break;
+
+			case InstrId::CAST_I32_I8: if (i32) return int32_t(int8_t(*i32)); break;
+			case InstrId::CAST_I32_CHR: if (i32) return int32_t(uint16_t(*i32)); break;
+			case InstrId::CAST_I32_I16: if (i32) return int32_t(int16_t(*i32)); break;
+			default: break;
+			}
+			return {};
+		}
+
+		/// @returns k, if v is 2^k, else -1
+		inline int powerOf2Log(const FoldConst& c)
+		{
+			uint64_t v = 0;
+			if (const int32_t* i32 = std::get_if<int32_t>(&c))
+				v = uint32_t(*i32);
+			else if (const int64_t* i64 = std::get_if<int64_t>(&c))
+				v = uint64_t(*i64);
+			return std::has_single_bit(v) ? std::countr_zero(v) : -1;
+		}
+		// Pushes a int that is never negative
+		inline bool isNonNegI32Push(const Instr& instr)
+		{
+			const InstrId id = InstrId(instr.index());
+			return id == InstrId::PUSH_ARRLEN || id == InstrId::CAST_I32_CHR;
+		}
+	}
+
+	// Folds instructions on pushed constants into a single push, following java:
+	//	Arithmetic, bitwise ops & shifts on ints, longs, floats & doubles
+	//	Comparisons (CMP_*), negation & casts
+	//	Ints & longs wrap around, floats & doubles are IEEE, f2i & co saturate (NaN -> 0)
+	//	Integer division & remainder by 0 are kept, as they throw
+	// And reduces strength, where it doesnt change the result:
+	//	Int / long multiplication by 2^k -> left shift by k (also for min, as it wraps around)
+	//	Int / long multiplication or division by 1 -> nothing
+	//	Int division & remainder of a array length, or char by 2^k -> unsigned shift, and
+	//		(Division rounds towards 0, so a shift is only right if the value is never negative)
+	//
+	// Folding chains, (2 + 3) * 4 is a single push
+	// Never merges over a jump target, handler, or instruction with a frame
+	// Fixes every instruction index in data & errorHandlers, and points data.instrs & data.errorHandlers to them
+	// Does nothing if there are jumps in bytes (I_GOTO16, I_GOTO32, ...), as those cant be moved
+	inline InstrOptStats foldConstInstrs(
+		std::vector<Instr>& instrs,
+		std::vector<ErrorHandler>& errorHandlers,
+		CodeCompileData& data,
+		InstrOptScratch& scratch)
+	{
+		_ASSERT(instrs.size() < UINT16_MAX);
+		data.instrs = instrs;
+		data.errorHandlers = errorHandlers;
+
+		InstrOptStats stats;
+		if (!detail::markInstrLeaders(instrs, errorHandlers, data, scratch))
+			return stats;
+
+		const size_t n = instrs.size();
+		scratch.isRemoved.assign(n, 0);
+		scratch.kept.clear();
+		bool pendingLeader = false;
+		bool removedAny = false;
+		const auto remove = [&](const size_t i) {
+			scratch.isRemoved[i] = detail::INSTR_REMOVED;
+			stats.instrsSaved++;
+			stats.bytesSaved += detail::instrSizeEstimate(instrs[i]);
+			removedAny = true;
+		};
+		const auto replace = [&](const size_t i, Instr&& instr) {
+			const size_t oldSize = detail::instrSizeEstimate(instrs[i]);
+			instrs[i] = std::move(instr);
+			const size_t newSize = detail::instrSizeEstimate(instrs[i]);
+			stats.bytesSaved += oldSize > newSize ? oldSize - newSize : 0;
+		};
+		for (size_t i = 0; i < n; i++)
+		{
+			pendingLeader |= scratch.isLeader[i] != 0;
+			const std::vector<uint16_t>& kept = scratch.kept;
+			if (!pendingLeader && !kept.empty())
+			{
+				const InstrId id = InstrId(instrs[i].index());
+				const size_t p2 = kept.back();
+				const detail::FoldConst b = detail::foldConstOf(instrs[p2]);
+
+				bool folded = false;
+				if (!std::holds_alternative<std::monostate>(b))
+				{
+					const detail::FoldConst unary = detail::foldUnaryConst(id, b);
+					if (!std::holds_alternative<std::monostate>(unary))
+					{
+						replace(p2, detail::newConstInstr(unary));
+						remove(i);
+						folded = true;
+					}
+				}
+				// p2 is jumped to, so other values might come with it
+				if (!folded && kept.size() >= 2 && !scratch.isLeader[p2] && !std::holds_alternative<std::monostate>(b))
+				{
+					const size_t p1 = kept[kept.size() - 2];
+					const detail::FoldConst binary = detail::foldBinaryConst(id, detail::foldConstOf(instrs[p1]), b);
+					if (!std::holds_alternative<std::monostate>(binary))
+					{
+						replace(p1, detail::newConstInstr(binary));
+						remove(p2);
+						remove(i);
+						scratch.kept.pop_back();
+						folded = true;
+					}
+					else if (id == InstrId::DIV_I32 || id == InstrId::REM_I32)
+					{
+						const int k = detail::powerOf2Log(b);
+						if (k > 0 && detail::isNonNegI32Push(instrs[p1]))
+						{
+							if (id == InstrId::DIV_I32)
+							{
+								replace(p2, InstrType::PUSH_I32_I32{ k });
+								replace(i, InstrType::SHR_I32{});
+							}
+							else
+							{
+								replace(p2, InstrType::PUSH_I32_I32{ int32_t((1u << k) - 1) });
+								replace(i, InstrType::AND_I32{});
+							}
+						}
+					}
+				}
+				if (folded)
+					continue;
+
+				const int k = detail::powerOf2Log(b);
+				const bool isI32 = std::holds_alternative<int32_t>(b);
+				if (k == 0 && (id == (isI32 ? InstrId::MUL_I32 : InstrId::MUL_I64)
+					|| id == (isI32 ? InstrId::DIV_I32 : InstrId::DIV_I64)))
+				{// x * 1, x / 1
+					remove(p2);
+					remove(i);
+					scratch.kept.pop_back();
+					// Jumps to p2 now go to whatever comes after i
+					pendingLeader = scratch.isLeader[p2] != 0;
+					continue;
+				}
+				if (k > 0 && id == (isI32 ? InstrId::MUL_I32 : InstrId::MUL_I64))
+				{// The shift amount is a int, even for longs
+					replace(p2, InstrType::PUSH_I32_I32{ k });
+					if (isI32)
+						replace(i, InstrType::SHL_I32{});
+					else
+						replace(i, InstrType::SHL_I64{});
+				}
+			}
+			scratch.isLeader[i] = pendingLeader;
+			pendingLeader = false;
+			scratch.kept.push_back(uint16_t(i));
+		}
+		if (removedAny)
+			detail::removeMarkedInstrs(instrs, errorHandlers, data, scratch);
+		return stats;
+	}
+}
@@ -73,6 +73,12 @@ namespace cpp_jcfu
 		template<class T>
 		inline static constexpr uint8_t idxOf = type_index<T>();
 
+		/// @returns {f(std::type_identity<T>{})...}, indexed like idxOf
+		template<typename F>
+		static constexpr auto typeTable(F&& f) {
+			return std::array{ f(std::type_identity<Types>{})... };
+		}
+
 		template<typename T, typename... Args>
 		void emplace(Args&&... args) {
 			reset();
@@ -88,6 +94,7 @@ namespace cpp_jcfu
 			{
 				_TRY_DESTROY_TYPE(InstrType::TABLE_SWITCH);
 				_TRY_DESTROY_TYPE(InstrType::LOOKUP_SWITCH);
+				_TRY_DESTROY_TYPE(InstrType::SWITCH);
 
 				_TRY_DESTROY_TYPE(InstrType::PUSH_GET_STATIC);
 				_TRY_DESTROY_TYPE(InstrType::PUSH_GET_FIELD);
@@ -138,6 +145,11 @@ namespace cpp_jcfu
 		void visit(Visitor&& visitor) const {
 			visitImpl(std::forward<Visitor>(visitor), std::index_sequence_for<Types...>{});
 		}
+		// For changing the instruction in place (jump offsets, ...)
+		template<typename Visitor>
+		void visit(Visitor&& visitor) {
+			visitMutImpl(std::forward<Visitor>(visitor), std::index_sequence_for<Types...>{});
+		}
 
 		constexpr bool valueless_by_exception() const noexcept {
 			return typeIndex == 0xFF;
@@ -156,6 +168,15 @@ namespace cpp_jcfu
 			};
 			visitors[typeIndex](&storage, visitor);
 		}
+		template<typename Visitor, size_t... Is>
+		void visitMutImpl(Visitor&& visitor, std::index_sequence<Is...>) {
+
+			using FuncType = void(*)(void*, Visitor&);
+			static constexpr FuncType visitors[] = {
+				[](void* ptr, Visitor& vis) { vis(*reinterpret_cast<Types*>(ptr)); }...
+			};
+			visitors[typeIndex](&storage, visitor);
+		}
 
 		void moveFrom(InstrVariant&& other) {
 
@@ -170,6 +191,7 @@ namespace cpp_jcfu
 			{
 				_TRY_MOVE_TYPE(InstrType::TABLE_SWITCH);
 				_TRY_MOVE_TYPE(InstrType::LOOKUP_SWITCH);
+				_TRY_MOVE_TYPE(InstrType::SWITCH);
 
 				_TRY_MOVE_TYPE(InstrType::PUSH_GET_STATIC);
 				_TRY_MOVE_TYPE(InstrType::PUSH_GET_FIELD);
@@ -462,7 +484,8 @@ namespace cpp_jcfu
 		InstrType::PUSH_F32_F32, //Will be converted
 		InstrType::PUSH_F64_F64, //Will be converted
 
-		InstrType::GOTO //Either goto, or goto_w
+		InstrType::GOTO, //Either goto, or goto_w
+		InstrType::SWITCH //Compares, tableswitch, lookupswitch, or a mix
 	>;
 
 	template<class T>
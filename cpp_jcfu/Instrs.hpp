@@ -8,6 +8,7 @@
 #include <memory>
 
 #include "State.hpp"
+#include "RefTable.hpp"
 #include "ext/ExtendVariant.hpp"
 
 namespace cpp_jcfu
@@ -302,15 +303,15 @@ namespace cpp_jcfu
 		};
 		struct BaseFieldRef
 		{
-			std::unique_ptr<ConstPoolItmType::FIELD_REF> ref;
+			Ref<ConstPoolItmType::FIELD_REF> ref;
 		};
 		struct BaseFuncRef
 		{
-			std::unique_ptr<ConstPoolItmType::FUNC_REF> ref;
+			Ref<ConstPoolItmType::FUNC_REF> ref;
 		};
 		struct BaseClassRef
 		{
-			std::unique_ptr<ConstPoolItmType::CLASS> ref;
+			Ref<ConstPoolItmType::CLASS> ref;
 		};
 
 		// Variant elements:
@@ -585,7 +586,7 @@ namespace cpp_jcfu
 
 		// Utility
 
-		using PUSH_CONST = std::unique_ptr<ConstPoolItm>;
+		using PUSH_CONST = Ref<ConstPoolItm>;
 
 		using PUSH_I32_I32 = int32_t;	//Will be converted
 		using PUSH_F32_F32 = float;		//Will be converted
@@ -593,6 +594,13 @@ namespace cpp_jcfu
 		using PUSH_F64_F64 = double;	//Will be converted
 
 		struct GOTO :BaseBranch {};
+
+		struct SwitchData
+		{
+			std::vector<SwitchCase> cases;//Any order, keys must be unique
+			int32_t defaultJmpOffset;
+		};
+		using SWITCH = std::unique_ptr<SwitchData>;
 	}
 
 	constexpr InstrId invertIfInstr(const InstrId id) {
@@ -649,4 +657,19 @@ namespace cpp_jcfu
 			.refDesc = nameAndDesc
 		}}) };
 	}
+	// Interned, so calling it again for the same function doesnt allocate
+	inline InstrType::PUSH_RUN_STATIC newPushRunStatic(
+		RefTable& refs,
+		const std::string_view klass,
+		const std::string_view name, const std::string_view desc)
+	{
+		return { { refs.func(klass, name, desc) } };
+	}
+	inline InstrType::PUSH_RUN_VIRTUAL newPushRunVirtual(
+		RefTable& refs,
+		const std::string_view klass,
+		const std::string_view name, const std::string_view desc)
+	{
+		return { { refs.func(klass, name, desc) } };
+	}
 }
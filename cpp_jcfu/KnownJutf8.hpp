@@ -0,0 +1,40 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <array>
+#include <string_view>
+#include <algorithm>
+
+#include "Utf8ToJutf8.hpp"
+
+namespace cpp_jcfu
+{
+	// Attribute names the writer itself emits
+	enum class KnownJutf8 : uint8_t
+	{
+		CODE,
+		STACK_MAP_TABLE,
+		LINE_NUMBER_TABLE,
+		LOCAL_VARIABLE_TABLE,
+		LOCAL_VARIABLE_TYPE_TABLE,
+
+		ENUM_SIZE
+	};
+	inline constexpr size_t KNOWN_JUTF8_COUNT = size_t(KnownJutf8::ENUM_SIZE);
+
+	// Already in modified utf8 (checked below), so they are written as is
+	inline constexpr std::array<std::string_view, KNOWN_JUTF8_COUNT> KNOWN_JUTF8 = {
+		"Code",
+		"StackMapTable",
+		"LineNumberTable",
+		"LocalVariableTable",
+		"LocalVariableTypeTable"
+	};
+	static_assert(std::ranges::all_of(KNOWN_JUTF8, isPlainJutf8));
+
+	constexpr std::string_view knownJutf8Str(const KnownJutf8 k) {
+		return KNOWN_JUTF8[size_t(k)];
+	}
+}
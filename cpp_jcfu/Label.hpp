@@ -0,0 +1,195 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <span>
+#include <optional>
+#include <algorithm>
+
+#include "State.hpp"
+#include "ext/CppMatch.hpp"
+#include "InstrVariant.hpp"
+#include "CodeCompileData.hpp"
+
+namespace cpp_jcfu
+{
+	// A branch target, that is bound to a instruction later
+	struct Label
+	{
+		uint32_t id;
+	};
+	struct LabelCase
+	{
+		int32_t k;
+		Label target;
+	};
+
+	// Flat label -> instruction table, a label is a index into it
+	class LabelTable
+	{
+		std::vector<uint16_t> instrs;// UINT16_MAX if not bound yet
+
+	public:
+		Label newLabel()
+		{
+			_ASSERT(instrs.size() < (1u << 29) && "Too many labels");// Has to fit in a PatchPoint
+			instrs.push_back(UINT16_MAX);
+			return { uint32_t(instrs.size() - 1) };
+		}
+		// instrIdx - the instruction the label points at, can be 1 past the last one
+		void bind(const Label l, const uint16_t instrIdx)
+		{
+			_ASSERT(!isBound(l) && "Label bound twice");
+			_ASSERT(instrIdx != UINT16_MAX);
+			instrs[l.id] = instrIdx;
+		}
+		bool isBound(const Label l) const { return instrs[l.id] != UINT16_MAX; }
+		uint16_t instrOf(const Label l) const
+		{
+			_ASSERT(isBound(l) && "Label never bound");
+			return instrs[l.id];
+		}
+		/// @returns the jmpOffset for a branch at instruction from
+		int32_t jmpOffset(const uint16_t from, const Label l) const {
+			return int32_t(instrOf(l)) - int32_t(from);
+		}
+
+		size_t size() const { return instrs.size(); }
+		// Keeps the memory
+		void clear() { instrs.clear(); }
+	};
+
+	// Builds a std::vector<Instr>, where branches, switches & error handlers target labels,
+	// instead of counting instructions. resolve() fills in every jmpOffset at once.
+	//
+	// Usage:
+	//	InstrLabeler lb(instrs, errorHandlers);
+	//	const Label loop = lb.newLabel();
+	//	lb.bind(loop);
+	//	instrs.emplace_back(...);
+	//	lb.branch<InstrType::IF_EQL>(loop);
+	//	lb.resolve();
+	//
+	// Instructions can be pushed to instrs directly, as long as its only appended to, until resolve()
+	class InstrLabeler
+	{
+		static constexpr uint32_t NO_CASE = UINT32_MAX;
+
+		struct Fixup
+		{
+			uint16_t instrIdx;
+			uint32_t caseIdx;// NO_CASE for the jmpOffset / defaultJmpOffset
+			Label target;
+		};
+		struct HandlerFixup
+		{
+			size_t handlerIdx;
+			Label start, end, handler;
+		};
+
+		std::vector<Instr>& instrs;
+		std::vector<ErrorHandler>& errorHandlers;
+		LabelTable labels;
+		std::vector<Fixup> fixups;
+		std::vector<HandlerFixup> handlerFixups;
+
+		uint16_t nextInstr() const
+		{
+			_ASSERT(instrs.size() < UINT16_MAX);
+			return uint16_t(instrs.size());
+		}
+
+	public:
+		InstrLabeler(std::vector<Instr>& instrs, std::vector<ErrorHandler>& errorHandlers)
+			:instrs(instrs), errorHandlers(errorHandlers) {}
+
+		Label newLabel() { return labels.newLabel(); }
+		// To the next instruction
+		void bind(const Label l) { labels.bind(l, nextInstr()); }
+
+		// IF_*, or GOTO
+		template<class T>
+			requires std::derived_from<T, InstrType::BaseBranch>
+		void branch(const Label target)
+		{
+			fixups.push_back({ nextInstr(), NO_CASE, target });
+			instrs.emplace_back(T{ { 0 } });
+		}
+		void tableSwitch(const int32_t min, const std::span<const Label> targets, const Label defaultTarget)
+		{
+			const uint16_t i = nextInstr();
+			fixups.push_back({ i, NO_CASE, defaultTarget });
+			for (size_t c = 0; c < targets.size(); c++)
+				fixups.push_back({ i, uint32_t(c), targets[c] });
+
+			instrs.emplace_back(std::make_unique<InstrType::TableSwitchData>(InstrType::TableSwitchData{
+				std::vector<int32_t>(targets.size(), 0), 0, min }));
+		}
+		// cases - sorted by key
+		void lookupSwitch(const std::span<const LabelCase> cases, const Label defaultTarget) {
+			caseSwitch<InstrType::LOOKUP_SWITCH>(cases, defaultTarget);
+		}
+		// A SWITCH, cases in any order
+		void caseSwitch(const std::span<const LabelCase> cases, const Label defaultTarget) {
+			caseSwitch<InstrType::SWITCH>(cases, defaultTarget);
+		}
+		template<class T>
+		void caseSwitch(const std::span<const LabelCase> cases, const Label defaultTarget)
+		{
+			const uint16_t i = nextInstr();
+			fixups.push_back({ i, NO_CASE, defaultTarget });
+
+			T sw = std::make_unique<typename T::element_type>();
+			sw->cases.reserve(cases.size());
+			for (size_t c = 0; c < cases.size(); c++)
+			{
+				fixups.push_back({ i, uint32_t(c), cases[c].target });
+				sw->cases.push_back({ cases[c].k, 0 });
+			}
+			instrs.emplace_back(std::move(sw));
+		}
+		// Catches throws from [start, end)
+		// end - bound after the last covered instruction
+		void handler(
+			const Label start, const Label end, const Label handlerStart,
+			std::optional<ConstPoolItmType::CLASS> catchType = std::nullopt)
+		{
+			handlerFixups.push_back({ errorHandlers.size(), start, end, handlerStart });
+			errorHandlers.push_back({ std::move(catchType), 0, 0, 0 });
+		}
+
+		// Fills in every jmpOffset & handler, every used label must be bound
+		void resolve()
+		{
+			for (const Fixup& f : fixups)
+			{
+				const int32_t jmpOffset = labels.jmpOffset(f.instrIdx, f.target);
+				ezmatch(instrs[f.instrIdx])(
+				varcase(auto&) { _ASSERT(false && "Instruction changed under a label fixup"); },
+				varcase(std::derived_from<InstrType::BaseBranch> auto&) { var.jmpOffset = jmpOffset; },
+				varcase(InstrType::TABLE_SWITCH&) {
+					(f.caseIdx == NO_CASE ? var->defaultJmpOffset : var->jmpOffsets[f.caseIdx]) = jmpOffset;
+				},
+				varcase(InstrType::LOOKUP_SWITCH&) {
+					(f.caseIdx == NO_CASE ? var->defaultJmpOffset : var->cases[f.caseIdx].jmpOffset) = jmpOffset;
+				},
+				varcase(InstrType::SWITCH&) {
+					(f.caseIdx == NO_CASE ? var->defaultJmpOffset : var->cases[f.caseIdx].jmpOffset) = jmpOffset;
+				}
+				);
+			}
+			for (const HandlerFixup& f : handlerFixups)
+			{
+				ErrorHandler& eh = errorHandlers[f.handlerIdx];
+				eh.startInstr = labels.instrOf(f.start);
+				_ASSERT(labels.instrOf(f.end) > eh.startInstr && "Empty error handler range");
+				eh.endInstr = uint16_t(labels.instrOf(f.end) - 1);
+				eh.handlerInstr = labels.instrOf(f.handler);
+			}
+			fixups.clear();
+			handlerFixups.clear();
+		}
+	};
+}
@@ -0,0 +1,138 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <utility>
+#include <string_view>
+
+#include "State.hpp"
+#include "ConstPool.hpp"
+
+namespace cpp_jcfu
+{
+	// Index of a entry in a RefTable, 16 bits like a pool index (InstrBuffer packs it with a u8)
+	enum class RefHandle : uint16_t {};
+
+	// A owned T, or a RefHandle into the RefTable of the code (CodeCompileData::refs)
+	// Same size as a pointer, the low bit says which one it is
+	template<class T>
+	class Ref
+	{
+		static_assert(alignof(T) >= 2);
+		uintptr_t bits = 0;// T*, or handle << 1 | 1
+
+	public:
+		Ref() = default;
+		Ref(std::nullptr_t) {}
+		Ref(std::unique_ptr<T>&& p) :bits(uintptr_t(p.release())) {}
+		Ref(const RefHandle h) :bits(uintptr_t(h) << 1 | 1) {}
+
+		Ref(Ref&& o) noexcept :bits(std::exchange(o.bits, 0)) {}
+		Ref& operator=(Ref&& o) noexcept {
+			if (this != &o)
+			{
+				reset();
+				bits = std::exchange(o.bits, 0);
+			}
+			return *this;
+		}
+		~Ref() { reset(); }
+
+		void reset()
+		{
+			if (!isHandle())
+				delete get();
+			bits = 0;
+		}
+
+		bool isHandle() const { return (bits & 1) != 0; }
+		RefHandle handle() const {
+			_ASSERT(isHandle());
+			return RefHandle(bits >> 1);
+		}
+		/// @returns nullptr for handles
+		T* get() const { return isHandle() ? nullptr : (T*)bits; }
+
+		T& operator*() const {
+			_ASSERT(bits != 0 && !isHandle() && "Ref is a handle, use refEntryOf");
+			return *get();
+		}
+		T* operator->() const { return &**this; }
+		explicit operator bool() const { return bits != 0; }
+	};
+
+	// Field, method & class refs (or any constant), interned once, so a
+	// instruction only carries a 16 bit RefHandle, instead of owning a copy of the strings.
+	// compileCode pushes each handle into the class pool only once.
+	//
+	// Holds up to MAX_SIZE entries, like a class pool. Use tryIntern, if that can be reached,
+	// the others assert, and give back handle 0 instead of a new entry.
+	// The strings are copied into the table, and live as long as it does
+	class RefTable
+	{
+		ConstPool entries;// The "pool index" is the handle
+
+	public:
+		// UINT16_MAX is the empty slot of the ConstPool
+		static constexpr size_t MAX_SIZE = UINT16_MAX - 1;
+
+		/// @returns nothing if e is new, and the table is full
+		std::optional<RefHandle> tryIntern(const ConstPoolEntry& e)
+		{
+			if (entries.size() >= MAX_SIZE)
+			{// Full, only existing entries can be found
+				const std::optional<uint16_t> h = entries.find(e);
+				if (!h.has_value())
+					return std::nullopt;
+				return RefHandle(*h);
+			}
+			return RefHandle(entries.intern(e, (uint16_t)entries.size()).first);
+		}
+		RefHandle intern(const ConstPoolEntry& e)
+		{
+			const std::optional<RefHandle> h = tryIntern(e);
+			_ASSERT(h.has_value() && "RefTable is full, use tryIntern");
+			return h.value_or(RefHandle(0));
+		}
+		RefHandle intern(const ConstPoolItm& itm) {
+			return intern(constPoolEntryOf(itm));
+		}
+
+		RefHandle klass(const std::string_view name) {
+			return intern(newClassEntry(name));
+		}
+		RefHandle field(const std::string_view klass, const std::string_view name, const std::string_view desc) {
+			return intern({ ConstPoolItmId::FIELD_REF, 0, { klass, name, desc } });
+		}
+		RefHandle func(const std::string_view klass, const std::string_view name, const std::string_view desc) {
+			return intern({ ConstPoolItmId::FUNC_REF, 0, { klass, name, desc } });
+		}
+		RefHandle interfaceFunc(const std::string_view klass, const std::string_view name, const std::string_view desc) {
+			return intern({ ConstPoolItmId::INTERFACE_FUNC_REF, 0, { klass, name, desc } });
+		}
+
+		const ConstPoolEntry& operator[](const RefHandle h) const { return entries[size_t(h)]; }
+
+		void reserve(const size_t count) { entries.reserve(count); }
+		// Keeps the memory, invalidates every handle
+		void clear() { entries.clear(); }
+		size_t size() const { return entries.size(); }
+		bool empty() const { return entries.empty(); }
+	};
+
+	/// @returns the entry ref points to, its strings point into ref, or refs
+	/// refs - resolves handles, can be nullptr if ref isnt one
+	template<class T>
+	inline ConstPoolEntry refEntryOf(const Ref<T>& ref, const RefTable* refs)
+	{
+		if (ref.isHandle())
+		{
+			_ASSERT(refs != nullptr && "Ref is a handle, but there is no RefTable");
+			return (*refs)[ref.handle()];
+		}
+		return constPoolEntryOf(*ref);
+	}
+}
@@ -0,0 +1,110 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <utility>
+#include <algorithm>
+
+#include "State.hpp"
+#include "ConstPool.hpp"
+#include "StateUtils.hpp"
+
+namespace cpp_jcfu
+{
+	// A constant pool that many threads can push into at the same time,
+	// so the functions of a class can be compiled in parallel.
+	//
+	// Entries are spread over shards by their hash, each one with its own lock & arena.
+	// Indices come from a single atomic counter, so they stay dense and unique.
+	//
+	// Usage:
+	//	SharedConstPool shared(std::move(consts)); // optional starting pool, like after orderLdcConsts
+	//	... compileCode(shared, data) from any thread ...
+	//	gen(..., shared.toConstPool(), ...);
+	class SharedConstPool
+	{
+		inline static constexpr size_t SHARD_BITS = 6;
+		inline static constexpr size_t SHARD_COUNT = size_t(1) << SHARD_BITS;
+
+		// Own cache line, so threads dont fight over neighbouring locks
+		struct alignas(64) Shard
+		{
+			std::mutex lock;
+			ConstPool pool;// Holds the real pool indices
+		};
+		std::array<Shard, SHARD_COUNT> shards;
+		std::atomic<size_t> nextIdx = 1;
+
+		Shard& shardOf(const size_t hash) {
+			// The pools take their slot from the low bits (up to 32), so the top ones
+			// pick the shard, else entries of a shard would cluster, with a 32 bit size_t
+			return shards[hash >> (sizeof(size_t) * 8 - SHARD_BITS)];
+		}
+	public:
+		SharedConstPool() = default;
+		// Keeps the indices of base
+		explicit SharedConstPool(const ConstPool& base)
+		{
+			size_t idx = 1;
+			for (const ConstPoolEntry& e : base)
+			{
+				const size_t hash = hashPoolEntry(e);
+				shardOf(hash).pool.internHashed(e, hash, (uint16_t)idx);
+				idx += e.isBig() ? 2 : 1;
+			}
+			nextIdx = idx;
+		}
+		SharedConstPool(const SharedConstPool&) = delete;
+		SharedConstPool& operator=(const SharedConstPool&) = delete;
+
+		// Thread safe
+		/// @returns the pool index of the entry
+		uint16_t push(const ConstPoolEntry& e)
+		{
+			const size_t hash = hashPoolEntry(e);
+			Shard& shard = shardOf(hash);
+			std::lock_guard guard(shard.lock);
+
+			if (const std::optional<uint16_t> idx = shard.pool.findHashed(e, hash))
+				return *idx;
+
+			const size_t idx = nextIdx.fetch_add(e.isBig() ? 2 : 1, std::memory_order_relaxed);
+			_ASSERT(idx < (UINT16_MAX - (e.isBig() ? 1 : 0)));
+			return shard.pool.internHashed(e, hash, (uint16_t)idx).first;
+		}
+		uint16_t push(const ConstPoolItm& itm) {
+			return push(constPoolEntryOf(itm));
+		}
+
+		// Same as the poolSize of a normal pool
+		size_t poolSize() const {
+			return nextIdx.load(std::memory_order_relaxed);
+		}
+
+		// Not thread safe, call after every push is done
+		/// @returns a normal pool, with the entries in index order
+		ConstPool toConstPool() const
+		{
+			std::vector<std::pair<uint16_t, const ConstPoolEntry*>> all;
+			for (const Shard& shard : shards)
+			{
+				for (const ConstPoolEntry& e : shard.pool)
+					all.emplace_back(*shard.pool.find(e), &e);
+			}
+			std::sort(all.begin(), all.end(), [](const auto& a, const auto& b) {
+				return a.first < b.first;
+			});
+
+			ConstPool ret;
+			ret.reserve(all.size());
+			for (const auto& [idx, e] : all)
+				ret.intern(*e, idx);
+			return ret;
+		}
+	};
+}
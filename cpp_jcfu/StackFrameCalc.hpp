@@ -0,0 +1,1009 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <optional>
+#include <algorithm>
+
+#include "State.hpp"
+#include "ext/CppMatch.hpp"
+#include "InstrVariant.hpp"
+#include "CodeCompileData.hpp"
+#include "DescParse.hpp"
+
+namespace cpp_jcfu
+{
+	namespace detail
+	{
+		// A SlotKind, without the allocations
+		struct FrameSlot
+		{
+			// Same order as SlotKind
+			enum class Kind : uint8_t { PAD, I32, F32, I64, F64, NIL, RAW_THIS, OBJ, RAW_OBJ };
+
+			Kind kind = Kind::PAD;
+			uint32_t v = 0;// OBJ: class name id, RAW_OBJ: instruction index of the new
+
+			bool isWide() const { return kind == Kind::I64 || kind == Kind::F64; }
+			bool isRef() const { return kind == Kind::NIL || kind == Kind::OBJ; }
+			bool operator==(const FrameSlot&) const = default;
+		};
+		struct FrameState
+		{
+			std::vector<FrameSlot> locals;// By slot, wide values have a PAD after them
+			std::vector<FrameSlot> stack;// By value
+			bool seen = false;
+			bool queued = false;
+			bool fixed = false;// From instructionFrames, never merged into
+		};
+
+		// Instructions that pop some values, and maybe push one, that doesnt depend on what was popped
+		struct SimpleStackEffect
+		{
+			uint8_t pops;
+			FrameSlot::Kind push;// PAD -> nothing
+		};
+		constexpr std::optional<SimpleStackEffect> simpleStackEffect(const InstrId id)
+		{
+			using K = FrameSlot::Kind;
+			switch (id)
+			{
+			case InstrId::NOP:
+			case InstrId::I_ADD_I32_VAR_U8_CI8:
+			case InstrId::RET:
+				return SimpleStackEffect{ 0, K::PAD };
+
+			case InstrId::PUSH_OBJ_NULL:
+				return SimpleStackEffect{ 0, K::NIL };
+
+			case InstrId::PUSH_I32_M1: case InstrId::PUSH_I32_0: case InstrId::PUSH_I32_1:
+			case InstrId::PUSH_I32_2: case InstrId::PUSH_I32_3: case InstrId::PUSH_I32_4:
+			case InstrId::PUSH_I32_5:
+			case InstrId::I_PUSH_I32_I8: case InstrId::I_PUSH_I32_I16:
+			case InstrId::PUSH_I32_VAR_U16:
+			case InstrId::I_PUSH_I32_VAR_0: case InstrId::I_PUSH_I32_VAR_1:
+			case InstrId::I_PUSH_I32_VAR_2: case InstrId::I_PUSH_I32_VAR_3:
+				return SimpleStackEffect{ 0, K::I32 };
+			case InstrId::PUSH_I64_0: case InstrId::PUSH_I64_1:
+			case InstrId::PUSH_I64_VAR_U16:
+			case InstrId::I_PUSH_I64_VAR_0: case InstrId::I_PUSH_I64_VAR_1:
+			case InstrId::I_PUSH_I64_VAR_2: case InstrId::I_PUSH_I64_VAR_3:
+				return SimpleStackEffect{ 0, K::I64 };
+			case InstrId::PUSH_F32_0: case InstrId::PUSH_F32_1: case InstrId::PUSH_F32_2:
+			case InstrId::PUSH_F32_VAR_U16:
+			case InstrId::I_PUSH_F32_VAR_0: case InstrId::I_PUSH_F32_VAR_1:
+			case InstrId::I_PUSH_F32_VAR_2: case InstrId::I_PUSH_F32_VAR_3:
+				return SimpleStackEffect{ 0, K::F32 };
+			case InstrId::PUSH_F64_0: case InstrId::PUSH_F64_1:
+			case InstrId::PUSH_F64_VAR_U16:
+			case InstrId::I_PUSH_F64_VAR_0: case InstrId::I_PUSH_F64_VAR_1:
+			case InstrId::I_PUSH_F64_VAR_2: case InstrId::I_PUSH_F64_VAR_3:
+				return SimpleStackEffect{ 0, K::F64 };
+
+			case InstrId::PUSH_I32_ARR: case InstrId::PUSH_BI8_ARR:
+			case InstrId::PUSH_CHR_ARR: case InstrId::PUSH_I16_ARR:
+				return SimpleStackEffect{ 2, K::I32 };
+			case InstrId::PUSH_I64_ARR: return SimpleStackEffect{ 2, K::I64 };
+			case InstrId::PUSH_F32_ARR: return SimpleStackEffect{ 2, K::F32 };
+			case InstrId::PUSH_F64_ARR: return SimpleStackEffect{ 2, K::F64 };
+
+			case InstrId::SAVE_I32_ARR: case InstrId::SAVE_I64_ARR:
+			case InstrId::SAVE_F32_ARR: case InstrId::SAVE_F64_ARR:
+			case InstrId::SAVE_OBJ_ARR: case InstrId::SAVE_BI8_ARR:
+			case InstrId::SAVE_CHR_ARR: case InstrId::SAVE_I16_ARR:
+				return SimpleStackEffect{ 3, K::PAD };
+
+			case InstrId::ADD_I32: case InstrId::SUB_I32: case InstrId::MUL_I32:
+			case InstrId::DIV_I32: case InstrId::REM_I32:
+			case InstrId::SHL_I32: case InstrId::SRC_I32: case InstrId::SHR_I32:
+			case InstrId::AND_I32: case InstrId::OR_I32: case InstrId::XOR_I32:
+			case InstrId::CMP_I64:
+			case InstrId::CMP_F32_M: case InstrId::CMP_F32_P:
+			case InstrId::CMP_F64_M: case InstrId::CMP_F64_P:
+				return SimpleStackEffect{ 2, K::I32 };
+			case InstrId::ADD_I64: case InstrId::SUB_I64: case InstrId::MUL_I64:
+			case InstrId::DIV_I64: case InstrId::REM_I64:
+			case InstrId::SHL_I64: case InstrId::SRC_I64: case InstrId::SHR_I64:
+			case InstrId::AND_I64: case InstrId::OR_I64: case InstrId::XOR_I64:
+				return SimpleStackEffect{ 2, K::I64 };
+			case InstrId::ADD_F32: case InstrId::SUB_F32: case InstrId::MUL_F32:
+			case InstrId::DIV_F32: case InstrId::REM_F32:
+				return SimpleStackEffect{ 2, K::F32 };
+			case InstrId::ADD_F64: case InstrId::SUB_F64: case InstrId::MUL_F64:
+			case InstrId::DIV_F64: case InstrId::REM_F64:
+				return SimpleStackEffect{ 2, K::F64 };
+
+			case InstrId::NEG_I32:
+			case InstrId::CAST_I64_I32: case InstrId::CAST_F32_I32: case InstrId::CAST_F64_I32:
+			case InstrId::CAST_I32_I8: case InstrId::CAST_I32_CHR: case InstrId::CAST_I32_I16:
+			case InstrId::PUSH_ARRLEN: case InstrId::IS_OF:
+				return SimpleStackEffect{ 1, K::I32 };
+			case InstrId::NEG_I64:
+			case InstrId::CAST_I32_I64: case InstrId::CAST_F32_I64: case InstrId::CAST_F64_I64:
+				return SimpleStackEffect{ 1, K::I64 };
+			case InstrId::NEG_F32:
+			case InstrId::CAST_I32_F32: case InstrId::CAST_I64_F32: case InstrId::CAST_F64_F32:
+				return SimpleStackEffect{ 1, K::F32 };
+			case InstrId::NEG_F64:
+			case InstrId::CAST_I32_F64: case InstrId::CAST_I64_F64: case InstrId::CAST_F32_F64:
+				return SimpleStackEffect{ 1, K::F64 };
+
+			case InstrId::POP_1:
+			case InstrId::IF_EQL: case InstrId::IF_NEQ: case InstrId::IF_LT:
+			case InstrId::IF_GTE: case InstrId::IF_GT: case InstrId::IF_LTE:
+			case InstrId::IF_NIL: case InstrId::IF_NNIL:
+			case InstrId::TABLE_SWITCH: case InstrId::LOOKUP_SWITCH:
+			case InstrId::RET_I32: case InstrId::RET_I64: case InstrId::RET_F32:
+			case InstrId::RET_F64: case InstrId::RET_OBJ:
+			case InstrId::THROW:
+			case InstrId::SYNC_ON: case InstrId::SYNC_OFF:
+				return SimpleStackEffect{ 1, K::PAD };
+			case InstrId::IF_I32_EQL: case InstrId::IF_I32_NEQ: case InstrId::IF_I32_LT:
+			case InstrId::IF_I32_GTE: case InstrId::IF_I32_GT: case InstrId::IF_I32_LTE:
+			case InstrId::IF_OBJ_EQL: case InstrId::IF_OBJ_NEQ:
+				return SimpleStackEffect{ 2, K::PAD };
+			default:
+				return std::nullopt;
+			}
+		}
+		constexpr bool isInstrFlowEnd(const InstrId id) {
+			return (id >= InstrId::RET_I32 && id <= InstrId::RET) || id == InstrId::THROW;
+		}
+		// -1 -> doesnt use a local var, -2 -> index is in varIdx, else the index
+		constexpr int localVarIdx(const InstrId id)
+		{
+			if ((id >= InstrId::PUSH_I32_VAR_U16 && id <= InstrId::PUSH_OBJ_VAR_U16)
+				|| (id >= InstrId::SAVE_I32_VAR_U16 && id <= InstrId::SAVE_OBJ_VAR_U16)
+				|| id == InstrId::I_ADD_I32_VAR_U8_CI8
+				|| id == InstrId::I_DEPR_GOTO_VAR_U16)
+				return -2;
+			if (id >= InstrId::I_PUSH_I32_VAR_0 && id <= InstrId::I_PUSH_OBJ_VAR_3)
+				return (int(id) - int(InstrId::I_PUSH_I32_VAR_0)) % 4;
+			if (id >= InstrId::I_SAVE_I32_VAR_0 && id <= InstrId::I_SAVE_OBJ_VAR_3)
+				return (int(id) - int(InstrId::I_SAVE_I32_VAR_0)) % 4;
+			return -1;
+		}
+		// Type of a local var push / save: I32, I64, F32, F64, OBJ
+		/// @returns -1 for anything else
+		constexpr int localVarKind(const InstrId id)
+		{
+			if (id >= InstrId::PUSH_I32_VAR_U16 && id <= InstrId::PUSH_OBJ_VAR_U16)
+				return int(id) - int(InstrId::PUSH_I32_VAR_U16);
+			if (id >= InstrId::SAVE_I32_VAR_U16 && id <= InstrId::SAVE_OBJ_VAR_U16)
+				return int(id) - int(InstrId::SAVE_I32_VAR_U16);
+			if (id >= InstrId::I_PUSH_I32_VAR_0 && id <= InstrId::I_PUSH_OBJ_VAR_3)
+				return (int(id) - int(InstrId::I_PUSH_I32_VAR_0)) / 4;
+			if (id >= InstrId::I_SAVE_I32_VAR_0 && id <= InstrId::I_SAVE_OBJ_VAR_3)
+				return (int(id) - int(InstrId::I_SAVE_I32_VAR_0)) / 4;
+			return -1;
+		}
+		// Slots the local var takes, long & double take 2
+		constexpr uint8_t localVarSlots(const InstrId id)
+		{
+			const int kind = localVarKind(id);
+			return (kind == 1 || kind == 3) ? 2 : 1;
+		}
+		constexpr bool isLocalVarSave(const InstrId id)
+		{
+			return (id >= InstrId::SAVE_I32_VAR_U16 && id <= InstrId::SAVE_OBJ_VAR_U16)
+				|| (id >= InstrId::I_SAVE_I32_VAR_0 && id <= InstrId::I_SAVE_OBJ_VAR_3);
+		}
+		constexpr bool isObjVarPush(const InstrId id)
+		{
+			return id == InstrId::PUSH_OBJ_VAR_U16
+				|| (id >= InstrId::I_PUSH_OBJ_VAR_0 && id <= InstrId::I_PUSH_OBJ_VAR_3);
+		}
+
+		template<class T>
+		concept FrameCalcIf = std::derived_from<T, InstrType::BaseBranch> && !std::same_as<T, InstrType::GOTO>;
+	}
+
+	// Memory calcStackFrames needs while working, keep it around to stop reallocating it for every function
+	struct FrameCalcScratch
+	{
+		static constexpr uint32_t NO_STATE = UINT32_MAX;
+
+		std::vector<uint32_t> stateOf;// By instruction
+		std::vector<detail::FrameState> states;// Only the first stateCount are used
+		size_t stateCount = 0;
+		std::vector<uint8_t> needsFrame;// By instruction
+		std::vector<uint16_t> work;
+		std::vector<uint32_t> handlerCatchIds;
+		detail::FrameState cur;
+		std::vector<detail::FrameSlot> tmpStack;
+
+		// Class names of OBJ slots, views into the instructions, or ownedNames
+		std::vector<std::string_view> classNames;
+		std::unordered_map<std::string_view, uint32_t> classIds;
+		std::deque<std::string> ownedNames;
+		std::string tmpName;
+
+		// Set by a successful calcStackFrames / calcMaxStack
+		uint16_t maxStack = 0;
+
+		// Keeps the memory
+		void clear()
+		{
+			stateOf.clear();
+			stateCount = 0;
+			needsFrame.clear();
+			work.clear();
+			handlerCatchIds.clear();
+			classNames.clear();
+			classIds.clear();
+			ownedNames.clear();
+		}
+	};
+
+	namespace detail
+	{
+		// Type inference over the instructions, like the verifier does it
+		// Its a worklist over the starts of basic blocks, merging until nothing changes
+		class FrameCalc
+		{
+			using K = FrameSlot::Kind;
+
+			const CodeCompileData& data;
+			FrameCalcScratch& s;
+			bool failed = false;
+			bool localsChanged = false;
+			size_t stackSlots = 0;
+			size_t maxStackSlots = 0;
+
+			// Not an assert, callers fall back to the given frames / maxStack
+			void fail() { failed = true; }
+
+			uint32_t classId(const std::string_view name)
+			{
+				const auto it = s.classIds.find(name);
+				if (it != s.classIds.end())
+					return it->second;
+				s.classNames.push_back(name);
+				s.classIds.emplace(name, uint32_t(s.classNames.size() - 1));
+				return uint32_t(s.classNames.size() - 1);
+			}
+			// For names that arent in the instructions
+			uint32_t ownedClassId(const std::string& name)
+			{
+				const auto it = s.classIds.find(name);
+				if (it != s.classIds.end())
+					return it->second;
+				return classId(s.ownedNames.emplace_back(name));
+			}
+			FrameSlot objSlot(const std::string_view name) {
+				return { K::OBJ, classId(name) };
+			}
+			FrameSlot descSlot(const std::string_view type)
+			{
+				switch (type.empty() ? 'V' : type[0])
+				{
+				case 'B': case 'C': case 'I': case 'S': case 'Z': return { K::I32 };
+				case 'F': return { K::F32 };
+				case 'J': return { K::I64 };
+				case 'D': return { K::F64 };
+				case 'L': case '[': return objSlot(descClassName(type));
+				default:
+					fail();
+					return {};
+				}
+			}
+			FrameSlot slotOf(const SlotKind& k)
+			{
+				FrameSlot ret{ K(k.index()) };
+				if (ret.kind == K::OBJ)
+					ret.v = classId(std::get<SlotKindType::OBJ>(k)->name);
+				else if (ret.kind == K::RAW_OBJ)
+					ret.v = std::get<SlotKindType::RAW_OBJ>(k);
+				return ret;
+			}
+			SlotKind slotKindOf(const FrameSlot slot) const
+			{
+				switch (slot.kind)
+				{
+				case K::PAD: return SlotKindType::PAD{};
+				case K::I32: return SlotKindType::I32{};
+				case K::F32: return SlotKindType::F32{};
+				case K::I64: return SlotKindType::I64{};
+				case K::F64: return SlotKindType::F64{};
+				case K::NIL: return SlotKindType::NIL{};
+				case K::RAW_THIS: return SlotKindType::RAW_THIS{};
+				case K::OBJ: return newObjSlotKind(std::string(s.classNames[slot.v]));
+				case K::RAW_OBJ: return SlotKindType::RAW_OBJ(slot.v);
+				}
+				return SlotKindType::PAD{};
+			}
+
+			// Frame locals (wide ones are a single item) -> locals by slot
+			void expandLocals(const std::vector<SlotKind>& frameLocals, std::vector<FrameSlot>& out)
+			{
+				out.clear();
+				for (const SlotKind& k : frameLocals)
+				{
+					out.push_back(slotOf(k));
+					if (out.back().isWide())
+						out.push_back({});
+				}
+			}
+
+			uint32_t stateAt(const size_t i)
+			{
+				if (s.stateOf[i] != FrameCalcScratch::NO_STATE)
+					return s.stateOf[i];
+				if (s.stateCount == s.states.size())
+					s.states.emplace_back();
+				FrameState& st = s.states[s.stateCount];
+				st.locals.clear();
+				st.stack.clear();
+				st.seen = st.queued = st.fixed = false;
+				s.stateOf[i] = uint32_t(s.stateCount);
+				return uint32_t(s.stateCount++);
+			}
+
+			/// @returns if into changed
+			bool mergeSlot(FrameSlot& into, const FrameSlot from, const bool isStack)
+			{
+				if (into == from || into.kind == K::PAD)
+					return false;
+				if (into.isRef() && from.isRef())
+				{
+					if (from.kind == K::NIL)
+						return false;
+					if (into.kind == K::NIL)
+					{
+						into = from;
+						return true;
+					}
+					// 2 different classes, without knowing the class tree, Object is the only safe answer
+					const FrameSlot obj = objSlot("java/lang/Object");
+					if (into == obj)
+						return false;
+					into = obj;
+					return true;
+				}
+				if (isStack)
+					fail();// The verifier wont take this either
+				into = {};
+				return true;
+			}
+			void mergeInto(const size_t target, const std::vector<FrameSlot>& locals, const std::vector<FrameSlot>& stack)
+			{
+				if (target >= data.instrs.size() || s.stateOf[target] == FrameCalcScratch::NO_STATE)
+				{
+					fail();
+					return;
+				}
+				FrameState& st = s.states[s.stateOf[target]];
+				bool changed = false;
+				if (!st.seen)
+				{
+					st.seen = true;
+					if (!st.fixed)
+					{
+						st.locals = locals;
+						st.stack = stack;
+					}
+					changed = true;
+				}
+				else if (!st.fixed)
+				{
+					if (st.stack.size() != stack.size())
+					{
+						fail();
+						return;
+					}
+					for (size_t j = 0; j < stack.size(); j++)
+						changed |= mergeSlot(st.stack[j], stack[j], true);
+
+					if (st.locals.size() > locals.size())
+					{// Missing ones are PAD
+						st.locals.resize(locals.size());
+						changed = true;
+					}
+					for (size_t j = 0; j < st.locals.size(); j++)
+						changed |= mergeSlot(st.locals[j], locals[j], false);
+				}
+				if (changed && !st.queued)
+				{
+					st.queued = true;
+					s.work.push_back(uint16_t(target));
+				}
+			}
+			void mergeHandlers(const size_t i)
+			{
+				for (size_t h = 0; h < data.errorHandlers.size(); h++)
+				{
+					const ErrorHandler& eh = data.errorHandlers[h];
+					if (i < eh.startInstr || i > eh.endInstr)
+						continue;
+					const FrameSlot exSlot[] = { FrameSlot{ K::OBJ, s.handlerCatchIds[h] } };
+					s.tmpStack.assign(std::begin(exSlot), std::end(exSlot));
+					mergeInto(eh.handlerInstr, s.cur.locals, s.tmpStack);
+				}
+			}
+
+			FrameSlot pop()
+			{
+				if (s.cur.stack.empty())
+				{
+					fail();
+					return {};
+				}
+				const FrameSlot ret = s.cur.stack.back();
+				s.cur.stack.pop_back();
+				stackSlots -= ret.isWide() ? 2 : 1;
+				return ret;
+			}
+			void popN(const size_t n)
+			{
+				for (size_t i = 0; i < n; i++)
+					pop();
+			}
+			void push(const FrameSlot slot)
+			{
+				s.cur.stack.push_back(slot);
+				stackSlots += slot.isWide() ? 2 : 1;
+				maxStackSlots = std::max(maxStackSlots, stackSlots);
+			}
+			void storeLocal(const size_t idx, const FrameSlot slot)
+			{
+				std::vector<FrameSlot>& locals = s.cur.locals;
+				const size_t size = slot.isWide() ? 2 : 1;
+				if (locals.size() < idx + size)
+					locals.resize(idx + size);
+				if (idx > 0 && locals[idx - 1].isWide())
+					locals[idx - 1] = {};// Overwrote its 2nd half
+				if (locals[idx].isWide() && !slot.isWide())
+					locals[idx + 1] = {};
+				locals[idx] = slot;
+				if (slot.isWide())
+					locals[idx + 1] = {};
+				localsChanged = true;
+			}
+			FrameSlot loadLocal(const size_t idx)
+			{
+				if (idx >= s.cur.locals.size())
+				{
+					fail();
+					return {};
+				}
+				return s.cur.locals[idx];
+			}
+
+			// How many values make up these slots, counting from the top of the stack, skipping skipVals values
+			size_t valuesForSlots(const size_t skipVals, size_t slots)
+			{
+				const std::vector<FrameSlot>& stack = s.cur.stack;
+				size_t vals = 0;
+				while (slots > 0)
+				{
+					if (skipVals + vals >= stack.size())
+					{
+						fail();
+						return 0;
+					}
+					const size_t size = stack[stack.size() - 1 - skipVals - vals].isWide() ? 2 : 1;
+					if (size > slots)
+					{// Would split a long/double
+						fail();
+						return 0;
+					}
+					slots -= size;
+					vals++;
+				}
+				return vals;
+			}
+			// dup, dup_x1, dup_x2, dup2, dup2_x1, dup2_x2
+			void dupSlots(const size_t dupSlotCount, const size_t underSlotCount)
+			{
+				std::vector<FrameSlot>& stack = s.cur.stack;
+				const size_t dupVals = valuesForSlots(0, dupSlotCount);
+				const size_t underVals = valuesForSlots(dupVals, underSlotCount);
+				if (failed)
+					return;
+				// Copied, as inserting from itself isnt allowed
+				FrameSlot dups[2];
+				std::copy(stack.end() - dupVals, stack.end(), dups);
+				const size_t insertAt = stack.size() - dupVals - underVals;
+				stack.insert(stack.begin() + insertAt, dups, dups + dupVals);
+				stackSlots += dupSlotCount;
+				maxStackSlots = std::max(maxStackSlots, stackSlots);
+			}
+
+			// After <init>, every copy of the raw object is initialized
+			void initRawObj(const FrameSlot raw)
+			{
+				FrameSlot obj;
+				if (raw.kind == K::RAW_THIS)
+				{
+					if (data.thisClass.empty())
+					{
+						fail();
+						return;
+					}
+					obj = objSlot(data.thisClass);
+				}
+				else if (raw.kind == K::RAW_OBJ && raw.v < data.instrs.size())
+				{
+					bool found = false;
+					ezmatch(data.instrs[raw.v])(
+					varcase(const auto&) {},
+					varcase(const InstrType::PUSH_OBJ&) {
+						obj = objSlot(refEntryOf(var.ref, data.refs).strs[0]);
+						found = true;
+					}
+					);
+					if (!found)
+					{
+						fail();
+						return;
+					}
+				}
+				else
+				{
+					fail();
+					return;
+				}
+				for (FrameSlot& slot : s.cur.locals)
+				{
+					if (slot == raw)
+						slot = obj;
+				}
+				for (FrameSlot& slot : s.cur.stack)
+				{
+					if (slot == raw)
+						slot = obj;
+				}
+				localsChanged = true;
+			}
+			// ref - a *FUNC_REF entry
+			void runFunc(const ConstPoolEntry& ref, const bool hasThis, const bool isSpecial)
+			{
+				size_t paramCount = 0;
+				const std::string_view ret = forEachDescParam(ref.strs[2],
+					[&](const std::string_view) { paramCount++; });
+				if (ret.empty())
+				{
+					fail();
+					return;
+				}
+				popN(paramCount);
+				if (hasThis)
+				{
+					const FrameSlot self = pop();
+					if (isSpecial && ref.strs[1] == "<init>")
+						initRawObj(self);
+				}
+				if (ret != "V")
+					push(descSlot(ret));
+			}
+
+			/// @returns if the next instruction can run after this one
+			bool step(const size_t i)
+			{
+				bool fallsThrough = true;
+				ezmatch(data.instrs[i])(
+				varcase(const auto&) {
+					constexpr InstrId id = INSTR_OP_CODE<decltype(var)>;
+					constexpr int varIdx = localVarIdx(id);
+					if constexpr (isLocalVarSave(id) || isObjVarPush(id))
+					{
+						size_t idx = size_t(varIdx);
+						if constexpr (varIdx == -2)
+							idx = var.varIdx;
+
+						if constexpr (isObjVarPush(id))
+							push(loadLocal(idx));
+						else
+							storeLocal(idx, pop());
+					}
+					else if constexpr (simpleStackEffect(id).has_value())
+					{
+						constexpr SimpleStackEffect eff = *simpleStackEffect(id);
+						popN(eff.pops);
+						if constexpr (eff.push != K::PAD)
+							push({ eff.push });
+						fallsThrough = !isInstrFlowEnd(id);
+					}
+					else// Raw jumps & consts, jsr, wide, ...
+						fail();
+				},
+				varcase(const detail::FrameCalcIf auto&) {
+					popN(simpleStackEffect(INSTR_OP_CODE<decltype(var)>)->pops);
+					mergeInto(i + var.jmpOffset, s.cur.locals, s.cur.stack);
+				},
+				varcase(const InstrType::GOTO) {
+					mergeInto(i + var.jmpOffset, s.cur.locals, s.cur.stack);
+					fallsThrough = false;
+				},
+				varcase(const InstrType::TABLE_SWITCH&) {
+					pop();
+					mergeInto(i + var->defaultJmpOffset, s.cur.locals, s.cur.stack);
+					for (const int32_t jmpOffset : var->jmpOffsets)
+						mergeInto(i + jmpOffset, s.cur.locals, s.cur.stack);
+					fallsThrough = false;
+				},
+				varcase(const InstrType::LOOKUP_SWITCH&) {
+					pop();
+					mergeInto(i + var->defaultJmpOffset, s.cur.locals, s.cur.stack);
+					for (const SwitchCase& kase : var->cases)
+						mergeInto(i + kase.jmpOffset, s.cur.locals, s.cur.stack);
+					fallsThrough = false;
+				},
+				varcase(const InstrType::SWITCH&) {
+					pop();
+					mergeInto(i + var->defaultJmpOffset, s.cur.locals, s.cur.stack);
+					for (const SwitchCase& kase : var->cases)
+						mergeInto(i + kase.jmpOffset, s.cur.locals, s.cur.stack);
+					fallsThrough = false;
+				},
+
+				varcase(const InstrType::POP_2) {
+					popN(valuesForSlots(0, 2));
+				},
+				varcase(const InstrType::DUP_1) { dupSlots(1, 0); },
+				varcase(const InstrType::DUP_1_X) { dupSlots(1, 1); },
+				varcase(const InstrType::DUP_1_X2) { dupSlots(1, 2); },
+				varcase(const InstrType::DUP_2) { dupSlots(2, 0); },
+				varcase(const InstrType::DUP_2_X) { dupSlots(2, 1); },
+				varcase(const InstrType::DUP_2_X2) { dupSlots(2, 2); },
+				varcase(const InstrType::SWAP) {
+					const FrameSlot a = pop();
+					const FrameSlot b = pop();
+					push(a);
+					push(b);
+				},
+
+				varcase(const InstrType::PUSH_I32_I32) { push({ K::I32 }); },
+				varcase(const InstrType::PUSH_I64_I64) { push({ K::I64 }); },
+				varcase(const InstrType::PUSH_F32_F32) { push({ K::F32 }); },
+				varcase(const InstrType::PUSH_F64_F64) { push({ K::F64 }); },
+				varcase(const InstrType::PUSH_CONST&) {
+					const ConstPoolEntry e = refEntryOf(var, data.refs);
+					switch (e.id)
+					{
+					case ConstPoolItmId::I32: push({ K::I32 }); break;
+					case ConstPoolItmId::F32: push({ K::F32 }); break;
+					case ConstPoolItmId::I64: push({ K::I64 }); break;
+					case ConstPoolItmId::F64: push({ K::F64 }); break;
+					case ConstPoolItmId::STR: push(objSlot("java/lang/String")); break;
+					case ConstPoolItmId::CLASS: push(objSlot("java/lang/Class")); break;
+					case ConstPoolItmId::FUNC_HANDLE: push(objSlot("java/lang/invoke/MethodHandle")); break;
+					case ConstPoolItmId::FUNC_TYPE: push(objSlot("java/lang/invoke/MethodType")); break;
+					case ConstPoolItmId::RUN_DYN: push(descSlot(e.strs[1])); break;
+					default: fail(); break;
+					}
+				},
+
+				varcase(const InstrType::PUSH_OBJ_ARR) {
+					pop();
+					const FrameSlot arr = pop();
+					if (arr.kind == K::NIL)
+					{
+						push(arr);
+						return;
+					}
+					const std::string_view name = arr.kind == K::OBJ ? s.classNames[arr.v] : std::string_view{};
+					if (name.size() < 2 || name[0] != '[' || (name[1] != 'L' && name[1] != '['))
+					{
+						fail();
+						return;
+					}
+					push(objSlot(descClassName(name.substr(1))));
+				},
+
+				varcase(const InstrType::PUSH_GET_STATIC&) {
+					push(descSlot(refEntryOf(var.ref, data.refs).strs[2]));
+				},
+				varcase(const InstrType::PUSH_GET_FIELD&) {
+					pop();
+					push(descSlot(refEntryOf(var.ref, data.refs).strs[2]));
+				},
+				varcase(const InstrType::SAVE_STATIC&) {
+					pop();
+				},
+				varcase(const InstrType::SAVE_FIELD&) {
+					popN(2);
+				},
+				varcase(const InstrType::PUSH_RUN_VIRTUAL&) { runFunc(refEntryOf(var.ref, data.refs), true, false); },
+				varcase(const InstrType::PUSH_RUN_SPECIAL&) { runFunc(refEntryOf(var.ref, data.refs), true, true); },
+				varcase(const InstrType::PUSH_RUN_STATIC&) { runFunc(refEntryOf(var.ref, data.refs), false, false); },
+				varcase(const InstrType::PUSH_RUN_INTERFACE&) { runFunc(refEntryOf(var.ref, data.refs), true, false); },
+				varcase(const InstrType::PUSH_RUN_DYN&) { runFunc(refEntryOf(var.ref, data.refs), false, false); },
+
+				varcase(const InstrType::PUSH_OBJ&) {
+					push({ K::RAW_OBJ, uint32_t(i) });
+				},
+				varcase(const InstrType::PUSH_ARR) {
+					pop();
+					const char* name = "[I";
+					switch (var.type)
+					{
+					case ArrayType::BOOL: name = "[Z"; break;
+					case ArrayType::CHR: name = "[C"; break;
+					case ArrayType::F32: name = "[F"; break;
+					case ArrayType::D64: name = "[D"; break;
+					case ArrayType::I8: name = "[B"; break;
+					case ArrayType::I16: name = "[S"; break;
+					case ArrayType::I32: name = "[I"; break;
+					case ArrayType::I64: name = "[J"; break;
+					}
+					push(objSlot(name));
+				},
+				varcase(const InstrType::PUSH_OBJARR_1&) {
+					pop();
+					const std::string_view elem = refEntryOf(var.ref, data.refs).strs[0];
+					s.tmpName.clear();
+					s.tmpName += '[';
+					if (!elem.empty() && elem[0] == '[')
+						s.tmpName += elem;
+					else
+					{
+						s.tmpName += 'L';
+						s.tmpName += elem;
+						s.tmpName += ';';
+					}
+					push({ K::OBJ, ownedClassId(s.tmpName) });
+				},
+				varcase(const InstrType::PUSH_OBJARR_U8&) {
+					popN(var.dims);
+					push(objSlot(refEntryOf(var.ref, data.refs).strs[0]));
+				},
+				varcase(const InstrType::CHECK_CAST&) {
+					pop();
+					push(objSlot(refEntryOf(var.ref, data.refs).strs[0]));
+				}
+				);
+				return fallsThrough;
+			}
+
+			void run(const size_t start)
+			{
+				FrameState& cur = s.cur;
+				{
+					const FrameState& st = s.states[s.stateOf[start]];
+					cur.locals = st.locals;
+					cur.stack = st.stack;
+				}
+				stackSlots = 0;
+				for (const FrameSlot slot : cur.stack)
+					stackSlots += slot.isWide() ? 2 : 1;
+				maxStackSlots = std::max(maxStackSlots, stackSlots);
+				for (size_t i = start; !failed; i++)
+				{
+					localsChanged = false;
+					mergeHandlers(i);
+
+					const bool fallsThrough = step(i);
+					if (localsChanged)
+						mergeHandlers(i);// Handlers can also see the locals after a store
+					if (!fallsThrough)
+						return;
+					if (i + 1 >= data.instrs.size())
+					{// Fell off the end
+						fail();
+						return;
+					}
+					if (s.stateOf[i + 1] != FrameCalcScratch::NO_STATE)
+					{
+						mergeInto(i + 1, cur.locals, cur.stack);
+						return;
+					}
+				}
+			}
+
+			void compressLocals(const std::vector<FrameSlot>& locals, std::vector<SlotKind>& out) const
+			{
+				size_t end = locals.size();
+				while (end > 0 && locals[end - 1].kind == K::PAD)
+					end--;
+				// A wide value keeps its 2nd half
+				if (end > 0 && locals[end - 1].isWide())
+					end++;
+
+				for (size_t j = 0; j < end && j < locals.size(); j++)
+				{
+					out.push_back(slotKindOf(locals[j]));
+					if (locals[j].isWide())
+						j++;
+				}
+			}
+		public:
+			FrameCalc(const CodeCompileData& data, FrameCalcScratch& s)
+				:data(data), s(s) {}
+
+			/// @param frames nullptr, if only maxStack is needed
+			bool calc(const std::span<const uint16_t> extraFrameInstrs, std::vector<std::pair<uint16_t, StackFrame>>* frames)
+			{
+				const std::span<const Instr> instrs = data.instrs;
+				const size_t n = instrs.size();
+				s.clear();
+				s.stateOf.assign(n + 1, FrameCalcScratch::NO_STATE);
+				s.needsFrame.assign(n + 1, 0);
+
+				// Find the starts of blocks, and the instructions that need frames
+				const auto markTarget = [&](const int64_t target) {
+					if (target < 0 || size_t(target) >= n)
+					{
+						fail();
+						return;
+					}
+					stateAt(size_t(target));
+					s.needsFrame[size_t(target)] = 1;
+				};
+				stateAt(0);
+				for (size_t i = 0; i < n; i++)
+				{
+					bool endsBlock = true;
+					ezmatch(instrs[i])(
+					varcase(const auto&) {
+						endsBlock = isInstrFlowEnd(INSTR_OP_CODE<decltype(var)>);
+					},
+					varcase(const detail::FrameCalcIf auto&) {
+						markTarget(int64_t(i) + var.jmpOffset);
+					},
+					varcase(const InstrType::GOTO) {
+						markTarget(int64_t(i) + var.jmpOffset);
+					},
+					varcase(const InstrType::TABLE_SWITCH&) {
+						markTarget(int64_t(i) + var->defaultJmpOffset);
+						for (const int32_t jmpOffset : var->jmpOffsets)
+							markTarget(int64_t(i) + jmpOffset);
+					},
+					varcase(const InstrType::LOOKUP_SWITCH&) {
+						markTarget(int64_t(i) + var->defaultJmpOffset);
+						for (const SwitchCase& kase : var->cases)
+							markTarget(int64_t(i) + kase.jmpOffset);
+					},
+					varcase(const InstrType::SWITCH&) {
+						markTarget(int64_t(i) + var->defaultJmpOffset);
+						for (const SwitchCase& kase : var->cases)
+							markTarget(int64_t(i) + kase.jmpOffset);
+					}
+					);
+					if (endsBlock && i + 1 < n)
+						stateAt(i + 1);
+				}
+				s.handlerCatchIds.reserve(data.errorHandlers.size());
+				for (const ErrorHandler& eh : data.errorHandlers)
+				{
+					markTarget(eh.handlerInstr);
+					s.handlerCatchIds.push_back(eh.catchType.has_value()
+						? classId(eh.catchType->name)
+						: classId("java/lang/Throwable"));
+				}
+				for (const uint16_t i : extraFrameInstrs)
+				{
+					if (i < n)
+					{
+						stateAt(i);
+						s.needsFrame[i] = 1;
+					}
+				}
+				for (const auto& [i, frame] : data.instructionFrames)
+				{
+					if (i >= n)
+						continue;
+					FrameState& st = s.states[stateAt(i)];
+					st.fixed = true;
+					expandLocals(frame.local, st.locals);
+					st.stack.clear();
+					for (const SlotKind& k : frame.stack)
+						st.stack.push_back(slotOf(k));
+				}
+				if (failed)
+					return false;
+
+				// Run until nothing changes
+				FrameState& start = s.states[s.stateOf[0]];
+				if (!start.fixed)
+					expandLocals(data.startFrameLocals, start.locals);
+				start.seen = true;
+				start.queued = true;
+				s.work.push_back(0);
+				while (!s.work.empty() && !failed)
+				{
+					const uint16_t i = s.work.back();
+					s.work.pop_back();
+					s.states[s.stateOf[i]].queued = false;
+					run(i);
+				}
+				if (failed)
+					return false;
+				if (maxStackSlots > UINT16_MAX)
+				{
+					fail();
+					return false;
+				}
+				s.maxStack = uint16_t(maxStackSlots);
+				if (frames == nullptr)
+					return true;
+
+				for (size_t i = 0; i < n; i++)
+				{
+					if (s.stateOf[i] == FrameCalcScratch::NO_STATE || data.instructionFrames.contains(uint16_t(i)))
+						continue;
+					const FrameState& st = s.states[s.stateOf[i]];
+					if (!st.seen)
+					{// Dead code, the verifier still wants a frame for it, from instructionFrames
+						continue;
+					}
+					if (!s.needsFrame[i])
+						continue;
+
+					StackFrame& frame = frames->emplace_back(uint16_t(i), StackFrame{}).second;
+					compressLocals(st.locals, frame.local);
+					frame.stack.reserve(st.stack.size());
+					for (const FrameSlot slot : st.stack)
+						frame.stack.push_back(slotKindOf(slot));
+				}
+				return true;
+			}
+		};
+	}
+
+	// Calculates the StackFrame of every branch target, error handler, and instruction in extraFrameInstrs
+	// Instructions in data.instructionFrames get no frame, the given one is trusted as is
+	/// @param frames gets (instrIdx, frame), in instruction order
+	/// @returns false if the code cant be analyzed (raw I_* jumps/consts, jsr, broken stack), frames is then incomplete
+	inline bool calcStackFrames(
+		const CodeCompileData& data,
+		const std::span<const uint16_t> extraFrameInstrs,
+		FrameCalcScratch& scratch,
+		std::vector<std::pair<uint16_t, StackFrame>>& frames)
+	{
+		return detail::FrameCalc(data, scratch).calc(extraFrameInstrs, &frames);
+	}
+	// Follows every branch & error handler, like calcStackFrames, but only keeps the deepest stack
+	/// @returns nothing if the code cant be analyzed
+	inline std::optional<uint16_t> calcMaxStack(const CodeCompileData& data, FrameCalcScratch& scratch)
+	{
+		if (!detail::FrameCalc(data, scratch).calc({}, nullptr))
+			return std::nullopt;
+		return scratch.maxStack;
+	}
+	/// @returns the highest local slot instr uses +1, or 0
+	inline size_t instrLocalsEnd(const Instr& instr)
+	{
+		size_t ret = 0;
+		ezmatch(instr)(
+		varcase(const auto&) {
+			constexpr InstrId id = INSTR_OP_CODE<decltype(var)>;
+			constexpr int varIdx = detail::localVarIdx(id);
+			if constexpr (varIdx != -1)
+			{
+				size_t idx = size_t(varIdx);
+				if constexpr (varIdx == -2)
+					idx = var.varIdx;
+				ret = idx + detail::localVarSlots(id);
+			}
+		}
+		);
+		return ret;
+	}
+	// The highest local slot used by any instruction, startFrameLocals or instructionFrames, +1
+	// Params only count if they are in startFrameLocals
+	inline uint16_t calcMaxLocals(const CodeCompileData& data)
+	{
+		const auto frameSlots = [](const std::vector<SlotKind>& locals) {
+			size_t ret = 0;
+			for (const SlotKind& k : locals)
+				ret += (std::holds_alternative<SlotKindType::I64>(k) || std::holds_alternative<SlotKindType::F64>(k)) ? 2 : 1;
+			return ret;
+		};
+		size_t ret = frameSlots(data.startFrameLocals);
+		for (const auto& [i, frame] : data.instructionFrames)
+			ret = std::max(ret, frameSlots(frame.local));
+
+		for (const Instr& instr : data.instrs)
+			ret = std::max(ret, instrLocalsEnd(instr));
+		_ASSERT(ret <= UINT16_MAX);
+		return uint16_t(ret);
+	}
+}
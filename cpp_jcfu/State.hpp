@@ -213,6 +213,7 @@ namespace cpp_jcfu
 		struct STR
 		{
 			std::string txt;
+			Mor_eq_op(STR);
 		};
 		using I32 = int32_t;
 		using F32 = float;
@@ -223,21 +224,25 @@ namespace cpp_jcfu
 		{
 			std::string name;
 			std::string desc;
+			Mor_eq_op(NAME_AND_DESC);
 		};
 		struct FUNC_TYPE
 		{
 			std::string desc;
+			Mor_eq_op(FUNC_TYPE);
 		};
 		struct RUN_DYN
 		{
 			NAME_AND_DESC funcDesc;
 			uint16_t bootstrapIdx;
+			Mor_eq_op(RUN_DYN);
 		};
 
 		struct RefBase
 		{
 			CLASS classIdx;
 			NAME_AND_DESC refDesc;
+			Mor_eq_op(RefBase);
 		};
 
 		struct FIELD_REF : RefBase
@@ -261,8 +266,9 @@ namespace cpp_jcfu
 		 */
 		struct FUNC_HANDLE
 		{
-			FuncHandleKind kind;//encoded as u16
+			FuncHandleKind kind;//encoded as u8
 			RefBase val;
+			Mor_eq_op(FUNC_HANDLE);
 		};
 	}
 	using ConstPoolItm = std::variant<
@@ -284,9 +290,6 @@ namespace cpp_jcfu
 		ConstPoolItmType::FUNC_TYPE,
 		ConstPoolItmType::RUN_DYN
 	>;
-	// You can only rely on the ones you added to it.
-	// The writer might add some, but it will always be after your ones.
-	using ConstPool = std::vector<ConstPoolItm>;
 
 	namespace CommonTagType
 	{
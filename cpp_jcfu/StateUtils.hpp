@@ -7,6 +7,7 @@
 #include <bit>
 
 #include "State.hpp"
+#include "ConstPool.hpp"
 #include "ext/CppMatch.hpp"
 
 namespace cpp_jcfu
@@ -20,9 +21,9 @@ namespace cpp_jcfu
 	inline size_t calcConstPoolSize(const ConstPool& pool)
 	{
 		size_t ret = 0;
-		for (const ConstPoolItm& itm : pool)
+		for (const ConstPoolEntry& e : pool)
 		{
-			if (isPoolItemBig(itm))
+			if (e.isBig())
 				ret += 2;
 			else
 				ret++;
@@ -30,17 +31,32 @@ namespace cpp_jcfu
 		return ret;
 	}
 
-	inline uint16_t constPoolPush(size_t& poolSize, ConstPool& consts, ConstPoolItm&& itm)
+	/// copyStrs - false, if the strings already live as long as the pool (static, or from this pool)
+	inline uint16_t constPoolPush(size_t& poolSize, ConstPool& consts, const ConstPoolEntry& e, const bool copyStrs = true)
 	{
-		const bool is2x = isPoolItemBig(itm);
+		const bool is2x = e.isBig();
 		_ASSERT(poolSize < (UINT16_MAX - (is2x ? 1 : 0)));
-		consts.emplace_back(itm);
-		const uint16_t res = (uint16_t)poolSize;
+		const auto [res, added] = consts.intern(e, (uint16_t)poolSize, copyStrs);
 
-		poolSize++;
-		if (is2x)
+		if (added)
+		{
+			poolSize++;
+			if (is2x)
+				poolSize++;
+		}
+		return res;
+	}
+	inline uint16_t constPoolPush(size_t& poolSize, ConstPool& consts, const ConstPoolItm& itm)
+	{
+		return constPoolPush(poolSize, consts, constPoolEntryOf(itm));
+	}
+	// Only hashes k the first time its pushed into consts
+	inline uint16_t knownJutf8Push(size_t& poolSize, ConstPool& consts, const KnownJutf8 k)
+	{
+		_ASSERT(poolSize < UINT16_MAX);
+		const auto [res, added] = consts.internKnown(k, (uint16_t)poolSize);
+		if (added)
 			poolSize++;
-
 		return res;
 	}
 }
@@ -0,0 +1,174 @@
+/*
+** See Copyright Notice inside Include.hpp
+*/
+#pragma once
+
+#include <span>
+#include <bit>
+#include <algorithm>
+
+#include "Instrs.hpp"
+
+namespace cpp_jcfu
+{
+	// A dispatched instruction costs about as much as this many bytes of code
+	inline constexpr size_t SWITCH_DISPATCH_COST = 4;
+	// Keys further apart than this start a new cluster
+	inline constexpr int64_t SWITCH_CLUSTER_GAP = 8;
+	// Most keys compared one by one, if they are cut out of a cluster
+	inline constexpr size_t MAX_SWITCH_COMPARES = 4;
+	// Most keys compared one by one, if they are whole clusters
+	inline constexpr size_t MAX_SWITCH_CLUSTER_COMPARES = 16;
+	// Bigger tables are never worth it, and could push the code past 64KB
+	inline constexpr uint64_t MAX_SWITCH_TABLE_RANGE = 0x1000;
+
+	// How compileCode emits a SWITCH, with its cases sorted:
+	//	(save key to temp var)
+	//	(load temp var, push key, if_icmpeq case) for cases outside [mainStart, mainEnd)
+	//	(load temp var) tableswitch / lookupswitch for [mainStart, mainEnd), or goto default if empty
+	//
+	// Without a temp var, a lone compare uses the key itself, and no compares means no load.
+	// Only the last part can be a switch, as a SWITCH is 1 instruction, so a switch in the
+	// middle would need its default to jump inside it, where there is no stack frame.
+	// The other clusters are compared one by one.
+	struct SwitchPlan
+	{
+		enum class Kind : uint8_t { NONE, TABLE, LOOKUP };
+
+		uint32_t mainStart = 0;
+		uint32_t mainEnd = 0;
+		Kind kind = Kind::NONE;
+		bool needsTempVar = false;
+
+		size_t compareCount(const size_t caseCount) const {
+			return caseCount - (mainEnd - mainStart);
+		}
+		// If everything is a single table / lookup switch, at the start of the instruction
+		bool isPlainSwitch() const {
+			return kind != Kind::NONE && !needsTempVar;// Compares next to a switch always use the temp var
+		}
+	};
+
+	namespace detail
+	{
+		// Same sizes compileCode picks for PUSH_I32_I32, ldc's count as 2 bytes
+		constexpr size_t pushI32Size(const int32_t k)
+		{
+			if (k >= -1 && k <= 5)
+				return 1;
+			if (k >= INT8_MIN && k <= INT8_MAX)
+				return 2;
+			if (k >= INT16_MIN && k <= INT16_MAX)
+				return 3;
+			return 2;
+		}
+		constexpr size_t varInstrSize(const uint16_t idx) {
+			return idx <= 3 ? 1 : (idx <= UINT8_MAX ? 2 : 4);
+		}
+		constexpr uint64_t switchTableRange(const std::span<const SwitchCase> cases) {
+			return uint64_t(int64_t(cases.back().k) - int64_t(cases.front().k)) + 1;
+		}
+	}
+
+	// Picks the cheapest plan, cost = bytes + SWITCH_DISPATCH_COST * instructions dispatched to reach the last case
+	// (Switches are counted with 3 padding bytes, and a lookupswitch as a binary search)
+	//
+	// cases - sorted by key, no duplicates
+	// tempVar - local var index to save the key in, if more than 1 compare is needed
+	// plainOnly - only a single tableswitch / lookupswitch
+	inline SwitchPlan planSwitch(
+		const std::span<const SwitchCase> cases,
+		const uint16_t tempVar,
+		const bool plainOnly)
+	{
+		using Kind = SwitchPlan::Kind;
+		const size_t n = cases.size();
+		const size_t tempSize = detail::varInstrSize(tempVar);
+
+		SwitchPlan best;
+		size_t bestCost = SIZE_MAX;
+		const auto consider = [&](const size_t mainStart, const size_t mainEnd, const Kind kind) {
+			const std::span<const SwitchCase> main = cases.subspan(mainStart, mainEnd - mainStart);
+			if (kind == Kind::TABLE
+				&& (main.empty() || detail::switchTableRange(main) > MAX_SWITCH_TABLE_RANGE))
+				return;
+
+			const size_t compareCount = n - main.size();
+			const bool needsTempVar = compareCount >= 2 || (compareCount == 1 && kind != Kind::NONE);
+			const size_t loadSize = needsTempVar ? tempSize : 0;
+			const size_t loadCount = needsTempVar ? 1 : 0;
+
+			size_t bytes = loadSize;// The save is as big as a load
+			size_t dispatched = loadCount;
+			const auto compare = [&](const SwitchCase& kase) {
+				if (kase.k == 0)
+				{// ifeq
+					bytes += loadSize + 3;
+					dispatched += loadCount + 1;
+					return;
+				}
+				bytes += loadSize + detail::pushI32Size(kase.k) + 3;
+				dispatched += loadCount + 2;
+			};
+			for (size_t i = 0; i < mainStart; i++)
+				compare(cases[i]);
+			for (size_t i = mainEnd; i < n; i++)
+				compare(cases[i]);
+
+			switch (kind)
+			{
+			case Kind::NONE:// (pop) goto
+				bytes += (compareCount == 0 ? 1 : 0) + 3;
+				dispatched += (compareCount == 0 ? 1 : 0) + 1;
+				break;
+			case Kind::TABLE:
+				bytes += loadSize + 1 + 3 + 4 * 3 + 4 * detail::switchTableRange(main);
+				dispatched += loadCount + 1;
+				break;
+			case Kind::LOOKUP:
+				bytes += loadSize + 1 + 3 + 4 * 2 + 8 * main.size();
+				dispatched += loadCount + 1 + std::bit_width(main.size());
+				break;
+			}
+			const size_t cost = bytes + SWITCH_DISPATCH_COST * dispatched;
+			if (cost >= bestCost)
+				return;
+			bestCost = cost;
+			best.mainStart = (uint32_t)mainStart;
+			best.mainEnd = (uint32_t)mainEnd;
+			best.kind = kind;
+			best.needsTempVar = needsTempVar;
+		};
+		if (plainOnly)
+		{
+			consider(0, n, Kind::TABLE);
+			consider(0, n, Kind::LOOKUP);
+			return best;
+		}
+		// If a cluster starts at cases[at], or at is the end
+		const auto isClusterEdge = [&](const size_t at) {
+			return at == 0 || at == n || int64_t(cases[at].k) - int64_t(cases[at - 1].k) > SWITCH_CLUSTER_GAP;
+		};
+		// Compare whole clusters, or a few keys from each end, the middle goes in the switch
+		for (size_t lo = 0; lo <= std::min(n, MAX_SWITCH_CLUSTER_COMPARES); lo++)
+		{
+			for (size_t hi = n; lo + (n - hi) <= MAX_SWITCH_CLUSTER_COMPARES; hi--)
+			{
+				if (lo + (n - hi) > MAX_SWITCH_COMPARES && !(isClusterEdge(lo) && isClusterEdge(hi)))
+				{
+					if (hi == lo)
+						break;
+					continue;
+				}
+				if (hi == lo)
+				{
+					consider(lo, hi, Kind::NONE);
+					break;
+				}
+				consider(lo, hi, Kind::TABLE);
+				consider(lo, hi, Kind::LOOKUP);
+			}
+		}
+		return best;
+	}
+}
@@ -4,76 +4,181 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <bit>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define _CPP_JCFU__JUTF8_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _CPP_JCFU__JUTF8_SSE2
+#endif
 
 namespace cpp_jcfu
 {
+	namespace detail {
+		constexpr bool isJutf8Special(const char ch) {
+			return ch == 0 || (uint8_t)ch >= 0x80;
+		}
+		// 8 bytes at a time, any byte that is 0 or has the high bit set, turns on its high bit
+		// (borrows can only mark bytes after a real match, so the first mark is right)
+		inline size_t findJutf8SpecialSwar(const std::string_view in, size_t i)
+		{
+			constexpr uint64_t ONES = 0x0101010101010101;
+			constexpr uint64_t HIGHS = 0x8080808080808080;
+			for (; i + 8 <= in.size(); i += 8)
+			{
+				uint64_t v;
+				std::memcpy(&v, in.data() + i, 8);
+				const uint64_t marks = (v | (v - ONES)) & HIGHS;
+				if (marks == 0)
+					continue;
+				if constexpr (std::endian::native == std::endian::little)
+					return i + (std::countr_zero(marks) >> 3);
+				else
+					break;// Find it byte by byte
+			}
+			for (; i < in.size(); i++)
+			{
+				if (isJutf8Special(in[i]))
+					return i;
+			}
+			return in.size();
+		}
+	}
+
+	// @returns the index of the first byte at/after start, that utf8ToJutf8 has to look at (0, or not ascii)
+	// or in.size(), if there is none
+	inline size_t findJutf8Special(const std::string_view in, size_t start = 0)
+	{
+		size_t i = start;
+#if defined(_CPP_JCFU__JUTF8_AVX2)
+		const __m256i zero = _mm256_setzero_si256();
+		for (; i + 32 <= in.size(); i += 32)
+		{
+			const __m256i v = _mm256_loadu_si256((const __m256i*)(in.data() + i));
+			// High bit is set on non ascii bytes, and on the 0xFF's from the compare
+			const uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, zero)));
+			if (mask != 0)
+				return i + std::countr_zero(mask);
+		}
+#endif
+#if defined(_CPP_JCFU__JUTF8_AVX2) || defined(_CPP_JCFU__JUTF8_SSE2)
+		const __m128i zero16 = _mm_setzero_si128();
+		for (; i + 16 <= in.size(); i += 16)
+		{
+			const __m128i v = _mm_loadu_si128((const __m128i*)(in.data() + i));
+			const uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero16)));
+			if (mask != 0)
+				return i + std::countr_zero(mask);
+		}
+#endif
+		return detail::findJutf8SpecialSwar(in, i);
+	}
+
+	// @returns if utf8ToJutf8(in) would give back in (no nulls, no 4 byte chars)
+	// Only looks for ascii, which is what almost every name and descriptor is
+	constexpr bool isPlainJutf8(const std::string_view in)
+	{
+		if (std::is_constant_evaluated())
+		{
+			for (const char ch : in)
+			{
+				if (detail::isJutf8Special(ch))
+					return false;
+			}
+			return true;
+		}
+		return findJutf8Special(in) == in.size();
+	}
+
+	namespace detail {
+		// Lead byte of a 4 byte char, that has all of its bytes
+		constexpr bool isJutf8FourByteLead(const std::string_view in, const size_t i) {
+			return ((uint8_t)in[i] & 0xF8) == 0xF0 && i + 3 < in.size();
+		}
+	}
+
+	// @returns the size utf8ToJutf8(in) will have
+	inline size_t utf8ToJutf8Size(const std::string_view in)
+	{
+		size_t ret = in.size();
+		for (size_t i = findJutf8Special(in); i < in.size(); i = findJutf8Special(in, i + 1))
+		{
+			if (in[i] == 0)
+				ret++;// 2 byte null
+			else if (detail::isJutf8FourByteLead(in, i))
+			{
+				ret += 2;// 4 byte char -> 2x 3 byte surrogates
+				i += 3;
+			}
+		}
+		return ret;
+	}
 
 	//https://en.wikipedia.org/wiki/CESU-8
 	//https://en.wikipedia.org/wiki/UTF-8
 	//https://en.wikipedia.org/wiki/UTF-16
 	//https://stackoverflow.com/questions/34151138/convert-cesu-8-to-utf-8-with-high-performance
-	// Unsafe, wont work on chars that are >4 bytes long
-	inline std::string utf8ToJutf8(const std::string& in)
+	// Writes the modified utf8 version of in to dst, which needs room for utf8ToJutf8Size(in) bytes
+	// Nulls become 2 bytes, 4 byte chars become 2 surrogates (3 bytes each), anything else is copied as is
+	/// @returns the end of what was written
+	inline uint8_t* utf8ToJutf8To(const std::string_view in, uint8_t* dst)
 	{
-		//Codes to replace are: (0xF_), but only 0xF0 is supported by surogate pairs
-
-		std::string ret;
-		ret.reserve(in.size() + 4);
-
-		uint32_t decodedNum = 0;
-		uint8_t parseIdx = 0;
-
-		for (size_t i = 0; i < in.size(); i++)
+		size_t i = 0;
+		while (i < in.size())
 		{
-			const char ch = in[i];
+			// Copy the whole ascii run at once
+			const size_t runEnd = findJutf8Special(in, i);
+			std::memcpy(dst, in.data() + i, runEnd - i);
+			dst += runEnd - i;
+			i = runEnd;
+			if (i == in.size())
+				break;
 
-			if (parseIdx != 0)
+			const uint8_t ch = (uint8_t)in[i];
+			if (ch == 0)
 			{
-				//currently recoding a 4 byte character
-				parseIdx++;
-				const uint8_t chBits = (ch & 0b111111);
-				switch (parseIdx)
-				{
-				case 2:
-					decodedNum |= chBits << 12;//byte 2
-					break;
-				case 3:
-					decodedNum |= chBits << 6;//byte 3
-					break;
-				case 4:
-					decodedNum |= chBits;//byte 4
-					decodedNum -= 0x10000;//how is it off...
-					parseIdx = 0;
-					ret.push_back(0b10100000 | uint8_t(decodedNum >> 16));//4bits
-					ret.push_back(0b10000000 | uint8_t((decodedNum >> 10) & 0b111111));//6bits
-
-					ret.push_back((uint8_t)0xED);
-					ret.push_back(0b10110000 | uint8_t((decodedNum >> 6) & 0b1111));//4bits
-					ret.push_back(0b10000000 | uint8_t(decodedNum & 0b111111));//6bits
-					break;
-				}
+				*dst++ = 0b11000000;
+				*dst++ = 0b10000000;
+				i++;
 				continue;
 			}
-			else if ((ch & 0xF0) == 0xF0)
-			{
-				//Found the start of a 4 byte unicode character
-				decodedNum = (ch & 0b11) << 18; //NOTE: 1 extra bit is ignored, to reduce errors in high surrogate encoding 
-				ret.push_back((uint8_t)0xED);
-				parseIdx = 1;
+			if (!detail::isJutf8FourByteLead(in, i))
+			{// 2/3 byte chars are the same
+				*dst++ = ch;
+				i++;
 				continue;
 			}
+			const uint32_t codePoint = ((ch & 0b111) << 18)
+				| (((uint8_t)in[i + 1] & 0b111111) << 12)
+				| (((uint8_t)in[i + 2] & 0b111111) << 6)
+				| ((uint8_t)in[i + 3] & 0b111111);
+			i += 4;
 
-			if (ch == 0)
-			{
-				ret.push_back((uint8_t)0b11000000);
-				ret.push_back((uint8_t)0b10000000);
-				continue;
-			}
+			// 20 bits, split over 2 utf16 surrogates
+			const uint32_t v = codePoint - 0x10000;
+			const uint16_t high = uint16_t(0xD800 | ((v >> 10) & 0x3FF));
+			const uint16_t low = uint16_t(0xDC00 | (v & 0x3FF));
 
-			//just a normal <4 byte unicode character
-			ret.push_back(ch);
+			for (const uint16_t surrogate : { high, low })
+			{// As a 3 byte char
+				*dst++ = uint8_t(0b11100000 | (surrogate >> 12));
+				*dst++ = uint8_t(0b10000000 | ((surrogate >> 6) & 0b111111));
+				*dst++ = uint8_t(0b10000000 | (surrogate & 0b111111));
+			}
 		}
-
+		return dst;
+	}
+	inline std::string utf8ToJutf8(const std::string_view in)
+	{
+		std::string ret(utf8ToJutf8Size(in), '\0');
+		[[maybe_unused]] const uint8_t* const end = utf8ToJutf8To(in, (uint8_t*)ret.data());
+		_ASSERT(end == (const uint8_t*)ret.data() + ret.size());
 		return ret;
 	}
-}
\ No newline at end of file
+}
@@ -4,130 +4,156 @@
 #pragma once
 
 #include <vector>
+#include <span>
+#include <string_view>
 #include <bit>
 
 #include "ext/ExtendVariant.hpp"
 #include "State.hpp"
+#include "ByteWriter.hpp"
 #include "Utf8ToJutf8.hpp"
 #include "StateUtils.hpp"
 
 namespace cpp_jcfu
 {
-	inline void u64w(std::vector<uint8_t>& out, const uint64_t v)
+	// Checked versions of the ByteWriter writes, for the cold paths
+
+	inline void u8w(ByteWriter& out, const uint8_t v)
+	{
+		out.ensure(1);
+		out.u8(v);
+	}
+	inline void u64w(ByteWriter& out, const uint64_t v)
+	{
+		out.ensure(8);
+		out.u64(v);
+	}
+	inline void u32w(ByteWriter& out, const uint32_t v)
+	{
+		out.ensure(4);
+		out.u32(v);
+	}
+	inline void u16w(ByteWriter& out, const uint16_t v)
 	{
-		out.push_back((v >> 56) & 0xFF);
-		out.push_back((v >> 48) & 0xFF);
-		out.push_back((v >> 40) & 0xFF);
-		out.push_back((v >> 32) & 0xFF);
-		out.push_back((v >> 24) & 0xFF);
-		out.push_back((v >> 16) & 0xFF);
-		out.push_back((v >> 8) & 0xFF);
-		out.push_back(v & 0xFF);
+		out.ensure(2);
+		out.u16(v);
 	}
-	inline void u32w(std::vector<uint8_t>& out, const uint32_t v)
+	inline void bytesW(ByteWriter& out, const std::span<const uint8_t> v)
 	{
-		out.push_back((v >> 24) & 0xFF);
-		out.push_back((v >> 16) & 0xFF);
-		out.push_back((v >> 8) & 0xFF);
-		out.push_back(v & 0xFF);
+		out.ensure(v.size());
+		out.bytes(v);
 	}
-	inline void u16w(std::vector<uint8_t>& out, const uint16_t v)
+	inline void u32Patch(ByteWriter& out,const size_t offset, const uint32_t v)
 	{
-		out.push_back((v >> 8) & 0xFF);
-		out.push_back(v & 0xFF);
+		out.patch32(offset, v);
 	}
-	inline void u32Patch(std::vector<uint8_t>& out,const size_t offset, const uint32_t v)
+	inline void u16Patch(ByteWriter& out, const size_t offset, const uint16_t v)
 	{
-		out[offset] = (v >> 24) & 0xFF;
-		out[offset+1] = (v >> 16) & 0xFF;
-		out[offset+2] = (v >> 8) & 0xFF;
-		out[offset+3] = v & 0xFF;
+		out.patch16(offset, v);
 	}
-	inline void u16Patch(std::vector<uint8_t>& out, const size_t offset, const uint16_t v)
+	// Writes a placeholder for a u4 attribute_length
+	/// @returns where it is, for attrLenPatch
+	inline size_t attrLenPlaceholderW(ByteWriter& out)
 	{
-		out[offset] = (v >> 8) & 0xFF;
-		out[offset + 1] = v & 0xFF;
+		const size_t at = out.size();
+		u32w(out, 0);
+		return at;
+	}
+	// Fills in the placeholder, with the size of everything written after it
+	inline void attrLenPatch(ByteWriter& out, const size_t at)
+	{
+		const size_t len = out.size() - at - 4;
+		_ASSERT(len < UINT32_MAX);
+		u32Patch(out, at, (uint32_t)len);
 	}
 	//https://docs.oracle.com/javase/specs/jvms/se7/html/jvms-4.html#jvms-4.4.7
-	inline void jUtf8W(std::vector<uint8_t>& out, std::string v)
+	// Converts straight into out, and patches in the length
+	inline void jUtf8W(ByteWriter& out, const std::string_view str)
 	{
-		v = utf8ToJutf8(v);
-		_ASSERT(v.size() < UINT16_MAX);
-		u16w(out, (uint16_t)v.size());
-		out.insert(out.end(), v.begin(), v.end());
+		// Converting can at most double the size
+		// If there isnt room for that, get the exact size, so buffers
+		// that were sized exactly (like the pool) dont grow
+		if (out.spare() < 2 + 2 * str.size())
+			out.ensure(2 + utf8ToJutf8Size(str));
+
+		const size_t lenAt = out.size();
+		out.u16(0);
+		const size_t len = utf8ToJutf8To(str, out.tail()) - out.tail();
+		_ASSERT(len < UINT16_MAX);
+		out.advance(len);
+		u16Patch(out, lenAt, (uint16_t)len);
 	}
 
-	inline void constPoolIdxW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, ConstPoolItm&& itm)
-	{
-		_ASSERT(poolSize < UINT16_MAX);
-		u16w(out, (uint16_t)poolSize);
-		consts.emplace_back(itm);
+	inline void constPoolIdxPushW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const ConstPoolEntry& e) {
+		u16w(out, constPoolPush(poolSize, consts, e));
 	}
-	inline void constPoolIdxPushW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, ConstPoolItm&& itm) {
-		u16w(out, constPoolPush(poolSize, consts, std::move(itm)));
+	inline void constPoolIdxPushW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const ConstPoolItm& itm) {
+		u16w(out, constPoolPush(poolSize, consts, itm));
 	}
-	inline void pushJutf8IdxW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, const std::string& str)
+	inline void pushJutf8IdxW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const std::string_view str)
 	{
-		constPoolIdxPushW(out, poolSize, consts,
-			ConstPoolItmType::JUTF8(str));
+		constPoolIdxPushW(out, poolSize, consts, newJutf8Entry(str));
 	}
-	inline void pushClassIdxW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, const std::string& className)
+	inline void pushKnownJutf8IdxW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const KnownJutf8 k)
 	{
-		constPoolIdxPushW(out, poolSize, consts,
-			ConstPoolItmType::CLASS(className));
+		u16w(out, knownJutf8Push(poolSize, consts, k));
+	}
+	inline void pushClassIdxW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const std::string_view className)
+	{
+		constPoolIdxPushW(out, poolSize, consts, newClassEntry(className));
 	}
 
-	inline void codeSlotKindW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, const CodeSlotKind& itm)
+	inline void codeSlotKindW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const CodeSlotKind& itm)
 	{
 		ezmatch(itm)(
 		varcase(const auto){
-			out.push_back(aca::variant_index_v<decltype(var),CodeSlotKind>);
+			u8w(out, aca::variant_index_v<decltype(var),CodeSlotKind>);
 
 		},
 		varcase(const CodeSlotKindType::OBJ){
-			out.push_back(7);
+			u8w(out, 7);
 			u16w(out, var.constPoolIdx);
 		},
 		varcase(const CodeSlotKindType::RAW_OBJ){
-			out.push_back(8);
+			u8w(out, 8);
 			u16w(out, var);
 		}
 		);
 	}
-	inline void codeStackFrameW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, const CodeStackFrame& itm)
+	inline void codeStackFrameW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const CodeStackFrame& itm)
 	{
 		ezmatch(itm)(
 		varcase(const CodeStackFrameType::SAME_NO_STACK){
 			if (var <= 63)
-				out.push_back(var);
+				u8w(out, var);
 			else
 			{
-				out.push_back(251);
+				u8w(out, 251);
 				u16w(out, var);
 			}
 		},
 		varcase(const CodeStackFrameType::SAME_1_STACK){
 			if (var.delta <= 63)
-				out.push_back(var.delta+64);
+				u8w(out, var.delta+64);
 			else
 			{
-				out.push_back(247);
+				u8w(out, 247);
 				u16w(out, var.delta);
 			}
 			codeSlotKindW(out, poolSize, consts, var.stackKind);
 		},
 		varcase(const CodeStackFrameType::AnyCodeChopStackFrame auto){
-			out.push_back(var.binId);
+			u8w(out, var.binId);
 			u16w(out, var.delta);
 		},
 		varcase(const CodeStackFrameType::AnyCodeAddStackFrame auto) {
-			out.push_back(251+ var.localKinds.size());
+			u8w(out, 251+ var.localKinds.size());
 			u16w(out, var.delta);
 			for (const CodeSlotKind k : var.localKinds)
 				codeSlotKindW(out, poolSize, consts, k);
 		},
 		varcase(const CodeStackFrameType::FULL&){
-			out.push_back(255);
+			u8w(out, 255);
 			u16w(out, var->delta);
 
 			u16w(out, var->localKinds.size());
@@ -139,118 +165,105 @@ namespace cpp_jcfu
 		}
 		);
 	}
-	inline void codeTagW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, const CodeTag& itm)
+	inline void codeTagW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const CodeTag& itm)
 	{
 		ezmatch(itm)(
 		// https://docs.oracle.com/javase/specs/jvms/se24/html/jvms-4.html#jvms-4.7.12
 		varcase(const CodeTagType::LINE_NUMS&){
-			pushJutf8IdxW(out, poolSize, consts, "LineNumberTable");
-			std::vector<uint8_t> tagOut;
+			pushKnownJutf8IdxW(out, poolSize, consts, KnownJutf8::LINE_NUMBER_TABLE);
+			const size_t lenAt = attrLenPlaceholderW(out);
 
 			_ASSERT(var.size() < UINT16_MAX);
-			u16w(tagOut, (uint16_t)var.size());
+			u16w(out, (uint16_t)var.size());
 			for (const CodeTagLineNumEntry& e : var)
 			{
-				u16w(tagOut, e.startPc);
-				u16w(tagOut, e.line);
+				u16w(out, e.startPc);
+				u16w(out, e.line);
 			}
-			_ASSERT(tagOut.size() < UINT32_MAX);
-			u32w(out, (uint32_t)tagOut.size());
-			out.insert(out.end(), tagOut.begin(), tagOut.end());
+			attrLenPatch(out, lenAt);
 		},
 		varcase(const CodeTagType::LOCALS&){
-			pushJutf8IdxW(out, poolSize, consts, "LocalVariableTable");
-			std::vector<uint8_t> tagOut;
+			pushKnownJutf8IdxW(out, poolSize, consts, KnownJutf8::LOCAL_VARIABLE_TABLE);
+			const size_t lenAt = attrLenPlaceholderW(out);
 
 			_ASSERT(var.size() < UINT16_MAX);
-			u16w(tagOut, (uint16_t)var.size());
+			u16w(out, (uint16_t)var.size());
 			for (const CodeTagLocalEntry& e : var)
 			{
-				u16w(tagOut, e.startPc);
-				u16w(tagOut, e.len);
-				pushJutf8IdxW(tagOut, poolSize, consts, e.name);
-				pushJutf8IdxW(tagOut, poolSize, consts, e.desc);
-				u16w(tagOut, e.idx);
+				u16w(out, e.startPc);
+				u16w(out, e.len);
+				pushJutf8IdxW(out, poolSize, consts, e.name);
+				pushJutf8IdxW(out, poolSize, consts, e.desc);
+				u16w(out, e.idx);
 			}
-			_ASSERT(tagOut.size() < UINT32_MAX);
-			u32w(out, (uint32_t)tagOut.size());
-			out.insert(out.end(), tagOut.begin(), tagOut.end());
+			attrLenPatch(out, lenAt);
 		},
 		varcase(const CodeTagType::LOCAL_TYPES&){
-			pushJutf8IdxW(out, poolSize, consts, "LocalVariableTypeTable");
-			std::vector<uint8_t> tagOut;
+			pushKnownJutf8IdxW(out, poolSize, consts, KnownJutf8::LOCAL_VARIABLE_TYPE_TABLE);
+			const size_t lenAt = attrLenPlaceholderW(out);
 
 			_ASSERT(var.size() < UINT16_MAX);
-			u16w(tagOut, (uint16_t)var.size());
+			u16w(out, (uint16_t)var.size());
 			for (const CodeTagLocalTypeEntry& e : var)
 			{
-				u16w(tagOut, e.startPc);
-				u16w(tagOut, e.len);
-				pushJutf8IdxW(tagOut, poolSize, consts, e.name);
-				pushJutf8IdxW(tagOut, poolSize, consts, e.sig);
-				u16w(tagOut, e.idx);
+				u16w(out, e.startPc);
+				u16w(out, e.len);
+				pushJutf8IdxW(out, poolSize, consts, e.name);
+				pushJutf8IdxW(out, poolSize, consts, e.sig);
+				u16w(out, e.idx);
 			}
-			_ASSERT(tagOut.size() < UINT32_MAX);
-			u32w(out, (uint32_t)tagOut.size());
-			out.insert(out.end(), tagOut.begin(), tagOut.end());
+			attrLenPatch(out, lenAt);
 		},
 		// https://docs.oracle.com/javase/specs/jvms/se24/html/jvms-4.html#jvms-4.7.4
 		varcase(const CodeTagType::STACK_FRAMES&){
-			pushJutf8IdxW(out, poolSize, consts, "StackMapTable");
-			std::vector<uint8_t> tagOut;
+			pushKnownJutf8IdxW(out, poolSize, consts, KnownJutf8::STACK_MAP_TABLE);
+			const size_t lenAt = attrLenPlaceholderW(out);
 
 			_ASSERT(var.size() < UINT16_MAX);
-			u16w(tagOut, (uint16_t)var.size());
+			u16w(out, (uint16_t)var.size());
 			for (const CodeStackFrame& frame : var)
-				codeStackFrameW(tagOut, poolSize, consts, frame);
+				codeStackFrameW(out, poolSize, consts, frame);
 
-			_ASSERT(tagOut.size() < UINT32_MAX);
-			u32w(out, (uint32_t)tagOut.size());
-			out.insert(out.end(), tagOut.begin(), tagOut.end());
+			attrLenPatch(out, lenAt);
 		}
 		);
 	}
-	inline void funcTagW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, const FuncTag& itm)
+	inline void funcTagW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const FuncTag& itm)
 	{
 		ezmatch(itm)(
 		varcase(const FuncTagType::CODE&){
-			pushJutf8IdxW(out, poolSize, consts, "Code");
-			std::vector<uint8_t> tagOut;
+			pushKnownJutf8IdxW(out, poolSize, consts, KnownJutf8::CODE);
+			const size_t lenAt = attrLenPlaceholderW(out);
 
-			u16w(tagOut, var.maxStack);
-			u16w(tagOut, var.maxLocals);
+			u16w(out, var.maxStack);
+			u16w(out, var.maxLocals);
 
 			_ASSERT(!var.bytecode.empty() && var.bytecode.size() < UINT16_MAX);
-			u32w(tagOut, (uint32_t)var.bytecode.size());
+			u32w(out, (uint32_t)var.bytecode.size());
 
-			tagOut.insert(tagOut.end(),
-				var.bytecode.begin(), 
-				var.bytecode.end());
+			bytesW(out, var.bytecode);
 
 			_ASSERT(var.errorHandlers.size() < UINT16_MAX);
-			u16w(tagOut, (uint16_t)var.errorHandlers.size());
+			u16w(out, (uint16_t)var.errorHandlers.size());
 			for (const CodeTagErrorHandler& eh : var.errorHandlers)
 			{
-				u16w(tagOut, eh.startByte);
-				u16w(tagOut, eh.afterEndByte);
-				u16w(tagOut, eh.handlerByte);
+				u16w(out, eh.startByte);
+				u16w(out, eh.afterEndByte);
+				u16w(out, eh.handlerByte);
 				if (eh.catchType.has_value())
 				{
-					pushClassIdxW(tagOut, poolSize, consts,
+					pushClassIdxW(out, poolSize, consts,
 						eh.catchType->name);
 				}
 				else
-					u16w(tagOut, 0);
+					u16w(out, 0);
 			}
 			_ASSERT(var.tags.size() < UINT16_MAX);
-			u16w(tagOut, (uint16_t)var.tags.size());
+			u16w(out, (uint16_t)var.tags.size());
 			for (const CodeTag& ct : var.tags)
-				codeTagW(tagOut, poolSize, consts, ct);
-
-			_ASSERT(tagOut.size() < UINT32_MAX);
-			u32w(out, (uint32_t)tagOut.size());
-			out.insert(out.end(), tagOut.begin(), tagOut.end());
+				codeTagW(out, poolSize, consts, ct);
 
+			attrLenPatch(out, lenAt);
 		},
 			//TODO
 		varcase(const FuncTagType::EXCEPTIONS&){
@@ -281,7 +294,7 @@ namespace cpp_jcfu
 		}
 		);
 	}
-	inline void fieldTagW(std::vector<uint8_t>& out, size_t& poolSize, ConstPool& consts, const FieldTag& itm)
+	inline void fieldTagW(ByteWriter& out, size_t& poolSize, ConstPool& consts, const FieldTag& itm)
 	{
 		ezmatch(itm)(
 			//TODO
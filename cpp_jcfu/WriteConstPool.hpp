@@ -4,7 +4,8 @@
 #pragma once
 
 #include <vector>
-#include <bit>
+#include <array>
+#include <optional>
 
 #include "State.hpp"
 #include "ext/CppMatch.hpp"
@@ -13,130 +14,178 @@
 
 namespace cpp_jcfu
 {
-	inline void constPoolW(std::vector<uint8_t>& out,ConstPool&& consts)
+	struct ConstPoolLayout
 	{
-		//https://docs.oracle.com/javase/specs/jvms/se7/html/jvms-4.html#jvms-4.4
-		//const pool
-			std::vector<uint8_t> poolOut;
-			size_t poolSize = calcConstPoolSize(consts)+1;
-
-			for (size_t i = 0; i < consts.size(); i++)
+		// Pool indices of the children of every item, 0 -> none
+		std::vector<std::array<uint16_t, 2>> children;
+		size_t byteSize = 0;//Of all the items, without the u2 count
+		uint16_t poolSize;//The count, as written in the class file
+	};
+
+	// The items that an item refers to, by index
+	// Their strings are views into the ones of e
+	constexpr std::array<std::optional<ConstPoolEntry>, 2> constPoolEntryChildren(const ConstPoolEntry& e)
+	{
+		using Ret = std::array<std::optional<ConstPoolEntry>, 2>;
+		const auto refChildren = [&e]() {
+			return Ret{ newClassEntry(e.strs[0]), newNameAndDescEntry(e.strs[1], e.strs[2]) };
+		};
+		switch (e.id)
+		{
+		case ConstPoolItmId::CLASS:
+		case ConstPoolItmId::STR:
+		case ConstPoolItmId::FUNC_TYPE:
+			return Ret{ newJutf8Entry(e.strs[0]) };
+		case ConstPoolItmId::NAME_AND_DESC:
+			return Ret{ newJutf8Entry(e.strs[0]), newJutf8Entry(e.strs[1]) };
+		case ConstPoolItmId::RUN_DYN:
+			return Ret{ newNameAndDescEntry(e.strs[0], e.strs[1]) };
+
+		case ConstPoolItmId::FIELD_REF:
+		case ConstPoolItmId::FUNC_REF:
+		case ConstPoolItmId::INTERFACE_FUNC_REF:
+			return refChildren();
+
+		case ConstPoolItmId::FUNC_HANDLE:
+		{
+			ConstPoolItmId refId = ConstPoolItmId::FUNC_REF;
+			switch ((FuncHandleKind)e.num)
 			{
-				ezmatch(consts[i])(
-					varcase(const ConstPoolItmType::CLASS&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::CLASS);
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::JUTF8(var.name));
-				},
-
-				varcase(ConstPoolItmType::FIELD_REF&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::FIELD_REF);
-
-					const ConstPoolItmType::NAME_AND_DESC refDescSteal = std::move(var.refDesc);
-
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::CLASS(var.classIdx));
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::NAME_AND_DESC(refDescSteal));
-				},
-				varcase(ConstPoolItmType::FUNC_REF&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::FUNC_REF);
-
-					const ConstPoolItmType::NAME_AND_DESC refDescSteal = std::move(var.refDesc);
-
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::CLASS(var.classIdx));
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::NAME_AND_DESC(refDescSteal));
-				},
-				varcase(ConstPoolItmType::INTERFACE_FUNC_REF&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::INTERFACE_FUNC_REF);
-
-					const ConstPoolItmType::NAME_AND_DESC refDescSteal = std::move(var.refDesc);
-
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::CLASS(var.classIdx));
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::NAME_AND_DESC(refDescSteal));
-				},
-
-				varcase(const ConstPoolItmType::STR&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::STR);
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::JUTF8(var.txt));
-				},
-				varcase(const ConstPoolItmType::I32&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::I32);
-					u32w(poolOut, var);
-				},
-				varcase(const ConstPoolItmType::I64&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::I64);
-					u64w(poolOut, var);
-				},
-				varcase(const ConstPoolItmType::F32&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::F32);
-					u32w(poolOut, std::bit_cast<uint32_t>(var));
-				},
-				varcase(const ConstPoolItmType::F64&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::F64);
-					u64w(poolOut, std::bit_cast<uint64_t>(var));
-				},
+			case FuncHandleKind::GET_FIELD:
+			case FuncHandleKind::PUT_FIELD:
+			case FuncHandleKind::GET_STATIC:
+			case FuncHandleKind::PUT_STATIC:
+				refId = ConstPoolItmId::FIELD_REF;
+				break;
+			case FuncHandleKind::RUN_INTERFACE:
+				refId = ConstPoolItmId::INTERFACE_FUNC_REF;
+				break;
+			default:
+				break;
+			}
+			return Ret{ ConstPoolEntry{ refId, 0, e.strs } };
+		}
+		default:
+			return Ret{};
+		}
+	}
+	// Size of the item in the class file, including its tag byte
+	inline size_t constPoolEntryByteSize(const ConstPoolEntry& e)
+	{
+		switch (e.id)
+		{
+		case ConstPoolItmId::I32:
+		case ConstPoolItmId::F32:
+			return 1 + 4;
+		case ConstPoolItmId::I64:
+		case ConstPoolItmId::F64:
+			return 1 + 8;
+		case ConstPoolItmId::JUTF8:
+			return 1 + 2 + utf8ToJutf8Size(e.strs[0]);
+		case ConstPoolItmId::FUNC_HANDLE:
+			return 1 + 1 + 2;
+		// Single index ones
+		case ConstPoolItmId::CLASS:
+		case ConstPoolItmId::STR:
+		case ConstPoolItmId::FUNC_TYPE:
+			return 1 + 2;
+		// Everything else is 2 u2's
+		default:
+			return 1 + 2 + 2;
+		}
+	}
 
-				varcase(ConstPoolItmType::NAME_AND_DESC&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::NAME_AND_DESC);
+	// Adds the children of every item to the pool, and figures out their indices.
+	// After this, the pool wont change anymore.
+	// layout is overwritten, but keeps its memory
+	inline void layoutConstPool(ConstPool& consts, ConstPoolLayout& layout)
+	{
+		layout.children.clear();
+		layout.children.reserve(consts.size());
+		layout.byteSize = 0;
+		size_t poolSize = calcConstPoolSize(consts) + 1;
+
+		// Children are only ever appended, so this finds the children of children too
+		for (size_t i = 0; i < consts.size(); i++)
+		{
+			// Built before pushing, as that may move the items (not the strings)
+			const std::array<std::optional<ConstPoolEntry>, 2> children = constPoolEntryChildren(consts[i]);
+
+			std::array<uint16_t, 2> childIdxs{};
+			for (size_t j = 0; j < children.size(); j++)
+			{
+				// The strings already live in the pools arena, no need to copy them
+				if (children[j].has_value())
+					childIdxs[j] = constPoolPush(poolSize, consts, *children[j], false);
+			}
+			layout.children.push_back(childIdxs);
+			layout.byteSize += constPoolEntryByteSize(consts[i]);
+		}
+		_ASSERT(poolSize < UINT16_MAX);
+		layout.poolSize = (uint16_t)poolSize;
+	}
+	inline ConstPoolLayout layoutConstPool(ConstPool& consts)
+	{
+		ConstPoolLayout layout;
+		layoutConstPool(consts, layout);
+		return layout;
+	}
 
-					const std::string descSteal = std::move(var.desc);
+	// Writes a single item, every item can be written on its own
+	// Unchecked, out must have room for constPoolEntryByteSize(e)
+	inline void constPoolEntryW(ByteWriter& out, const ConstPoolEntry& e, const std::array<uint16_t, 2>& children)
+	{
+		out.u8((uint8_t)e.id);
+		switch (e.id)
+		{
+		case ConstPoolItmId::I32:
+		case ConstPoolItmId::F32:
+			out.u32((uint32_t)e.num);
+			break;
+		case ConstPoolItmId::I64:
+		case ConstPoolItmId::F64:
+			out.u64(e.num);
+			break;
+		case ConstPoolItmId::JUTF8:
+			jUtf8W(out, e.strs[0]);
+			break;
+		case ConstPoolItmId::FUNC_HANDLE:
+			out.u8((uint8_t)e.num);
+			out.u16(children[0]);
+			break;
+		case ConstPoolItmId::RUN_DYN:
+			out.u16((uint16_t)e.num);
+			out.u16(children[0]);
+			break;
+
+		case ConstPoolItmId::CLASS:
+		case ConstPoolItmId::STR:
+		case ConstPoolItmId::FUNC_TYPE:
+			out.u16(children[0]);
+			break;
+		// NAME_AND_DESC, *_REF
+		default:
+			out.u16(children[0]);
+			out.u16(children[1]);
+			break;
+		}
+	}
+	// Only reads the pool, layout must come from layoutConstPool(consts)
+	inline void constPoolW(ByteWriter& out, const ConstPool& consts, const ConstPoolLayout& layout)
+	{
+		//https://docs.oracle.com/javase/specs/jvms/se7/html/jvms-4.html#jvms-4.4
+		//const pool
+		_ASSERT(layout.children.size() == consts.size());
 
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::JUTF8(var.name));
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::JUTF8(descSteal));
-				},
-				varcase(const ConstPoolItmType::JUTF8&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::JUTF8);
-					jUtf8W(poolOut, var);
-				},
-				varcase(const ConstPoolItmType::FUNC_HANDLE&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::FUNC_HANDLE);
-					u16w(poolOut, (uint16_t)var.kind);
-					ConstPoolItm res;
-					switch (var.kind)
-					{
-					case FuncHandleKind::GET_FIELD:
-					case FuncHandleKind::PUT_FIELD:
-					case FuncHandleKind::GET_STATIC:
-					case FuncHandleKind::PUT_STATIC:
-						res = ConstPoolItmType::FIELD_REF(var.val);
-						break;
-					case FuncHandleKind::RUN_DYN:
-					case FuncHandleKind::RUN_STATIC:
-					case FuncHandleKind::RUN_SPECIAL:
-					case FuncHandleKind::NEW_RUN_SPECIAL:
-						res = ConstPoolItmType::FUNC_REF(var.val);
-						break;
-					case FuncHandleKind::RUN_INTERFACE:
-						res = ConstPoolItmType::INTERFACE_FUNC_REF(var.val);
-						break;
-					}
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						std::move(res));
-				},
-				varcase(const ConstPoolItmType::FUNC_TYPE&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::FUNC_TYPE);
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::JUTF8(var.desc));
-				},
-				varcase(const ConstPoolItmType::RUN_DYN&) {
-					poolOut.push_back((uint8_t)ConstPoolItmId::RUN_DYN);
-					u16w(poolOut, var.bootstrapIdx);
-					constPoolIdxPushW(poolOut, poolSize, consts,
-						ConstPoolItmType::NAME_AND_DESC(var.funcDesc));
-				}
-					);
-			}
-			_ASSERT(poolSize < UINT16_MAX);
-			u16w(out, (uint16_t)poolSize);
+		out.ensure(2 + layout.byteSize);
+		out.u16(layout.poolSize);
 
-			out.insert(out.end(), poolOut.begin(), poolOut.end());
+		for (size_t i = 0; i < consts.size(); i++)
+			constPoolEntryW(out, consts[i], layout.children[i]);
+	}
+	inline void constPoolW(ByteWriter& out, ConstPool&& consts)
+	{
+		const ConstPoolLayout layout = layoutConstPool(consts);
+		constPoolW(out, consts, layout);
 	}
 }